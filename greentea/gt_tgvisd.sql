@@ -127,6 +127,7 @@ CREATE TABLE `gt_messages` (
   `created_at` datetime NOT NULL,
   `updated_at` datetime DEFAULT NULL,
   PRIMARY KEY (`id`),
+  UNIQUE KEY `chat_id_tg_msg_id` (`chat_id`,`tg_msg_id`),
   KEY `tg_msg_id` (`tg_msg_id`),
   KEY `reply_to_tg_msg_id` (`reply_to_tg_msg_id`),
   KEY `msg_type` (`msg_type`),
@@ -135,7 +136,6 @@ CREATE TABLE `gt_messages` (
   KEY `is_deleted` (`is_deleted`),
   KEY `created_at` (`created_at`),
   KEY `updated_at` (`updated_at`),
-  KEY `chat_id` (`chat_id`),
   KEY `sender_id` (`sender_id`),
   CONSTRAINT `gt_messages_ibfk_4` FOREIGN KEY (`chat_id`) REFERENCES `gt_chats` (`id`) ON DELETE CASCADE ON UPDATE CASCADE,
   CONSTRAINT `gt_messages_ibfk_6` FOREIGN KEY (`sender_id`) REFERENCES `gt_senders` (`id`) ON DELETE SET NULL ON UPDATE CASCADE
@@ -164,6 +164,18 @@ CREATE TABLE `gt_msg_fwd_info` (
 ) ENGINE=InnoDB DEFAULT CHARSET=utf8mb4 COLLATE=utf8mb4_unicode_520_ci;
 
 
+DROP TABLE IF EXISTS `gt_scrape_state`;
+CREATE TABLE `gt_scrape_state` (
+  `tg_chat_id` bigint NOT NULL,
+  `oldest_tg_msg_id` bigint unsigned NOT NULL,
+  `newest_tg_msg_id` bigint unsigned NOT NULL,
+  `backfill_done` enum('0','1') CHARACTER SET utf8mb4 COLLATE utf8mb4_general_ci NOT NULL DEFAULT '0',
+  `covered_ranges` mediumtext CHARACTER SET ascii COLLATE ascii_bin,
+  `updated_at` datetime NOT NULL,
+  PRIMARY KEY (`tg_chat_id`)
+) ENGINE=InnoDB DEFAULT CHARSET=utf8mb4 COLLATE=utf8mb4_unicode_520_ci;
+
+
 DROP TABLE IF EXISTS `gt_sender_chat`;
 CREATE TABLE `gt_sender_chat` (
   `id` int unsigned NOT NULL AUTO_INCREMENT,
@@ -278,4 +290,76 @@ CREATE TABLE `telegram_sso` (
 ) ENGINE=InnoDB DEFAULT CHARSET=utf8mb4 COLLATE=utf8mb4_unicode_520_ci;
 
 
+DROP PROCEDURE IF EXISTS `gt_save_text_message`;
+DELIMITER ;;
+CREATE PROCEDURE `gt_save_text_message`(
+  IN `p_chat_id` bigint unsigned,
+  IN `p_sender_id` bigint unsigned,
+  IN `p_tg_msg_id` bigint unsigned,
+  IN `p_reply_to_tg_msg_id` bigint unsigned,
+  IN `p_is_edited` tinyint,
+  IN `p_text` text CHARACTER SET utf8mb4,
+  IN `p_text_entities` text CHARACTER SET utf8mb4,
+  IN `p_tg_date` datetime,
+  IN `p_is_forwarded` tinyint,
+  IN `p_fwd_sender_id` bigint unsigned,
+  IN `p_fwd_tg_date` datetime,
+  IN `p_fwd_psa_type` text CHARACTER SET utf8mb4,
+  IN `p_fwd_from_tg_chat_id` bigint,
+  IN `p_fwd_from_tg_msg_id` bigint,
+  IN `p_fwd_sender_name` varchar(255) CHARACTER SET utf8mb4,
+  IN `p_fwd_author_signature` varchar(255) CHARACTER SET utf8mb4,
+  IN `p_fwd_extra` text CHARACTER SET utf8mb4
+)
+BEGIN
+  DECLARE `v_id` bigint unsigned;
+  DECLARE `v_is_new` tinyint;
+
+  DECLARE EXIT HANDLER FOR SQLEXCEPTION
+  BEGIN
+    ROLLBACK;
+    RESIGNAL;
+  END;
+
+  START TRANSACTION;
+
+  INSERT INTO `gt_messages`
+    (`chat_id`, `sender_id`, `tg_msg_id`, `reply_to_tg_msg_id`, `msg_type`,
+     `has_edited_msg`, `is_forwarded_msg`, `is_deleted`, `created_at`,
+     `updated_at`)
+  VALUES
+    (`p_chat_id`, `p_sender_id`, `p_tg_msg_id`, `p_reply_to_tg_msg_id`, 'text',
+     IF(`p_is_edited`, '1', '0'), IF(`p_is_forwarded`, '1', '0'), '0', NOW(),
+     NULL)
+  ON DUPLICATE KEY UPDATE `id` = LAST_INSERT_ID(`id`);
+
+  SET `v_is_new` = (ROW_COUNT() = 1);
+  SET `v_id` = LAST_INSERT_ID();
+
+  IF `v_is_new` THEN
+    IF `p_is_forwarded` THEN
+      INSERT INTO `gt_msg_fwd_info`
+        (`message_id`, `sender_id`, `tg_date`,
+         `public_service_announcement_type`, `from_tg_chat_id`,
+         `from_tg_msg_id`, `sender_name`, `author_signature`, `extra`)
+      VALUES
+        (`v_id`, `p_fwd_sender_id`, `p_fwd_tg_date`, `p_fwd_psa_type`,
+         `p_fwd_from_tg_chat_id`, `p_fwd_from_tg_msg_id`, `p_fwd_sender_name`,
+         `p_fwd_author_signature`, `p_fwd_extra`);
+    END IF;
+
+    INSERT INTO `gt_message_content`
+      (`message_id`, `text`, `text_entities`, `is_edited_msg`, `tg_date`,
+       `created_at`)
+    VALUES
+      (`v_id`, `p_text`, `p_text_entities`, IF(`p_is_edited`, '1', '0'),
+       `p_tg_date`, NOW());
+  END IF;
+
+  COMMIT;
+
+  SELECT `v_id` AS `id`, `v_is_new` AS `is_new`;
+END;;
+DELIMITER ;
+
 -- 2022-01-05 15:48:42
@@ -0,0 +1,25 @@
+-- SPDX-License-Identifier: GPL-2.0-only
+--
+-- Make (chat_id, tg_msg_id) unique in gt_messages.
+--
+-- The logger relies on this key to save messages with
+-- INSERT ... ON DUPLICATE KEY UPDATE / INSERT IGNORE instead of
+-- SELECT-then-INSERT.
+--
+-- Duplicates created by the old code path are removed first, the
+-- lowest id wins. Their gt_message_content and gt_msg_fwd_info rows
+-- go away with them through ON DELETE CASCADE.
+--
+
+SET NAMES utf8mb4;
+
+DELETE `m1` FROM `gt_messages` `m1`
+INNER JOIN `gt_messages` `m2`
+  ON  `m1`.`chat_id` = `m2`.`chat_id`
+  AND `m1`.`tg_msg_id` = `m2`.`tg_msg_id`
+  AND `m1`.`id` > `m2`.`id`;
+
+-- The new key also serves the chat_id foreign key.
+ALTER TABLE `gt_messages`
+  ADD UNIQUE KEY `chat_id_tg_msg_id` (`chat_id`, `tg_msg_id`),
+  DROP KEY `chat_id`;
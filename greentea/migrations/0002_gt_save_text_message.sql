@@ -0,0 +1,89 @@
+-- SPDX-License-Identifier: GPL-2.0-only
+--
+-- Save a text message with a single CALL.
+--
+-- With TGVISD_MYSQL_SAVE_MODE=proc, the logger saves gt_messages,
+-- gt_msg_fwd_info and gt_message_content through this procedure in
+-- one client/server round trip instead of one per statement plus
+-- the transaction control.
+--
+-- It returns one row (id, is_new). id is the gt_messages primary
+-- key, is_new is 0 if the message was already there, in which case
+-- nothing else is written.
+--
+-- Needs 0001_gt_messages_chat_tg_msg_id.sql.
+--
+
+SET NAMES utf8mb4;
+
+DROP PROCEDURE IF EXISTS `gt_save_text_message`;
+DELIMITER ;;
+CREATE PROCEDURE `gt_save_text_message`(
+  IN `p_chat_id` bigint unsigned,
+  IN `p_sender_id` bigint unsigned,
+  IN `p_tg_msg_id` bigint unsigned,
+  IN `p_reply_to_tg_msg_id` bigint unsigned,
+  IN `p_is_edited` tinyint,
+  IN `p_text` text CHARACTER SET utf8mb4,
+  IN `p_text_entities` text CHARACTER SET utf8mb4,
+  IN `p_tg_date` datetime,
+  IN `p_is_forwarded` tinyint,
+  IN `p_fwd_sender_id` bigint unsigned,
+  IN `p_fwd_tg_date` datetime,
+  IN `p_fwd_psa_type` text CHARACTER SET utf8mb4,
+  IN `p_fwd_from_tg_chat_id` bigint,
+  IN `p_fwd_from_tg_msg_id` bigint,
+  IN `p_fwd_sender_name` varchar(255) CHARACTER SET utf8mb4,
+  IN `p_fwd_author_signature` varchar(255) CHARACTER SET utf8mb4,
+  IN `p_fwd_extra` text CHARACTER SET utf8mb4
+)
+BEGIN
+  DECLARE `v_id` bigint unsigned;
+  DECLARE `v_is_new` tinyint;
+
+  DECLARE EXIT HANDLER FOR SQLEXCEPTION
+  BEGIN
+    ROLLBACK;
+    RESIGNAL;
+  END;
+
+  START TRANSACTION;
+
+  INSERT INTO `gt_messages`
+    (`chat_id`, `sender_id`, `tg_msg_id`, `reply_to_tg_msg_id`, `msg_type`,
+     `has_edited_msg`, `is_forwarded_msg`, `is_deleted`, `created_at`,
+     `updated_at`)
+  VALUES
+    (`p_chat_id`, `p_sender_id`, `p_tg_msg_id`, `p_reply_to_tg_msg_id`, 'text',
+     IF(`p_is_edited`, '1', '0'), IF(`p_is_forwarded`, '1', '0'), '0', NOW(),
+     NULL)
+  ON DUPLICATE KEY UPDATE `id` = LAST_INSERT_ID(`id`);
+
+  SET `v_is_new` = (ROW_COUNT() = 1);
+  SET `v_id` = LAST_INSERT_ID();
+
+  IF `v_is_new` THEN
+    IF `p_is_forwarded` THEN
+      INSERT INTO `gt_msg_fwd_info`
+        (`message_id`, `sender_id`, `tg_date`,
+         `public_service_announcement_type`, `from_tg_chat_id`,
+         `from_tg_msg_id`, `sender_name`, `author_signature`, `extra`)
+      VALUES
+        (`v_id`, `p_fwd_sender_id`, `p_fwd_tg_date`, `p_fwd_psa_type`,
+         `p_fwd_from_tg_chat_id`, `p_fwd_from_tg_msg_id`, `p_fwd_sender_name`,
+         `p_fwd_author_signature`, `p_fwd_extra`);
+    END IF;
+
+    INSERT INTO `gt_message_content`
+      (`message_id`, `text`, `text_entities`, `is_edited_msg`, `tg_date`,
+       `created_at`)
+    VALUES
+      (`v_id`, `p_text`, `p_text_entities`, IF(`p_is_edited`, '1', '0'),
+       `p_tg_date`, NOW());
+  END IF;
+
+  COMMIT;
+
+  SELECT `v_id` AS `id`, `v_is_new` AS `is_new`;
+END;;
+DELIMITER ;
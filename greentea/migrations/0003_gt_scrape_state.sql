@@ -0,0 +1,36 @@
+-- SPDX-License-Identifier: GPL-2.0-only
+--
+-- Per-chat scrape cursors.
+--
+-- The scraper used to find where to resume a chat with an ORDER BY
+-- ... LIMIT 1 over gt_messages on every visit. It now keeps the
+-- oldest and newest stored tg_msg_id of each chat here (and in
+-- memory), and whether the chat has been scraped back to its first
+-- message.
+--
+-- The table is seeded from what gt_messages already has, running
+-- this again only widens the ranges.
+--
+
+SET NAMES utf8mb4;
+
+CREATE TABLE IF NOT EXISTS `gt_scrape_state` (
+  `tg_chat_id` bigint NOT NULL,
+  `oldest_tg_msg_id` bigint unsigned NOT NULL,
+  `newest_tg_msg_id` bigint unsigned NOT NULL,
+  `backfill_done` enum('0','1') CHARACTER SET utf8mb4 COLLATE utf8mb4_general_ci NOT NULL DEFAULT '0',
+  `updated_at` datetime NOT NULL,
+  PRIMARY KEY (`tg_chat_id`)
+) ENGINE=InnoDB DEFAULT CHARSET=utf8mb4 COLLATE=utf8mb4_unicode_520_ci;
+
+INSERT INTO `gt_scrape_state`
+  (`tg_chat_id`, `oldest_tg_msg_id`, `newest_tg_msg_id`, `backfill_done`,
+   `updated_at`)
+SELECT `g`.`tg_group_id`, MIN(`m`.`tg_msg_id`), MAX(`m`.`tg_msg_id`), '0', NOW()
+FROM `gt_messages` `m`
+INNER JOIN `gt_chat_group` `cg` ON `cg`.`chat_id` = `m`.`chat_id`
+INNER JOIN `gt_groups` `g` ON `g`.`id` = `cg`.`group_id`
+GROUP BY `g`.`tg_group_id`
+ON DUPLICATE KEY UPDATE
+  `oldest_tg_msg_id` = LEAST(`oldest_tg_msg_id`, VALUES(`oldest_tg_msg_id`)),
+  `newest_tg_msg_id` = GREATEST(`newest_tg_msg_id`, VALUES(`newest_tg_msg_id`));
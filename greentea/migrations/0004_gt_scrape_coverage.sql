@@ -0,0 +1,17 @@
+-- SPDX-License-Identifier: GPL-2.0-only
+--
+-- Per-chat scrape coverage.
+--
+-- A pair of cursors can't tell a chat scraped end to end from one
+-- with holes in the middle (the bot was down, a page failed to save).
+-- covered_ranges is the list of tg_msg_id ranges known to be complete,
+-- "lo-hi,lo-hi,...", everything between them is still to be fetched.
+--
+-- NULL means unknown, the scraper rebuilds it from gt_messages on the
+-- next start.
+--
+
+SET NAMES utf8mb4;
+
+ALTER TABLE `gt_scrape_state`
+  ADD `covered_ranges` mediumtext CHARACTER SET ascii COLLATE ascii_bin NULL AFTER `backfill_done`;
@@ -54,12 +54,24 @@ bool MySQL::connect(void) noexcept
 }
 
 
-__hot MySQLRes *MySQL::storeResult(void) noexcept
+bool MySQL::reconnect(void) noexcept
+{
+	close();
+	conn_ = mysql_init(NULL);
+	if (unlikely(!conn_))
+		return false;
+
+	if (connTimeout_)
+		mysql_options(conn_, MYSQL_OPT_CONNECT_TIMEOUT, &connTimeout_);
+
+	return connect();
+}
+
+
+static MySQLRes *wrap_result(MYSQL_RES *result) noexcept
 {
 	MySQLRes *ret;
-	MYSQL_RES *result;
 
-	result = mysql_store_result(conn_);
 	if (unlikely(!result))
 		return nullptr;
 
@@ -74,6 +86,18 @@ __hot MySQLRes *MySQL::storeResult(void) noexcept
 }
 
 
+__hot MySQLRes *MySQL::storeResult(void) noexcept
+{
+	return wrap_result(mysql_store_result(conn_));
+}
+
+
+__hot MySQLRes *MySQL::useResult(void) noexcept
+{
+	return wrap_result(mysql_use_result(conn_));
+}
+
+
 __hot MySQLStmt *MySQL::prepare(size_t bind_num, const char *q) noexcept
 {
 	return prepareLen(bind_num, q, strlen(q));
@@ -98,7 +122,7 @@ __hot MySQLStmt *MySQL::prepareLen(size_t bind_num, const char *q, size_t qlen)
 	}
 
 	try {
-		ret = new MySQLStmt(stmt, bind, q, qlen);
+		ret = new MySQLStmt(stmt, bind, q, qlen, bind_num);
 	} catch (const std::bad_alloc &e) {
 		ret = MYSQL_ERR_PTR<MySQLStmt>(-ENOMEM);
 		goto err;
@@ -114,6 +138,59 @@ err:
 }
 
 
+__hot MySQLStmt *MySQL::prepareCached(size_t bind_num, const char *q) noexcept
+{
+	return prepareCachedLen(bind_num, q, strlen(q));
+}
+
+
+__hot MySQLStmt *MySQL::prepareCachedLen(size_t bind_num, const char *q,
+					 size_t qlen) noexcept
+{
+	MySQLStmt *ret;
+
+	try {
+		auto it = stmtCache_.find(std::string_view(q, qlen));
+
+		if (likely(it != stmtCache_.end())) {
+			ret = it->second;
+			if (unlikely(ret->getBindNum() != bind_num))
+				return MYSQL_ERR_PTR<MySQLStmt>(-EINVAL);
+
+			ret->reuse();
+			return ret;
+		}
+
+		/*
+		 * The statement keeps a pointer to the query text, let
+		 * it point to the key so that the caller's buffer does
+		 * not need to outlive the call.
+		 */
+		it = stmtCache_.emplace(std::string(q, qlen), nullptr).first;
+		ret = prepareLen(bind_num, it->first.c_str(), it->first.size());
+		if (MYSQL_IS_ERR_OR_NULL<MySQLStmt>(ret)) {
+			stmtCache_.erase(it);
+			return ret;
+		}
+
+		it->second = ret;
+	} catch (const std::bad_alloc &) {
+		ret = MYSQL_ERR_PTR<MySQLStmt>(-ENOMEM);
+	}
+
+	return ret;
+}
+
+
+void MySQL::clearStmtCache(void) noexcept
+{
+	for (auto &it: stmtCache_)
+		delete it.second;
+
+	stmtCache_.clear();
+}
+
+
 MySQLStmt::~MySQLStmt(void) noexcept
 {
 	if (bind_) {
@@ -166,6 +243,209 @@ err:
 }
 
 
+__hot MySQLStmtCursor *MySQLStmt::cursor(void) noexcept
+{
+	MySQLStmtCursor *ret;
+	MYSQL_RES *meta;
+	MYSQL_BIND *bind = nullptr;
+	struct MySQLStmtCursor::col *cols = nullptr;
+	size_t nr_cols;
+	int err;
+
+	meta = mysql_stmt_result_metadata(stmt_);
+	if (unlikely(!meta))
+		return nullptr;
+
+	nr_cols = (size_t)mysql_num_fields(meta);
+	bind = (MYSQL_BIND *)calloc(nr_cols, sizeof(*bind));
+	cols = (struct MySQLStmtCursor::col *)calloc(nr_cols, sizeof(*cols));
+	if (unlikely(!bind || !cols)) {
+		ret = MYSQL_ERR_PTR<MySQLStmtCursor>(-ENOMEM);
+		goto err;
+	}
+
+	try {
+		ret = new MySQLStmtCursor(stmt_, meta, bind, cols, nr_cols);
+	} catch (const std::bad_alloc &) {
+		ret = MYSQL_ERR_PTR<MySQLStmtCursor>(-ENOMEM);
+		goto err;
+	}
+
+	/* From here on, the cursor owns everything. */
+	err = ret->bindColumns();
+	if (unlikely(err)) {
+		delete ret;
+		return MYSQL_ERR_PTR<MySQLStmtCursor>(err);
+	}
+
+	return ret;
+err:
+	free(cols);
+	free(bind);
+	mysql_free_result(meta);
+	return ret;
+}
+
+
+int MySQLStmtCursor::bindColumns(void) noexcept
+{
+	MYSQL_FIELD *fields;
+	size_t i;
+
+	fields = mysql_fetch_fields(meta_);
+	for (i = 0; i < nrCols_; i++) {
+		MYSQL_BIND *b = &bind_[i];
+		struct col *c = &cols_[i];
+
+		switch (fields[i].type) {
+		case MYSQL_TYPE_TINY:
+		case MYSQL_TYPE_SHORT:
+		case MYSQL_TYPE_INT24:
+		case MYSQL_TYPE_LONG:
+		case MYSQL_TYPE_LONGLONG:
+		case MYSQL_TYPE_YEAR:
+			b->buffer_type   = MYSQL_TYPE_LONGLONG;
+			b->buffer        = &c->i64;
+			b->is_unsigned   = !!(fields[i].flags & UNSIGNED_FLAG);
+			break;
+		case MYSQL_TYPE_FLOAT:
+		case MYSQL_TYPE_DOUBLE:
+			b->buffer_type   = MYSQL_TYPE_DOUBLE;
+			b->buffer        = &c->f64;
+			break;
+		default:
+			/*
+			 * Start small, growColumns() takes care of the
+			 * rare long value. Sizing by the declared length
+			 * would reserve 4G for a LONGTEXT.
+			 */
+			c->buflen = fields[i].length + 1;
+			if (c->buflen > 256)
+				c->buflen = 256;
+			if (c->buflen < 32)
+				c->buflen = 32;
+
+			c->buf = (char *)malloc(c->buflen);
+			if (unlikely(!c->buf))
+				return -ENOMEM;
+
+			c->is_str        = true;
+			b->buffer_type   = MYSQL_TYPE_STRING;
+			b->buffer        = c->buf;
+			b->buffer_length = c->buflen;
+			break;
+		}
+
+		b->is_null = &c->is_null;
+		b->length  = &c->len;
+		b->error   = &c->error;
+	}
+
+	if (unlikely(mysql_stmt_bind_result(stmt_, bind_)))
+		return -EIO;
+
+	return 0;
+}
+
+
+/*
+ * Some string columns didn't fit, grow their buffers and fetch them
+ * again. The new buffers are kept for the following rows.
+ */
+__cold int MySQLStmtCursor::growColumns(void) noexcept
+{
+	bool rebind = false;
+	size_t i;
+
+	for (i = 0; i < nrCols_; i++) {
+		MYSQL_BIND *b = &bind_[i];
+		struct col *c = &cols_[i];
+		unsigned long newlen;
+		char *buf;
+
+		if (!c->error)
+			continue;
+
+		if (unlikely(!c->is_str))
+			return -ERANGE;
+
+		newlen = c->buflen;
+		while (newlen <= c->len)
+			newlen *= 2;
+
+		buf = (char *)realloc(c->buf, newlen);
+		if (unlikely(!buf))
+			return -ENOMEM;
+
+		c->buf           = buf;
+		c->buflen        = newlen;
+		b->buffer        = buf;
+		b->buffer_length = newlen;
+		if (unlikely(mysql_stmt_fetch_column(stmt_, b, (unsigned int)i, 0)))
+			return -EIO;
+
+		c->error = false;
+		rebind = true;
+	}
+
+	if (rebind && unlikely(mysql_stmt_bind_result(stmt_, bind_)))
+		return -EIO;
+
+	return 0;
+}
+
+
+__hot int MySQLStmtCursor::next(void) noexcept
+{
+	int ret;
+
+	ret = mysql_stmt_fetch(stmt_);
+	if (likely(!ret))
+		return 0;
+
+	if (ret == MYSQL_NO_DATA)
+		return 1;
+
+	if (ret == MYSQL_DATA_TRUNCATED)
+		return growColumns();
+
+	return -EIO;
+}
+
+
+MySQLStmtCursor::~MySQLStmtCursor(void) noexcept
+{
+	size_t i;
+
+	/*
+	 * Rows we haven't read are discarded here, so are the result
+	 * sets after this one (a CALL ends with a status result).
+	 */
+	if (stmt_) {
+		mysql_stmt_free_result(stmt_);
+		while (!mysql_stmt_next_result(stmt_))
+			mysql_stmt_free_result(stmt_);
+	}
+
+	if (cols_) {
+		for (i = 0; i < nrCols_; i++)
+			free(cols_[i].buf);
+		free(cols_);
+		cols_ = nullptr;
+	}
+
+	if (bind_) {
+		free(bind_);
+		bind_ = nullptr;
+	}
+
+	if (meta_) {
+		mysql_free_result(meta_);
+		meta_ = nullptr;
+	}
+}
+
+
 MySQLStmtRes::~MySQLStmtRes(void) noexcept
 {
 	if (bind_) {
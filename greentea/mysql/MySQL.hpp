@@ -10,6 +10,11 @@
 #include <cstddef>
 #include <cstdint>
 #include <cstdlib>
+#include <cstring>
+#include <string>
+#include <charconv>
+#include <string_view>
+#include <unordered_map>
 #include <mysql/mysql.h>
 
 #ifndef likely
@@ -63,10 +68,38 @@ namespace mysql {
 class MySQL;
 
 
+struct stmt_cache_hash {
+	using is_transparent = void;
+
+	inline size_t operator()(std::string_view q) const noexcept
+	{
+		return std::hash<std::string_view>{}(q);
+	}
+};
+
+
+/*
+ * Decode a text protocol column, @len is the column length and
+ * doesn't need a terminating NUL. Garbage decodes as 0.
+ */
+template<typename T>
+static inline T mysql_decode_int(const char *str, size_t len) noexcept
+{
+	T ret = 0;
+
+	if (likely(str))
+		std::from_chars(str, str + len, ret);
+
+	return ret;
+}
+
+
 class MySQLRes
 {
 private:
 	MYSQL_RES *res_ = nullptr;
+	MYSQL_ROW row_ = nullptr;
+	unsigned long *lens_ = nullptr;
 
 public:
 	inline MySQLRes(MYSQL_RES *res) noexcept:
@@ -96,6 +129,53 @@ public:
 	}
 
 
+	/*
+	 * Typed row access. next() moves to the next row and returns
+	 * false at the end of the result set, or on error for a result
+	 * from useResult() (check getErrno() on the connection).
+	 *
+	 * The getters read straight from the row buffer, nothing is
+	 * allocated per row. A view is valid until the next call to
+	 * next().
+	 */
+	inline bool next(void) noexcept
+	{
+		row_ = mysql_fetch_row(res_);
+		if (unlikely(!row_))
+			return false;
+
+		lens_ = mysql_fetch_lengths(res_);
+		return true;
+	}
+
+
+	inline bool isNull(size_t i) noexcept
+	{
+		return !row_[i];
+	}
+
+
+	inline std::string_view getString(size_t i) noexcept
+	{
+		if (unlikely(!row_[i]))
+			return std::string_view();
+
+		return std::string_view(row_[i], lens_[i]);
+	}
+
+
+	inline int64_t getInt64(size_t i) noexcept
+	{
+		return mysql_decode_int<int64_t>(row_[i], lens_[i]);
+	}
+
+
+	inline uint64_t getUInt64(size_t i) noexcept
+	{
+		return mysql_decode_int<uint64_t>(row_[i], lens_[i]);
+	}
+
+
 	inline MYSQL_RES *getRes(void) noexcept
 	{
 		return res_;
@@ -168,6 +248,129 @@ public:
 };
 
 
+/*
+ * Binary protocol row cursor over an executed statement.
+ *
+ * Integer columns are fetched straight into an int64_t, floating
+ * point ones into a double, everything else as a string into a per
+ * column buffer that only grows when a longer value shows up. Rows
+ * are read from the wire one at a time (the result is not stored
+ * client side), so memory use doesn't depend on the number of rows.
+ *
+ * While a cursor is open, the connection can't run anything else.
+ * Only the first result set is read, the ones after it (e.g. from a
+ * stored procedure) are skipped when the cursor is deleted.
+ */
+class MySQLStmtCursor
+{
+public:
+	struct col {
+		union {
+			int64_t		i64;
+			double		f64;
+		};
+		char			*buf;
+		unsigned long		buflen;
+		unsigned long		len;
+		bool			is_null;
+		bool			error;
+		bool			is_str;
+	};
+
+private:
+	MYSQL_STMT *stmt_ = nullptr;
+	MYSQL_RES *meta_ = nullptr;
+	MYSQL_BIND *bind_ = nullptr;
+	struct col *cols_ = nullptr;
+	size_t nrCols_ = 0;
+
+	int bindColumns(void) noexcept;
+	int growColumns(void) noexcept;
+
+	friend class MySQLStmt;
+
+public:
+	~MySQLStmtCursor(void) noexcept;
+
+
+	inline MySQLStmtCursor(MYSQL_STMT *stmt, MYSQL_RES *meta, MYSQL_BIND *bind,
+			       struct col *cols, size_t nr_cols) noexcept:
+		stmt_(stmt),
+		meta_(meta),
+		bind_(bind),
+		cols_(cols),
+		nrCols_(nr_cols)
+	{
+	}
+
+
+	/*
+	 * Returns 0 when a row has been fetched, 1 at the end of the
+	 * result set or -EIO on error (see MySQLStmt::getError()).
+	 */
+	int next(void) noexcept;
+
+
+	inline size_t numFields(void) noexcept
+	{
+		return nrCols_;
+	}
+
+
+	inline bool isNull(size_t i) noexcept
+	{
+		return cols_[i].is_null;
+	}
+
+
+	inline int64_t getInt64(size_t i) noexcept
+	{
+		const struct col *c = &cols_[i];
+
+		if (unlikely(c->is_null))
+			return 0;
+		if (unlikely(c->is_str))
+			return mysql_decode_int<int64_t>(c->buf, c->len);
+
+		return c->i64;
+	}
+
+
+	inline uint64_t getUInt64(size_t i) noexcept
+	{
+		const struct col *c = &cols_[i];
+
+		if (unlikely(c->is_null))
+			return 0;
+		if (unlikely(c->is_str))
+			return mysql_decode_int<uint64_t>(c->buf, c->len);
+
+		return (uint64_t) c->i64;
+	}
+
+
+	inline double getDouble(size_t i) noexcept
+	{
+		return cols_[i].is_null ? 0.0 : cols_[i].f64;
+	}
+
+
+	/*
+	 * Only for columns fetched as strings, empty otherwise. The
+	 * view is valid until the next call to next().
+	 */
+	inline std::string_view getString(size_t i) noexcept
+	{
+		const struct col *c = &cols_[i];
+
+		if (unlikely(c->is_null || !c->is_str))
+			return std::string_view();
+
+		return std::string_view(c->buf, c->len);
+	}
+};
+
+
 class MySQLStmt
 {
 private:
@@ -175,27 +378,60 @@ private:
 	MYSQL_BIND *bind_ = nullptr;
 	const char *q_ = nullptr;
 	size_t qlen_ = 0;
+	size_t bindNum_ = 0;
+	bool prepared_ = false;
 
 public:
 	~MySQLStmt(void) noexcept;
 	MySQLStmtRes *storeResult(size_t bind_res_num) noexcept;
 
+	/*
+	 * Open a row cursor after execute(). Returns NULL if the
+	 * statement has no result set. The caller deletes the cursor
+	 * before running the statement again.
+	 */
+	MySQLStmtCursor *cursor(void) noexcept;
+
 	inline MySQLStmt(MYSQL_STMT *stmt, MYSQL_BIND *bind, const char *q,
-			 size_t qlen) noexcept:
+			 size_t qlen, size_t bind_num) noexcept:
 		stmt_(stmt),
 		bind_(bind),
 		q_(q),
-		qlen_(qlen)
+		qlen_(qlen),
+		bindNum_(bind_num)
 	{
 	}
 
 
+	inline size_t getBindNum(void) noexcept
+	{
+		return bindNum_;
+	}
+
+
+	/*
+	 * Make a cached statement ready for the next user. This is
+	 * client side only, no round trip to the server.
+	 */
+	inline void reuse(void) noexcept
+	{
+		mysql_stmt_free_result(stmt_);
+		memset(bind_, 0, bindNum_ * sizeof(*bind_));
+	}
+
+
 	inline uint64_t getInsertId(void)
 	{
 		return mysql_stmt_insert_id(stmt_);
 	}
 
 
+	inline uint64_t getAffectedRows(void)
+	{
+		return mysql_stmt_affected_rows(stmt_);
+	}
+
+
 	inline const char *getError(void) noexcept
 	{
 		return mysql_stmt_error(stmt_);
@@ -208,9 +444,21 @@ public:
 	}
 
 
+	/*
+	 * Prepare the statement on the server. A statement that has
+	 * been prepared before (i.e. it comes from the statement
+	 * cache) is not prepared again.
+	 */
 	inline int stmtInit(void) noexcept
 	{
-		return mysql_stmt_prepare(stmt_, q_, qlen_);
+		int ret;
+
+		if (prepared_)
+			return 0;
+
+		ret = mysql_stmt_prepare(stmt_, q_, qlen_);
+		prepared_ = !ret;
+		return ret;
 	}
 
 
@@ -232,6 +480,23 @@ public:
 	}
 
 
+	/*
+	 * Bind the parameters from a caller owned array instead of
+	 * the statement's own. The values it points to must be kept
+	 * until execute().
+	 */
+	inline int bindStmt(MYSQL_BIND *bind) noexcept
+	{
+		return mysql_stmt_bind_param(stmt_, bind);
+	}
+
+
+	inline MYSQL_BIND *getBind(size_t i) noexcept
+	{
+		return &bind_[i];
+	}
+
+
 	inline int execute(void) noexcept
 	{
 		return mysql_stmt_execute(stmt_);
@@ -248,6 +513,17 @@ private:
 	const char *passwd_ = nullptr;
 	const char *dbname_ = nullptr;
 	uint16_t port_ = 0;
+	unsigned int connTimeout_ = 0;
+
+	/*
+	 * Prepared statements owned by this connection, keyed by the
+	 * query text. They are only valid as long as the connection
+	 * is, close() frees them.
+	 */
+	std::unordered_map<std::string, MySQLStmt *, stmt_cache_hash,
+			   std::equal_to<>> stmtCache_;
+
+	void clearStmtCache(void) noexcept;
 
 public:
 	MySQL(void) = default;
@@ -258,11 +534,43 @@ public:
 		  const char *dbname);
 
 	bool connect(void) noexcept;
+
+	/*
+	 * Drop the connection and connect again with the parameters
+	 * given to init(), setPort() and setConnectTimeout().
+	 */
+	bool reconnect(void) noexcept;
+
 	MySQLRes *storeResult(void) noexcept;
 
+	/*
+	 * Like storeResult(), but rows are read from the wire as they
+	 * are fetched instead of being buffered client side first. The
+	 * connection can't run anything else until the result is freed.
+	 */
+	MySQLRes *useResult(void) noexcept;
+
 	MySQLStmt *prepare(size_t bind_num, const char *q) noexcept;
 	MySQLStmt *prepareLen(size_t bind_num, const char *q, size_t qlen) noexcept;
 
+	/*
+	 * Same as prepare(), but the statement is owned by the
+	 * connection and is reused by the next call with the same
+	 * query text. Calling stmtInit() on a reused statement is a
+	 * no-op, so hot statements cost a single execute round trip.
+	 *
+	 * The caller must NOT delete the returned statement.
+	 */
+	MySQLStmt *prepareCached(size_t bind_num, const char *q) noexcept;
+	MySQLStmt *prepareCachedLen(size_t bind_num, const char *q,
+				    size_t qlen) noexcept;
+
+	inline size_t getStmtCacheSize(void) noexcept
+	{
+		return stmtCache_.size();
+	}
+
+
 	inline int beginTransaction(void)
 	{
 		static constexpr char q[] = "START TRANSACTION;";
@@ -295,8 +603,43 @@ public:
 	}
 
 
+	/*
+	 * Non-blocking variants. They return NET_ASYNC_NOT_READY until
+	 * the socket (getFd()) made enough progress, the caller then
+	 * calls them again with the same arguments. See Reactor.
+	 */
+	__hot inline enum net_async_status realQueryNonblocking(const char *q,
+								unsigned long len) noexcept
+	{
+		return mysql_real_query_nonblocking(conn_, q, len);
+	}
+
+
+	__hot inline enum net_async_status storeResultNonblocking(MYSQL_RES **res) noexcept
+	{
+		return mysql_store_result_nonblocking(conn_, res);
+	}
+
+
+	inline int getFd(void) noexcept
+	{
+		return likely(conn_) ? (int) conn_->net.fd : -1;
+	}
+
+
+	/*
+	 * Number of columns of the last query, tells whether a NULL
+	 * result from storeResult() is an error or just no rows.
+	 */
+	inline unsigned int getFieldCount(void) noexcept
+	{
+		return mysql_field_count(conn_);
+	}
+
+
 	inline void close(void) noexcept
 	{
+		clearStmtCache();
 		if (likely(conn_)) {
 			mysql_close(conn_);
 			conn_ = nullptr;
@@ -310,6 +653,17 @@ public:
 	}
 
 
+	/*
+	 * Bound the time connect() may hang on an unreachable server.
+	 * Call it after init(), before connect().
+	 */
+	inline int setConnectTimeout(unsigned int sec) noexcept
+	{
+		connTimeout_ = sec;
+		return mysql_options(conn_, MYSQL_OPT_CONNECT_TIMEOUT, &sec);
+	}
+
+
 	inline ~MySQL(void) noexcept
 	{
 		this->close();
@@ -322,6 +676,12 @@ public:
 	}
 
 
+	inline uint64_t getAffectedRows(void) noexcept
+	{
+		return mysql_affected_rows(conn_);
+	}
+
+
 	inline MYSQL *getConn(void) noexcept
 	{
 		return conn_;
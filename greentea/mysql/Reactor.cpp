@@ -0,0 +1,477 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Copyright (C) 2022  Ammar Faizi <ammarfaizi2@gmail.com>
+ */
+
+#include "Reactor.hpp"
+#include <chrono>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdexcept>
+#include <mysql/errmsg.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+
+namespace mysql {
+
+
+enum {
+	RCONN_IDLE  = 0,
+	RCONN_QUERY = 1,
+	RCONN_STORE = 2,
+};
+
+
+/* Between two reconnect attempts of the same connection. */
+static constexpr int64_t RCONN_RETRY_MS = 1000;
+
+
+static int64_t reactor_now_ms(void)
+{
+	using namespace std::chrono;
+
+	return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+
+Reactor::Reactor(void)
+{
+	struct epoll_event ev;
+
+	epfd_ = epoll_create1(EPOLL_CLOEXEC);
+	if (unlikely(epfd_ < 0))
+		throw std::runtime_error("Cannot create epoll fd");
+
+	evfd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (unlikely(evfd_ < 0)) {
+		::close(epfd_);
+		throw std::runtime_error("Cannot create eventfd");
+	}
+
+	/* data.ptr == NULL tells the eventfd apart from connections. */
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = nullptr;
+	if (unlikely(epoll_ctl(epfd_, EPOLL_CTL_ADD, evfd_, &ev))) {
+		::close(evfd_);
+		::close(epfd_);
+		throw std::runtime_error("Cannot add eventfd to epoll");
+	}
+}
+
+
+Reactor::~Reactor(void)
+{
+	stop();
+
+	for (auto c: conns_)
+		delete c;
+
+	::close(evfd_);
+	::close(epfd_);
+}
+
+
+int Reactor::addConnection(MySQL *db) noexcept
+{
+	struct epoll_event ev;
+	struct rconn *c;
+	int fd;
+
+	if (unlikely(thread_))
+		return -EBUSY;
+
+	fd = db->getFd();
+	if (unlikely(fd < 0))
+		return -ENOTCONN;
+
+	try {
+		c = new struct rconn;
+		conns_.reserve(conns_.size() + 1);
+		idle_.reserve(conns_.size() + 1);
+	} catch (const std::bad_alloc &) {
+		return -ENOMEM;
+	}
+
+	c->db      = db;
+	c->fd      = fd;
+	c->state   = RCONN_IDLE;
+	c->events  = 0;
+	c->revents = 0;
+	c->op      = nullptr;
+	c->broken  = false;
+	c->retry_at_ms = 0;
+
+	/*
+	 * Registered disarmed. EPOLLONESHOT also keeps a hang up on an
+	 * idle connection from being reported over and over.
+	 */
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLONESHOT;
+	ev.data.ptr = c;
+	if (unlikely(epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev))) {
+		delete c;
+		return -errno;
+	}
+
+	conns_.push_back(c);
+	idle_.push_back(c);
+	return 0;
+}
+
+
+int Reactor::start(void) noexcept
+{
+	if (unlikely(thread_))
+		return -EBUSY;
+
+	if (unlikely(conns_.empty()))
+		return -EINVAL;
+
+	try {
+		thread_ = new std::thread([this]{
+			this->run();
+		});
+	} catch (const std::exception &) {
+		thread_ = nullptr;
+		return -ENOMEM;
+	}
+
+#if defined(__linux__)
+	pthread_setname_np(thread_->native_handle(), "mysql-reactor");
+#endif
+	return 0;
+}
+
+
+void Reactor::stop(void) noexcept
+{
+	uint64_t val = 1;
+
+	lock_.lock();
+	stop_ = true;
+	lock_.unlock();
+
+	if (!thread_) {
+		cancelAll();
+		return;
+	}
+
+	if (unlikely(write(evfd_, &val, sizeof(val)) < 0))
+		perror("write(evfd_)");
+
+	thread_->join();
+	delete thread_;
+	thread_ = nullptr;
+}
+
+
+__hot int Reactor::submit(const char *q, size_t qlen, reactor_cb_t cb) noexcept
+{
+	uint64_t val = 1;
+	struct rop *op;
+
+	try {
+		op = new struct rop;
+		op->q.assign(q, qlen);
+		op->cb = std::move(cb);
+	} catch (const std::bad_alloc &) {
+		return -ENOMEM;
+	}
+
+	lock_.lock();
+	if (unlikely(stop_)) {
+		lock_.unlock();
+		delete op;
+		return -ECANCELED;
+	}
+
+	try {
+		pending_.push_back(op);
+	} catch (const std::bad_alloc &) {
+		lock_.unlock();
+		delete op;
+		return -ENOMEM;
+	}
+	nrSubmitted_.fetch_add(1, std::memory_order_relaxed);
+	lock_.unlock();
+
+	if (unlikely(write(evfd_, &val, sizeof(val)) < 0))
+		perror("write(evfd_)");
+
+	return 0;
+}
+
+
+void Reactor::drainEventFd(void)
+{
+	uint64_t val;
+
+	while (read(evfd_, &val, sizeof(val)) > 0)
+		;
+}
+
+
+__hot void Reactor::run(void)
+{
+	struct epoll_event evs[64];
+	int i, n;
+
+	while (!stop_) {
+		n = epoll_wait(epfd_, evs, 64, -1);
+		if (unlikely(n < 0)) {
+			if (errno == EINTR)
+				continue;
+
+			perror("epoll_wait");
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			struct rconn *c = (struct rconn *)evs[i].data.ptr;
+
+			if (!c) {
+				drainEventFd();
+				continue;
+			}
+
+			/*
+			 * Nothing is expected from an idle connection,
+			 * the server hung up (wait_timeout, restart).
+			 */
+			if (unlikely(!c->op)) {
+				c->broken = true;
+				continue;
+			}
+
+			c->revents = evs[i].events;
+			step(c);
+		}
+
+		dispatch();
+	}
+
+	cancelAll();
+}
+
+
+/*
+ * Hand queued queries to idle connections.
+ */
+__hot void Reactor::dispatch(void)
+{
+	struct rconn *c;
+	struct rop *op;
+
+	lock_.lock();
+	while (!idle_.empty() && !pending_.empty()) {
+		op = pending_.front();
+		pending_.pop_front();
+		c = idle_.back();
+		idle_.pop_back();
+		lock_.unlock();
+
+		c->op = op;
+		if (unlikely(c->broken) && !revive(c)) {
+			complete(c, nullptr, -ENOTCONN);
+			lock_.lock();
+			continue;
+		}
+
+		c->state   = RCONN_QUERY;
+		c->events  = 0;
+		c->revents = 0;
+		step(c);
+
+		lock_.lock();
+	}
+	lock_.unlock();
+}
+
+
+/*
+ * Drive the statement on @c as far as the socket allows.
+ */
+__hot void Reactor::step(struct rconn *c)
+{
+	enum net_async_status st;
+	MYSQL_RES *res = nullptr;
+	MySQLRes *ret;
+
+	switch (c->state) {
+	case RCONN_QUERY:
+		st = c->db->realQueryNonblocking(c->op->q.c_str(),
+						 c->op->q.size());
+		if (st == NET_ASYNC_NOT_READY)
+			goto wait;
+		if (unlikely(st == NET_ASYNC_ERROR)) {
+			complete(c, nullptr, -EIO);
+			return;
+		}
+
+		c->state   = RCONN_STORE;
+		c->events  = 0;
+		c->revents = 0;
+		[[fallthrough]];
+	case RCONN_STORE:
+		st = c->db->storeResultNonblocking(&res);
+		if (st == NET_ASYNC_NOT_READY)
+			goto wait;
+		if (unlikely(st == NET_ASYNC_ERROR) ||
+		    unlikely(!res && c->db->getFieldCount())) {
+			complete(c, nullptr, -EIO);
+			return;
+		}
+
+		if (!res) {
+			complete(c, nullptr, 0);
+			return;
+		}
+
+		try {
+			ret = new MySQLRes(res);
+		} catch (const std::bad_alloc &) {
+			mysql_free_result(res);
+			complete(c, nullptr, -ENOMEM);
+			return;
+		}
+
+		complete(c, ret, 0);
+		return;
+	default:
+		return;
+	}
+
+wait:
+	arm(c);
+}
+
+
+/*
+ * The client library doesn't tell which direction it is waiting
+ * for. Start a phase waiting for both. If a wake up for writability
+ * alone didn't get us any further, the query is out and we are
+ * waiting for the server, so only wait for readability from then on.
+ */
+void Reactor::arm(struct rconn *c)
+{
+	struct epoll_event ev;
+	uint32_t want;
+
+	if (!c->events)
+		want = EPOLLIN | EPOLLOUT;
+	else if (!(c->revents & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+		want = EPOLLIN;
+	else
+		want = c->events;
+
+	c->events = want;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = want | EPOLLONESHOT;
+	ev.data.ptr = c;
+	if (unlikely(epoll_ctl(epfd_, EPOLL_CTL_MOD, c->fd, &ev))) {
+		perror("epoll_ctl");
+		complete(c, nullptr, -EIO);
+	}
+}
+
+
+/*
+ * Reconnect a connection the server dropped and register its new
+ * socket. Returns false if it is still down.
+ */
+__cold bool Reactor::revive(struct rconn *c)
+{
+	struct epoll_event ev;
+	int64_t now;
+
+	now = reactor_now_ms();
+	if (now < c->retry_at_ms)
+		return false;
+
+	/* Closing the socket would drop it from epoll, but be explicit. */
+	if (c->fd >= 0)
+		epoll_ctl(epfd_, EPOLL_CTL_DEL, c->fd, NULL);
+	c->fd = -1;
+
+	if (unlikely(!c->db->reconnect())) {
+		c->retry_at_ms = now + RCONN_RETRY_MS;
+		return false;
+	}
+
+	c->fd = c->db->getFd();
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLONESHOT;
+	ev.data.ptr = c;
+	if (unlikely(epoll_ctl(epfd_, EPOLL_CTL_ADD, c->fd, &ev))) {
+		perror("epoll_ctl");
+		c->retry_at_ms = now + RCONN_RETRY_MS;
+		return false;
+	}
+
+	c->broken = false;
+	c->retry_at_ms = 0;
+	return true;
+}
+
+
+void Reactor::complete(struct rconn *c, MySQLRes *res, int ret)
+{
+	struct rop *op = c->op;
+	MySQL *db = c->db;
+	unsigned int err;
+
+	if (unlikely(ret == -EIO)) {
+		err = db->getErrno();
+		if (err == CR_SERVER_GONE_ERROR || err == CR_SERVER_LOST)
+			c->broken = true;
+	} else if (unlikely(ret == -ENOTCONN)) {
+		db = nullptr;
+	}
+
+	c->op    = nullptr;
+	c->state = RCONN_IDLE;
+	idle_.push_back(c);
+
+	nrCompleted_.fetch_add(1, std::memory_order_relaxed);
+	op->cb(db, res, ret);
+	delete op;
+}
+
+
+/*
+ * Fail everything that hasn't completed. A connection caught in the
+ * middle of a statement can't be used anymore, it gets closed.
+ */
+__cold void Reactor::cancelAll(void)
+{
+	std::deque<struct rop *> tmp;
+
+	for (auto c: conns_) {
+		struct rop *op = c->op;
+
+		if (!op)
+			continue;
+
+		c->op    = nullptr;
+		c->state = RCONN_IDLE;
+		c->db->close();
+		nrCompleted_.fetch_add(1, std::memory_order_relaxed);
+		op->cb(nullptr, nullptr, -ECANCELED);
+		delete op;
+	}
+
+	lock_.lock();
+	tmp.swap(pending_);
+	lock_.unlock();
+
+	for (auto op: tmp) {
+		nrCompleted_.fetch_add(1, std::memory_order_relaxed);
+		op->cb(nullptr, nullptr, -ECANCELED);
+		delete op;
+	}
+}
+
+
+} /* namespace mysql */
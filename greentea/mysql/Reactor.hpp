@@ -0,0 +1,140 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Copyright (C) 2022  Ammar Faizi <ammarfaizi2@gmail.com>
+ */
+
+#ifndef mysql__Reactor__HPP
+#define mysql__Reactor__HPP
+
+#include <mutex>
+#include <deque>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include <functional>
+#include "MySQL.hpp"
+
+
+namespace mysql {
+
+
+/*
+ * @ret is 0 on success, -EIO if the query failed (db->getError() tells
+ * why), -ENOTCONN if the connection was lost and can't be brought back
+ * right now or -ECANCELED if the reactor is stopping (@db is NULL for
+ * the last two).
+ *
+ * The callback runs on the reactor thread and owns @res, which is NULL
+ * for statements that don't return rows. @db is only valid until the
+ * callback returns.
+ */
+typedef std::function<void(MySQL *db, MySQLRes *res, int ret)> reactor_cb_t;
+
+
+/*
+ * Runs text queries over a handful of connections using the client
+ * library's non-blocking API, all driven by a single epoll thread.
+ * Queries are queued and handed to whichever connection is idle, so
+ * many of them can be in flight without a thread parked on each.
+ *
+ * A connection still carries one statement at a time, the protocol
+ * doesn't allow more. Prepared statements have no non-blocking API,
+ * they keep using the blocking MySQLStmt.
+ */
+class Reactor
+{
+private:
+	struct rop {
+		std::string		q;
+		reactor_cb_t		cb;
+	};
+
+	struct rconn {
+		MySQL			*db;
+		int			fd;
+		uint32_t		state;
+		uint32_t		events;
+		uint32_t		revents;
+		struct rop		*op;
+
+		/*
+		 * The server went away, reconnect before the next
+		 * query. No attempt before retry_at_ms after a failed
+		 * one.
+		 */
+		bool			broken;
+		int64_t			retry_at_ms;
+	};
+
+	int				epfd_   = -1;
+	int				evfd_   = -1;
+	volatile bool			stop_   = false;
+	std::thread			*thread_ = nullptr;
+
+	/* Only touched by the reactor thread once started. */
+	std::vector<struct rconn *>	conns_;
+	std::vector<struct rconn *>	idle_;
+
+	std::mutex			lock_;
+	std::deque<struct rop *>	pending_;
+
+	std::atomic<uint64_t>		nrSubmitted_ = 0;
+	std::atomic<uint64_t>		nrCompleted_ = 0;
+
+	void run(void);
+	void dispatch(void);
+	void drainEventFd(void);
+	void step(struct rconn *c);
+	void arm(struct rconn *c);
+	void complete(struct rconn *c, MySQLRes *res, int ret);
+	bool revive(struct rconn *c);
+	void cancelAll(void);
+
+public:
+	Reactor(void);
+	~Reactor(void);
+
+	/*
+	 * @db must be connected and outlive the reactor. Connections
+	 * can only be added before start(). A connection the server
+	 * drops is reconnected with db->reconnect(), so set its connect
+	 * timeout beforehand.
+	 */
+	int addConnection(MySQL *db) noexcept;
+	int start(void) noexcept;
+	void stop(void) noexcept;
+
+	/*
+	 * Queue @q, @cb is called once it has completed. Returns 0,
+	 * -ENOMEM or -ECANCELED. On failure @cb is never called.
+	 */
+	int submit(const char *q, size_t qlen, reactor_cb_t cb) noexcept;
+
+
+	inline size_t getNrConnections(void) noexcept
+	{
+		return conns_.size();
+	}
+
+
+	/*
+	 * Submitted but not yet completed, queued or in flight.
+	 */
+	inline uint64_t getNrPending(void) noexcept
+	{
+		return nrSubmitted_.load(std::memory_order_relaxed) -
+		       nrCompleted_.load(std::memory_order_relaxed);
+	}
+
+
+	inline uint64_t getNrCompleted(void) noexcept
+	{
+		return nrCompleted_.load(std::memory_order_relaxed);
+	}
+};
+
+
+} /* namespace mysql */
+
+#endif /* #ifndef mysql__Reactor__HPP */
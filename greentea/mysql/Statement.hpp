@@ -0,0 +1,604 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Copyright (C) 2022  Ammar Faizi <ammarfaizi2@gmail.com>
+ */
+
+#ifndef mysql__Statement__HPP
+#define mysql__Statement__HPP
+
+#include <time.h>
+#include <tuple>
+#include <utility>
+#include <optional>
+#include <concepts>
+#include <type_traits>
+#include "MySQL.hpp"
+
+
+namespace mysql {
+
+
+/*
+ * A string literal usable as a template argument, so that the query
+ * text is known at compile time.
+ */
+template<size_t N>
+struct fixed_string {
+	char str[N] = {};
+
+	constexpr fixed_string(const char (&s)[N]) noexcept
+	{
+		for (size_t i = 0; i < N; i++)
+			str[i] = s[i];
+	}
+
+
+	constexpr size_t size(void) const noexcept
+	{
+		return N - 1;
+	}
+
+
+	/*
+	 * Count the '?' placeholders. Quoted strings, quoted
+	 * identifiers and comments don't count.
+	 */
+	constexpr size_t nr_params(void) const noexcept
+	{
+		size_t i, ret = 0;
+		char quote = 0;
+
+		for (i = 0; i < N - 1; i++) {
+			char c = str[i];
+
+			if (quote) {
+				if (c == '\\' && quote != '`')
+					i++;
+				else if (c == quote)
+					quote = 0;
+				continue;
+			}
+
+			if (c == '\'' || c == '"' || c == '`') {
+				quote = c;
+				continue;
+			}
+
+			if (c == '/' && str[i + 1] == '*') {
+				for (i += 2; i < N - 1; i++) {
+					if (str[i] == '*' && str[i + 1] == '/') {
+						i++;
+						break;
+					}
+				}
+				continue;
+			}
+
+			if (c == '?')
+				ret++;
+		}
+
+		return ret;
+	}
+};
+
+
+/*
+ * A bool stored in an ENUM('0', '1') column. A number assigned to an
+ * ENUM is taken as the 1-based index of the member, not its text, so
+ * '0' is sent as 1 and '1' as 2.
+ */
+struct enum01 {
+	bool	val;
+
+	constexpr enum01(bool v) noexcept:
+		val(v)
+	{
+	}
+};
+
+
+/*
+ * A Unix timestamp stored in a DATETIME column, in UTC.
+ */
+struct datetime {
+	time_t	val;
+
+	constexpr datetime(time_t v) noexcept:
+		val(v)
+	{
+	}
+};
+
+
+template<typename T>
+inline constexpr bool stmt_always_false = false;
+
+
+template<size_t N>
+static constexpr enum enum_field_types stmt_int_type(void) noexcept
+{
+	if constexpr (N == 1)
+		return MYSQL_TYPE_TINY;
+	else if constexpr (N == 2)
+		return MYSQL_TYPE_SHORT;
+	else if constexpr (N == 4)
+		return MYSQL_TYPE_LONG;
+	else
+		return MYSQL_TYPE_LONGLONG;
+}
+
+
+/*
+ * How a C++ type is sent as a statement parameter. @storage is where
+ * the value lives until the statement is executed, bind() fills
+ * @b and points it at @s.
+ */
+template<typename T>
+struct stmt_param {
+	static_assert(stmt_always_false<T>, "Unsupported statement parameter type");
+};
+
+
+template<typename T>
+	requires (std::integral<T> && !std::same_as<T, bool>)
+struct stmt_param<T> {
+	using storage = T;
+
+	static inline void bind(MYSQL_BIND *b, storage *s, T v) noexcept
+	{
+		*s = v;
+		b->buffer_type = stmt_int_type<sizeof(T)>();
+		b->buffer      = s;
+		b->is_unsigned = std::is_unsigned_v<T>;
+	}
+};
+
+
+template<>
+struct stmt_param<bool> {
+	using storage = int8_t;
+
+	static inline void bind(MYSQL_BIND *b, storage *s, bool v) noexcept
+	{
+		*s = v;
+		b->buffer_type = MYSQL_TYPE_TINY;
+		b->buffer      = s;
+	}
+};
+
+
+template<>
+struct stmt_param<enum01> {
+	using storage = int8_t;
+
+	static inline void bind(MYSQL_BIND *b, storage *s, enum01 v) noexcept
+	{
+		*s = v.val ? 2 : 1;
+		b->buffer_type = MYSQL_TYPE_TINY;
+		b->buffer      = s;
+	}
+};
+
+
+template<>
+struct stmt_param<double> {
+	using storage = double;
+
+	static inline void bind(MYSQL_BIND *b, storage *s, double v) noexcept
+	{
+		*s = v;
+		b->buffer_type = MYSQL_TYPE_DOUBLE;
+		b->buffer      = s;
+	}
+};
+
+
+/*
+ * The string is not copied, it has to stay around until the
+ * statement has been executed.
+ */
+template<>
+struct stmt_param<std::string_view> {
+	using storage = char;
+
+	static inline void bind(MYSQL_BIND *b, storage *, std::string_view v)
+		noexcept
+	{
+		b->buffer_type   = MYSQL_TYPE_STRING;
+		b->buffer        = (void *) v.data();
+		b->buffer_length = v.size();
+	}
+};
+
+
+template<>
+struct stmt_param<datetime> {
+	using storage = MYSQL_TIME;
+
+	static inline void bind(MYSQL_BIND *b, storage *s, datetime v) noexcept
+	{
+		struct tm tm;
+
+		if (unlikely(!gmtime_r(&v.val, &tm))) {
+			b->buffer_type = MYSQL_TYPE_NULL;
+			return;
+		}
+
+		memset(s, 0, sizeof(*s));
+		s->year      = (unsigned) tm.tm_year + 1900u;
+		s->month     = (unsigned) tm.tm_mon + 1u;
+		s->day       = (unsigned) tm.tm_mday;
+		s->hour      = (unsigned) tm.tm_hour;
+		s->minute    = (unsigned) tm.tm_min;
+		s->second    = (unsigned) tm.tm_sec;
+		s->time_type = MYSQL_TIMESTAMP_DATETIME;
+
+		b->buffer_type = MYSQL_TYPE_DATETIME;
+		b->buffer      = s;
+	}
+};
+
+
+/*
+ * std::nullopt is sent as NULL.
+ */
+template<typename T>
+struct stmt_param<std::optional<T>> {
+	using storage = typename stmt_param<T>::storage;
+
+	static inline void bind(MYSQL_BIND *b, storage *s,
+				const std::optional<T> &v) noexcept
+	{
+		if (v)
+			stmt_param<T>::bind(b, s, *v);
+		else
+			b->buffer_type = MYSQL_TYPE_NULL;
+	}
+};
+
+
+/*
+ * An empty string is stored as NULL.
+ */
+static inline std::optional<std::string_view> str_or_null(std::string_view s)
+	noexcept
+{
+	if (s.empty())
+		return std::nullopt;
+
+	return s;
+}
+
+
+/*
+ * How a result column is read into a C++ type.
+ */
+template<typename T>
+struct stmt_column {
+	static_assert(stmt_always_false<T>, "Unsupported statement column type");
+};
+
+
+template<typename T>
+	requires (std::integral<T> && !std::same_as<T, bool>)
+struct stmt_column<T> {
+	static inline void get(MySQLStmtCursor *cur, size_t i, T *out) noexcept
+	{
+		if constexpr (std::is_unsigned_v<T>)
+			*out = (T) cur->getUInt64(i);
+		else
+			*out = (T) cur->getInt64(i);
+	}
+};
+
+
+template<>
+struct stmt_column<bool> {
+	static inline void get(MySQLStmtCursor *cur, size_t i, bool *out)
+		noexcept
+	{
+		*out = !!cur->getInt64(i);
+	}
+};
+
+
+template<>
+struct stmt_column<double> {
+	static inline void get(MySQLStmtCursor *cur, size_t i, double *out)
+		noexcept
+	{
+		*out = cur->getDouble(i);
+	}
+};
+
+
+/*
+ * Points into the cursor's buffer, valid until the next row.
+ */
+template<>
+struct stmt_column<std::string_view> {
+	static inline void get(MySQLStmtCursor *cur, size_t i,
+			       std::string_view *out) noexcept
+	{
+		*out = cur->getString(i);
+	}
+};
+
+
+template<typename T>
+struct stmt_column<std::optional<T>> {
+	static inline void get(MySQLStmtCursor *cur, size_t i,
+			       std::optional<T> *out) noexcept
+	{
+		T tmp;
+
+		if (cur->isNull(i)) {
+			out->reset();
+			return;
+		}
+
+		stmt_column<T>::get(cur, i, &tmp);
+		*out = tmp;
+	}
+};
+
+
+/*
+ * The part of a typed statement that doesn't depend on its query,
+ * mostly error reporting.
+ */
+class StatementBase
+{
+protected:
+	MySQL *db_ = nullptr;
+	MySQLStmt *stmt_ = nullptr;
+	const char *errFunc_ = nullptr;
+	int err_ = 0;
+
+
+	inline StatementBase(MySQL *db) noexcept:
+		db_(db)
+	{
+	}
+
+
+	inline int setError(const char *func, int err) noexcept
+	{
+		errFunc_ = func;
+		err_ = err;
+		return err;
+	}
+
+public:
+	/*
+	 * The step that failed, "prepare", "stmtInit", "bindStmt",
+	 * "execute", "cursor" or "next".
+	 */
+	inline const char *getErrFunc(void) noexcept
+	{
+		return errFunc_;
+	}
+
+
+	inline int getErrno(void) noexcept
+	{
+		if (err_ != -EIO)
+			return err_;
+		if (stmt_)
+			return stmt_->getErrno();
+
+		return db_->getErrno();
+	}
+
+
+	inline const char *getError(void) noexcept
+	{
+		if (err_ != -EIO)
+			return strerror(-err_);
+		if (stmt_)
+			return stmt_->getError();
+
+		return db_->getError();
+	}
+
+
+	inline uint64_t getInsertId(void) noexcept
+	{
+		return stmt_->getInsertId();
+	}
+
+
+	inline uint64_t getAffectedRows(void) noexcept
+	{
+		return stmt_->getAffectedRows();
+	}
+};
+
+
+/*
+ * A prepared statement whose parameter types are part of its type:
+ *
+ *   mysql::Statement<"INSERT INTO `t` (`a`, `b`) VALUES (?, ?)",
+ *                    uint64_t, std::optional<std::string_view>> st(db);
+ *
+ *   if (st.execute(a, b)) ...
+ *
+ * The number of '?' has to match the number of parameter types, and
+ * a value that doesn't convert to its parameter type doesn't compile.
+ * The MYSQL_BIND array and the values it points to live in the
+ * object, the statement itself comes from the connection's statement
+ * cache, so nothing is allocated once the statement is prepared.
+ *
+ * An object is meant to be used by one caller on one connection, it
+ * lives on the stack next to the call.
+ */
+template<fixed_string Q, typename... Args>
+class Statement: public StatementBase
+{
+private:
+	static constexpr size_t nrParams_ = sizeof...(Args);
+
+	static_assert(Q.nr_params() == nrParams_,
+		      "The number of '?' doesn't match the parameter types");
+
+	MYSQL_BIND bind_[nrParams_ ? nrParams_ : 1];
+	std::tuple<typename stmt_param<Args>::storage...> store_;
+
+
+	template<size_t... I>
+	inline void bindAll(std::index_sequence<I...>, const Args &... args)
+		noexcept
+	{
+		(stmt_param<Args>::bind(&bind_[I], &std::get<I>(store_), args), ...);
+	}
+
+public:
+	inline Statement(MySQL *db) noexcept:
+		StatementBase(db)
+	{
+	}
+
+
+	/*
+	 * Returns 0 on success. On failure, getErrFunc(), getErrno()
+	 * and getError() tell what went wrong.
+	 */
+	__hot int execute(const Args &... args) noexcept
+	{
+		MySQLStmt *stmt;
+
+		stmt = db_->prepareCachedLen(nrParams_, Q.str, Q.size());
+		if (MYSQL_IS_ERR_OR_NULL<MySQLStmt>(stmt)) {
+			stmt_ = nullptr;
+			if (!stmt)
+				return setError("prepare", -EIO);
+
+			return setError("prepare", (int) MYSQL_PTR_ERR(stmt));
+		}
+
+		stmt_ = stmt;
+		if (unlikely(stmt->stmtInit()))
+			return setError("stmtInit", -EIO);
+
+		memset(bind_, 0, sizeof(bind_));
+		bindAll(std::index_sequence_for<Args...>{}, args...);
+
+		if (unlikely(stmt->bindStmt(bind_)))
+			return setError("bindStmt", -EIO);
+
+		if (unlikely(stmt->execute()))
+			return setError("execute", -EIO);
+
+		return setError(nullptr, 0);
+	}
+};
+
+
+template<typename... Cols>
+struct columns {};
+
+
+template<fixed_string Q, typename Cols, typename... Args>
+class Select;
+
+
+/*
+ * A Statement that returns rows, read through a MySQLStmtCursor:
+ *
+ *   mysql::Select<"SELECT `id`, `name` FROM `t` WHERE `a` = ?",
+ *                 mysql::columns<uint64_t, std::string_view>,
+ *                 uint64_t> st(db);
+ *
+ *   if (st.execute(a)) ...
+ *   while (!(ret = st.next(id, name))) ...
+ *
+ * The column types are checked at compile time, their number against
+ * the result set when it is opened, because only the server knows
+ * what e.g. "SELECT *" expands to.
+ */
+template<fixed_string Q, typename... Cols, typename... Args>
+class Select<Q, columns<Cols...>, Args...>: public Statement<Q, Args...>
+{
+private:
+	MySQLStmtCursor *cur_ = nullptr;
+
+
+	template<size_t... I>
+	inline void getAll(std::index_sequence<I...>, Cols &... out) noexcept
+	{
+		(stmt_column<Cols>::get(cur_, I, &out), ...);
+	}
+
+public:
+	inline Select(MySQL *db) noexcept:
+		Statement<Q, Args...>(db)
+	{
+	}
+
+
+	inline ~Select(void) noexcept
+	{
+		if (cur_)
+			delete cur_;
+	}
+
+
+	__hot int execute(const Args &... args) noexcept
+	{
+		MySQLStmtCursor *cur;
+		int ret;
+
+		if (cur_) {
+			delete cur_;
+			cur_ = nullptr;
+		}
+
+		ret = Statement<Q, Args...>::execute(args...);
+		if (unlikely(ret))
+			return ret;
+
+		cur = this->stmt_->cursor();
+		if (MYSQL_IS_ERR_OR_NULL<MySQLStmtCursor>(cur)) {
+			if (!cur)
+				return this->setError("cursor", -EINVAL);
+
+			return this->setError("cursor", (int) MYSQL_PTR_ERR(cur));
+		}
+
+		if (unlikely(cur->numFields() != sizeof...(Cols))) {
+			delete cur;
+			return this->setError("cursor", -EINVAL);
+		}
+
+		cur_ = cur;
+		return 0;
+	}
+
+
+	/*
+	 * Returns 0 when a row has been read into @out, 1 at the end of
+	 * the result set or a negative error code.
+	 */
+	__hot int next(Cols &... out) noexcept
+	{
+		int ret;
+
+		if (unlikely(!cur_))
+			return this->setError("cursor", -EINVAL);
+
+		ret = cur_->next();
+		if (unlikely(ret < 0))
+			return this->setError("next", ret);
+		if (ret)
+			return ret;
+
+		getAll(std::index_sequence_for<Cols...>{}, out...);
+		return 0;
+	}
+};
+
+
+} /* namespace mysql */
+
+#endif /* #ifndef mysql__Statement__HPP */
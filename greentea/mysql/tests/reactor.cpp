@@ -0,0 +1,200 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Copyright (C) 2022  Ammar Faizi <ammarfaizi2@gmail.com>
+ */
+
+#include <mutex>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <condition_variable>
+
+#include "MySQL.hpp"
+#include "Reactor.hpp"
+
+#define NR_CONNS	3
+#define NR_QUERIES	300
+
+#define pr_err(FMT, ...) \
+	printf(FMT " at %s %s:%d\n", __VA_ARGS__, __FILE__, __func__, __LINE__)
+
+
+struct test_ctx {
+	std::mutex		lock;
+	std::condition_variable	cond;
+	int			nr_done = 0;
+	int			nr_ok   = 0;
+	int			nr_err  = 0;
+	bool			seen[NR_QUERIES] = {};
+};
+
+
+static void wait_done(struct test_ctx *ctx, int nr)
+{
+	std::unique_lock<std::mutex> lk(ctx->lock);
+
+	ctx->cond.wait(lk, [ctx, nr]{
+		return ctx->nr_done >= nr;
+	});
+}
+
+
+static void on_select(struct test_ctx *ctx, int i, mysql::MySQL *db,
+		      mysql::MySQLRes *res, int ret)
+{
+	MYSQL_ROW row;
+
+	if (unlikely(ret)) {
+		pr_err("Error on query %d: (%d) %s", i, ret,
+		       db ? db->getError() : "cancelled");
+		goto out;
+	}
+
+	assert(res);
+	assert(res->numFields() == 2);
+	row = res->fetchRow();
+	assert(row);
+	assert(atoi(row[0]) == i);
+	assert(!strcmp(row[1], "abc"));
+	assert(!res->fetchRow());
+
+out:
+	delete res;
+	std::lock_guard<std::mutex> lk(ctx->lock);
+	ctx->nr_done++;
+	if (!ret) {
+		assert(!ctx->seen[i]);
+		ctx->seen[i] = true;
+		ctx->nr_ok++;
+	} else {
+		ctx->nr_err++;
+	}
+	ctx->cond.notify_one();
+}
+
+
+/*
+ * Many more queries than connections, all of them must come back
+ * with their own result.
+ */
+static int test_reactor_001(mysql::Reactor *r)
+{
+	struct test_ctx ctx;
+	char qbuf[128];
+	int i, qlen;
+
+	for (i = 0; i < NR_QUERIES; i++) {
+		qlen = snprintf(qbuf, sizeof(qbuf), "SELECT %d, 'abc'", i);
+		assert(!r->submit(qbuf, (size_t)qlen,
+			[&ctx, i](mysql::MySQL *db, mysql::MySQLRes *res, int ret){
+				on_select(&ctx, i, db, res, ret);
+			}));
+	}
+
+	wait_done(&ctx, NR_QUERIES);
+	assert(ctx.nr_ok == NR_QUERIES);
+	assert(ctx.nr_err == 0);
+	for (i = 0; i < NR_QUERIES; i++)
+		assert(ctx.seen[i]);
+
+	return 0;
+}
+
+
+/*
+ * A failing query must not take its connection down, nor disturb
+ * the statements that follow it.
+ */
+static int test_reactor_002(mysql::Reactor *r)
+{
+	static const char q_bad[] = "SELECT * FROM `this_table_does_not_exist_xyz`";
+	static const char q_set[] = "SET @reactor_test = 1";
+	struct test_ctx ctx;
+	int i;
+
+	for (i = 0; i < NR_CONNS * 2; i++) {
+		assert(!r->submit(q_bad, sizeof(q_bad) - 1,
+			[&ctx](mysql::MySQL *db, mysql::MySQLRes *res, int ret){
+				assert(ret == -EIO);
+				assert(db && db->getErrno());
+				assert(!res);
+				std::lock_guard<std::mutex> lk(ctx.lock);
+				ctx.nr_done++;
+				ctx.nr_err++;
+				ctx.cond.notify_one();
+			}));
+
+		/* No result set, but not an error either. */
+		assert(!r->submit(q_set, sizeof(q_set) - 1,
+			[&ctx](mysql::MySQL *, mysql::MySQLRes *res, int ret){
+				assert(!ret);
+				assert(!res);
+				std::lock_guard<std::mutex> lk(ctx.lock);
+				ctx.nr_done++;
+				ctx.nr_ok++;
+				ctx.cond.notify_one();
+			}));
+	}
+
+	wait_done(&ctx, NR_CONNS * 4);
+	assert(ctx.nr_err == NR_CONNS * 2);
+	assert(ctx.nr_ok == NR_CONNS * 2);
+	return test_reactor_001(r);
+}
+
+
+static int do_test(void)
+{
+	int i, ret = 0;
+	mysql::MySQL *db[NR_CONNS] = {};
+	mysql::Reactor *r = nullptr;
+	const char *host = getenv("TEST_MYSQL_HOST");
+	const char *user = getenv("TEST_MYSQL_USER");
+	const char *passwd = getenv("TEST_MYSQL_PASSWORD");
+	const char *dbname = getenv("TEST_MYSQL_DBNAME");
+	const char *port_str = getenv("TEST_MYSQL_PORT");
+	uint16_t port = (uint16_t)atoi(port_str ? port_str : "0");
+
+	assert(host);
+	assert(user);
+	assert(passwd);
+	assert(dbname);
+
+	try {
+		r = new mysql::Reactor;
+		for (i = 0; i < NR_CONNS; i++) {
+			db[i] = new mysql::MySQL(host, user, passwd, dbname);
+			db[i]->setPort(port);
+			if (unlikely(!db[i]->connect()))
+				throw std::runtime_error(db[i]->getError());
+			assert(!r->addConnection(db[i]));
+		}
+
+		assert(r->getNrConnections() == NR_CONNS);
+		assert(!r->start());
+		assert(r->addConnection(db[0]) == -EBUSY);
+
+		ret |= test_reactor_001(r);
+		ret |= test_reactor_002(r);
+		assert(r->getNrPending() == 0);
+
+		r->stop();
+		assert(r->submit("SELECT 1", 8, nullptr) == -ECANCELED);
+	} catch (const std::runtime_error& e) {
+		ret = 1;
+		std::cout << "Error: " << e.what() << std::endl;
+	}
+
+	delete r;
+	for (i = 0; i < NR_CONNS; i++)
+		delete db[i];
+
+	return ret;
+}
+
+
+int main(void)
+{
+	return do_test();
+}
@@ -0,0 +1,268 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Copyright (C) 2022  Ammar Faizi <ammarfaizi2@gmail.com>
+ */
+
+#include <time.h>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include "MySQL.hpp"
+
+#define QUERY_BUF_SIZE 4096
+
+#define pr_err(FMT, ...) \
+	printf(FMT " at %s %s:%d\n", __VA_ARGS__, __FILE__, __func__, __LINE__)
+
+
+static int test_stmt_cache_001_create_table(mysql::MySQL *db, int rnum)
+{
+	static const char q_create[] =
+		"CREATE TABLE `stmt_cache_%d` (" 			\
+			"`id` bigint unsigned NOT NULL AUTO_INCREMENT,"	\
+			"`username` varchar(255) NOT NULL,"		\
+			"PRIMARY KEY (`id`),"				\
+			"UNIQUE KEY `username` (`username`)"		\
+		") ENGINE=InnoDB DEFAULT CHARSET=utf8mb4;";
+
+	int ret;
+	char qbuf[QUERY_BUF_SIZE];
+
+	snprintf(qbuf, sizeof(qbuf), q_create, rnum);
+	ret = db->query(qbuf);
+	if (unlikely(ret))
+		pr_err("Error on query(): %s", db->getError());
+
+	assert(!db->storeResult());
+	return ret;
+}
+
+
+static int test_stmt_cache_001_insert_data(mysql::MySQL *db, int rnum)
+{
+	static const char q_insert[] = "INSERT INTO `stmt_cache_%d` VALUES (NULL, ?);";
+
+	int i, errret = 0;
+	const char *stmtErrFunc = nullptr;
+	mysql::MySQLStmt *stmt, *first = nullptr;
+	char qbuf[QUERY_BUF_SIZE];
+
+	snprintf(qbuf, sizeof(qbuf), q_insert, rnum);
+
+	for (i = 0; i < 30; i++) {
+		size_t la;
+		char ba[16];
+
+		/*
+		 * The query text lives in a stack buffer that we keep
+		 * scribbling on, the cache must not depend on it.
+		 */
+		stmt = db->prepareCached(1, qbuf);
+		memset(qbuf, 'x', sizeof(qbuf));
+		snprintf(qbuf, sizeof(qbuf), q_insert, rnum);
+		if (MYSQL_IS_ERR_OR_NULL<mysql::MySQLStmt>(stmt)) {
+			pr_err("Error on prepareCached(): %s", db->getError());
+			return 1;
+		}
+
+		if (!first)
+			first = stmt;
+
+		/* Every call must hand back the very same statement. */
+		assert(stmt == first);
+		assert(db->getStmtCacheSize() == 1);
+
+		if (unlikely(stmt->stmtInit())) {
+			stmtErrFunc = "stmtInit";
+			goto stmt_err;
+		}
+
+		la = (size_t) snprintf(ba, sizeof(ba), "user_%d", i);
+		assert(stmt->bind(0, MYSQL_TYPE_STRING, ba, la));
+
+		if (unlikely(stmt->bindStmt())) {
+			stmtErrFunc = "bindStmt";
+			goto stmt_err;
+		}
+
+		if (unlikely(stmt->execute())) {
+			stmtErrFunc = "execute";
+			goto stmt_err;
+		}
+
+		assert(stmt->getInsertId() == (uint64_t)(i + 1));
+	}
+
+	/* A different bind count for the same query text is a bug. */
+	stmt = db->prepareCached(2, qbuf);
+	assert(MYSQL_PTR_ERR<mysql::MySQLStmt>(stmt) == -EINVAL);
+	return 0;
+
+stmt_err:
+	errret = stmt->getErrno();
+	pr_err("Error on %s(): (%d) %s", stmtErrFunc, errret, stmt->getError());
+	return errret;
+}
+
+
+static int test_stmt_cache_001_select_data(mysql::MySQL *db, int rnum)
+{
+	static const char q_select[] = "SELECT `id`, `username` FROM `stmt_cache_%d` WHERE `username` = ?";
+
+	int i, errret = 0;
+	const char *stmtErrFunc = nullptr;
+	mysql::MySQLStmt *stmt = nullptr;
+	char qbuf[QUERY_BUF_SIZE];
+
+	snprintf(qbuf, sizeof(qbuf), q_select, rnum);
+
+	for (i = 0; i < 30; i++) {
+		bool is_null[2];
+		size_t reslen[2];
+		char buf[2][0xff];
+
+		size_t la;
+		char ba[16];
+		int nr_rows = 0;
+		mysql::MySQLStmtRes *res;
+
+		stmt = db->prepareCached(1, qbuf);
+		if (MYSQL_IS_ERR_OR_NULL<mysql::MySQLStmt>(stmt)) {
+			pr_err("Error on prepareCached(): %s", db->getError());
+			return 1;
+		}
+		assert(db->getStmtCacheSize() == 2);
+
+		if (unlikely(stmt->stmtInit())) {
+			stmtErrFunc = "stmtInit";
+			goto stmt_err;
+		}
+
+		la = (size_t) snprintf(ba, sizeof(ba), "user_%d", i);
+		stmt->bind(0, MYSQL_TYPE_STRING, ba, la);
+
+		if (unlikely(stmt->bindStmt())) {
+			stmtErrFunc = "bindStmt";
+			goto stmt_err;
+		}
+
+		if (unlikely(stmt->execute())) {
+			stmtErrFunc = "execute";
+			goto stmt_err;
+		}
+
+		res = stmt->storeResult(2);
+		assert(!MYSQL_IS_ERR_OR_NULL<mysql::MySQLStmtRes>(res));
+
+		res->bind(0, MYSQL_TYPE_STRING, buf[0], sizeof(buf[0]), &is_null[0], &reslen[0]);
+		res->bind(1, MYSQL_TYPE_STRING, buf[1], sizeof(buf[1]), &is_null[1], &reslen[1]);
+		assert(!res->bindResult());
+		assert(!res->storeResult());
+
+		/*
+		 * Only fetch the first row, the rest must be discarded
+		 * when the statement is reused.
+		 */
+		if (!res->fetchRow()) {
+			nr_rows++;
+			assert(atoi(buf[0]) == (i + 1));
+			assert(!strcmp(buf[1], ba));
+		}
+		assert(nr_rows == 1);
+
+		delete res;
+	}
+
+	return 0;
+
+stmt_err:
+	errret = stmt->getErrno();
+	pr_err("Error on %s(): (%d) %s", stmtErrFunc, errret, stmt->getError());
+	return errret;
+}
+
+
+static int test_stmt_cache_001_drop_table(mysql::MySQL *db, int rnum)
+{
+	static const char q_drop[] = "DROP TABLE `stmt_cache_%d`";
+
+	int ret;
+	char qbuf[QUERY_BUF_SIZE];
+
+	snprintf(qbuf, sizeof(qbuf), q_drop, rnum);
+	ret = db->query(qbuf);
+	if (unlikely(ret))
+		pr_err("Error on query(): %s", db->getError());
+
+	assert(!db->storeResult());
+	return ret;
+}
+
+
+static int test_stmt_cache_001(mysql::MySQL *db)
+{
+	int rnum, ret = 0;
+
+	rnum = rand();
+	ret |= test_stmt_cache_001_create_table(db, rnum);
+	if (unlikely(ret))
+		return ret;
+
+	ret |= test_stmt_cache_001_insert_data(db, rnum);
+	if (unlikely(ret))
+		goto drop_tbl;
+
+	ret |= test_stmt_cache_001_select_data(db, rnum);
+	if (unlikely(ret))
+		goto drop_tbl;
+
+drop_tbl:
+	ret |= test_stmt_cache_001_drop_table(db, rnum);
+
+	/* close() must release every cached statement. */
+	db->close();
+	assert(db->getStmtCacheSize() == 0);
+	return ret;
+}
+
+
+static int do_test(void)
+{
+	int ret = 0;
+	mysql::MySQL *db = nullptr;
+	const char *host = getenv("TEST_MYSQL_HOST");
+	const char *user = getenv("TEST_MYSQL_USER");
+	const char *passwd = getenv("TEST_MYSQL_PASSWORD");
+	const char *dbname = getenv("TEST_MYSQL_DBNAME");
+	const char *port_str = getenv("TEST_MYSQL_PORT");
+	uint16_t port = (uint16_t)atoi(port_str ? port_str : "0");
+
+	assert(host);
+	assert(user);
+	assert(passwd);
+	assert(dbname);
+
+	try {
+		db = new mysql::MySQL(host, user, passwd, dbname);
+		db->setPort(port);
+		if (unlikely(!db->connect()))
+			throw std::runtime_error(db->getError());
+
+		ret = test_stmt_cache_001(db);
+	} catch (const std::runtime_error& e) {
+		ret = 1;
+		std::cout << "Error: " << e.what() << std::endl;
+	}
+
+	delete db;
+	return ret;
+}
+
+
+int main(void)
+{
+	srand((unsigned int)time(NULL));
+	return do_test();
+}
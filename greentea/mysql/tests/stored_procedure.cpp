@@ -0,0 +1,211 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Copyright (C) 2022  Ammar Faizi <ammarfaizi2@gmail.com>
+ */
+
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include "MySQL.hpp"
+#include "Statement.hpp"
+
+#define NR_ROWS		200
+
+#define pr_err(FMT, ...) \
+	printf(FMT " at %s %s:%d\n", __VA_ARGS__, __FILE__, __func__, __LINE__)
+
+
+static int test_proc_query(mysql::MySQL *db, const char *q)
+{
+	int ret;
+
+	ret = db->query(q);
+	if (unlikely(ret))
+		pr_err("Error on query(): %s", db->getError());
+
+	assert(!db->storeResult());
+	return ret;
+}
+
+
+static int test_proc_001_create(mysql::MySQL *db)
+{
+	static const char q_create_tbl[] =
+		"CREATE TABLE `stored_procedure` ("			\
+			"`id` bigint unsigned NOT NULL AUTO_INCREMENT,"	\
+			"`k` bigint unsigned NOT NULL,"			\
+			"`v` varchar(32) DEFAULT NULL,"			\
+			"PRIMARY KEY (`id`),"				\
+			"UNIQUE KEY `k` (`k`)"				\
+		") ENGINE=InnoDB DEFAULT CHARSET=utf8mb4;";
+
+	static const char q_create_proc[] =
+		"CREATE PROCEDURE `stored_procedure_upsert`("		\
+			"IN `p_k` bigint unsigned,"			\
+			"IN `p_v` varchar(32)"				\
+		") "							\
+		"BEGIN "						\
+			"DECLARE `v_is_new` tinyint; "			\
+			"INSERT INTO `stored_procedure` (`k`, `v`) "	\
+			"VALUES (`p_k`, `p_v`) "			\
+			"ON DUPLICATE KEY UPDATE "			\
+			"`id` = LAST_INSERT_ID(`id`); "			\
+			"SET `v_is_new` = (ROW_COUNT() = 1); "		\
+			"SELECT LAST_INSERT_ID(), `v_is_new`; "		\
+		"END";
+
+	int ret;
+
+	ret = test_proc_query(db, "DROP PROCEDURE IF EXISTS `stored_procedure_upsert`");
+	if (unlikely(ret))
+		return ret;
+
+	ret = test_proc_query(db, "DROP TABLE IF EXISTS `stored_procedure`");
+	if (unlikely(ret))
+		return ret;
+
+	ret = test_proc_query(db, q_create_tbl);
+	if (unlikely(ret))
+		return ret;
+
+	return test_proc_query(db, q_create_proc);
+}
+
+
+/*
+ * A CALL answers with the procedure's result set followed by a
+ * status result. The statement has to be runnable again right away,
+ * whether or not all rows have been read.
+ */
+static int test_proc_001_call(mysql::MySQL *db, uint64_t *ids, bool again)
+{
+	mysql::Select<
+		"CALL `stored_procedure_upsert`(?, ?)",
+		mysql::columns<uint64_t, int64_t>,
+		uint64_t,
+		std::optional<std::string_view>
+	> st(db);
+	std::optional<std::string_view> v;
+	uint64_t id;
+	int64_t is_new;
+	int i;
+
+	for (i = 0; i < NR_ROWS; i++) {
+		v.reset();
+		if (i % 3)
+			v = "value";
+
+		if (unlikely(st.execute((uint64_t) i, v))) {
+			pr_err("Error on %s(): (%d) %s", st.getErrFunc(),
+			       st.getErrno(), st.getError());
+			return 1;
+		}
+
+		assert(!st.next(id, is_new));
+		if (!again) {
+			assert(is_new == 1);
+			ids[i] = id;
+		} else {
+			assert(is_new == 0);
+			assert(ids[i] == id);
+		}
+
+		/* Only read to the end every other time. */
+		if (i & 1)
+			assert(st.next(id, is_new) == 1);
+	}
+
+	return 0;
+}
+
+
+static int test_proc_001_check(mysql::MySQL *db)
+{
+	mysql::MySQLRes *res;
+
+	assert(!db->query("SELECT COUNT(*) FROM `stored_procedure`"));
+	res = db->storeResult();
+	assert(!MYSQL_IS_ERR_OR_NULL<mysql::MySQLRes>(res));
+	assert(res->next());
+	assert(res->getInt64(0) == NR_ROWS);
+	delete res;
+	return 0;
+}
+
+
+static int test_proc_001_drop(mysql::MySQL *db)
+{
+	int ret = 0;
+
+	ret |= test_proc_query(db, "DROP PROCEDURE `stored_procedure_upsert`");
+	ret |= test_proc_query(db, "DROP TABLE `stored_procedure`");
+	return ret;
+}
+
+
+static int test_proc_001(mysql::MySQL *db)
+{
+	uint64_t ids[NR_ROWS];
+	int ret = 0;
+
+	ret |= test_proc_001_create(db);
+	if (unlikely(ret))
+		return ret;
+
+	ret |= test_proc_001_call(db, ids, false);
+	if (unlikely(ret))
+		goto drop;
+
+	ret |= test_proc_001_call(db, ids, true);
+	if (unlikely(ret))
+		goto drop;
+
+	ret |= test_proc_001_check(db);
+	if (unlikely(ret))
+		goto drop;
+
+drop:
+	ret |= test_proc_001_drop(db);
+	return ret;
+}
+
+
+static int do_test(void)
+{
+	int ret = 0;
+	mysql::MySQL *db = nullptr;
+	const char *host = getenv("TEST_MYSQL_HOST");
+	const char *user = getenv("TEST_MYSQL_USER");
+	const char *passwd = getenv("TEST_MYSQL_PASSWORD");
+	const char *dbname = getenv("TEST_MYSQL_DBNAME");
+	const char *port_str = getenv("TEST_MYSQL_PORT");
+	uint16_t port = (uint16_t)atoi(port_str ? port_str : "0");
+
+	assert(host);
+	assert(user);
+	assert(passwd);
+	assert(dbname);
+
+	try {
+		db = new mysql::MySQL(host, user, passwd, dbname);
+		db->setPort(port);
+		if (unlikely(!db->connect()))
+			throw std::runtime_error(db->getError());
+
+		ret = test_proc_001(db);
+	} catch (const std::runtime_error& e) {
+		ret = 1;
+		std::cout << "Error: " << e.what() << std::endl;
+	}
+
+	delete db;
+	return ret;
+}
+
+
+int main(void)
+{
+	return do_test();
+}
@@ -0,0 +1,356 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Copyright (C) 2022  Ammar Faizi <ammarfaizi2@gmail.com>
+ */
+
+#include <time.h>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include "MySQL.hpp"
+
+#define QUERY_BUF_SIZE	4096
+#define NR_ROWS		2000
+
+#define pr_err(FMT, ...) \
+	printf(FMT " at %s %s:%d\n", __VA_ARGS__, __FILE__, __func__, __LINE__)
+
+
+/*
+ * Every 100th row gets a string much longer than the initial column
+ * buffer, every 7th row a NULL.
+ */
+static size_t test_str_len(int i)
+{
+	return (i % 100) ? (size_t)(i % 50) : (size_t)(1000 + i);
+}
+
+
+static void test_str_fill(char *buf, int i)
+{
+	size_t len = test_str_len(i);
+
+	memset(buf, 'a' + (i % 26), len);
+	buf[len] = '\0';
+}
+
+
+static int test_stream_001_create_table(mysql::MySQL *db, int rnum)
+{
+	static const char q_create[] =
+		"CREATE TABLE `stream_cursor_%d` ("			\
+			"`id` bigint unsigned NOT NULL,"		\
+			"`neg` int NOT NULL,"				\
+			"`big` bigint unsigned NOT NULL,"		\
+			"`str` text NOT NULL,"				\
+			"`opt` varchar(32) DEFAULT NULL,"		\
+			"PRIMARY KEY (`id`)"				\
+		") ENGINE=InnoDB DEFAULT CHARSET=utf8mb4;";
+
+	int ret;
+	char qbuf[QUERY_BUF_SIZE];
+
+	snprintf(qbuf, sizeof(qbuf), q_create, rnum);
+	ret = db->query(qbuf);
+	if (unlikely(ret))
+		pr_err("Error on query(): %s", db->getError());
+
+	assert(!db->storeResult());
+	return ret;
+}
+
+
+static int test_stream_001_insert_data(mysql::MySQL *db, int rnum)
+{
+	static const char q_insert[] =
+		"INSERT INTO `stream_cursor_%d` VALUES (?, ?, ?, ?, ?);";
+
+	int i, errret = 0;
+	const char *stmtErrFunc = nullptr;
+	mysql::MySQLStmt *stmt;
+	char qbuf[QUERY_BUF_SIZE];
+	char str[QUERY_BUF_SIZE];
+	char opt[32];
+
+	snprintf(qbuf, sizeof(qbuf), q_insert, rnum);
+	assert(!db->beginTransaction());
+
+	for (i = 0; i < NR_ROWS; i++) {
+		uint64_t id = (uint64_t)i;
+		int32_t neg = -i;
+		uint64_t big = 0xffffffffffffff00ull + (uint64_t)(i & 0xff);
+		size_t opt_len;
+		MYSQL_BIND *b;
+
+		stmt = db->prepareCached(5, qbuf);
+		if (MYSQL_IS_ERR_OR_NULL<mysql::MySQLStmt>(stmt)) {
+			pr_err("Error on prepareCached(): %s", db->getError());
+			return 1;
+		}
+
+		if (unlikely(stmt->stmtInit())) {
+			stmtErrFunc = "stmtInit";
+			goto stmt_err;
+		}
+
+		test_str_fill(str, i);
+		opt_len = (size_t)snprintf(opt, sizeof(opt), "opt_%d", i);
+
+		b = stmt->bind(0, MYSQL_TYPE_LONGLONG, &id, sizeof(id));
+		b->is_unsigned = true;
+		stmt->bind(1, MYSQL_TYPE_LONG, &neg, sizeof(neg));
+		b = stmt->bind(2, MYSQL_TYPE_LONGLONG, &big, sizeof(big));
+		b->is_unsigned = true;
+		stmt->bind(3, MYSQL_TYPE_STRING, str, test_str_len(i));
+		if (i % 7)
+			stmt->bind(4, MYSQL_TYPE_STRING, opt, opt_len);
+		else
+			stmt->bind(4, MYSQL_TYPE_NULL, NULL, 0);
+
+		if (unlikely(stmt->bindStmt())) {
+			stmtErrFunc = "bindStmt";
+			goto stmt_err;
+		}
+
+		if (unlikely(stmt->execute())) {
+			stmtErrFunc = "execute";
+			goto stmt_err;
+		}
+	}
+
+	assert(!db->commit());
+	return 0;
+
+stmt_err:
+	errret = stmt->getErrno();
+	pr_err("Error on %s(): (%d) %s", stmtErrFunc, errret, stmt->getError());
+	db->rollback();
+	return errret;
+}
+
+
+static void test_stream_check_row(int i, int64_t id, int64_t neg, uint64_t big,
+				  std::string_view s, bool opt_null,
+				  std::string_view opt)
+{
+	char str[QUERY_BUF_SIZE];
+	char obuf[32];
+
+	test_str_fill(str, i);
+	snprintf(obuf, sizeof(obuf), "opt_%d", i);
+
+	assert(id == i);
+	assert(neg == -i);
+	assert(big == 0xffffffffffffff00ull + (uint64_t)(i & 0xff));
+	assert(s == std::string_view(str));
+	assert(opt_null == !(i % 7));
+	if (!opt_null)
+		assert(opt == std::string_view(obuf));
+}
+
+
+/*
+ * Text protocol, rows are read as they are fetched.
+ */
+static int test_stream_001_use_result(mysql::MySQL *db, int rnum)
+{
+	static const char q_select[] =
+		"SELECT `id`, `neg`, `big`, `str`, `opt` FROM `stream_cursor_%d` "
+		"ORDER BY `id` ASC";
+
+	int i = 0;
+	mysql::MySQLRes *res;
+	char qbuf[QUERY_BUF_SIZE];
+
+	snprintf(qbuf, sizeof(qbuf), q_select, rnum);
+	if (unlikely(db->query(qbuf))) {
+		pr_err("Error on query(): %s", db->getError());
+		return 1;
+	}
+
+	res = db->useResult();
+	assert(!MYSQL_IS_ERR_OR_NULL<mysql::MySQLRes>(res));
+	assert(res->numFields() == 5);
+
+	while (res->next()) {
+		test_stream_check_row(i, res->getInt64(0), res->getInt64(1),
+				      res->getUInt64(2), res->getString(3),
+				      res->isNull(4), res->getString(4));
+		i++;
+	}
+
+	assert(!db->getErrno());
+	assert(i == NR_ROWS);
+	delete res;
+	return 0;
+}
+
+
+/*
+ * Binary protocol, including strings that don't fit the initial
+ * column buffer.
+ */
+static int test_stream_001_cursor(mysql::MySQL *db, int rnum)
+{
+	static const char q_select[] =
+		"SELECT `id`, `neg`, `big`, `str`, `opt` FROM `stream_cursor_%d` "
+		"WHERE `id` >= ? ORDER BY `id` ASC";
+
+	int i, ret, errret = 0;
+	uint64_t from = 0;
+	mysql::MySQLStmt *stmt;
+	mysql::MySQLStmtCursor *cur;
+	const char *stmtErrFunc = nullptr;
+	char qbuf[QUERY_BUF_SIZE];
+	MYSQL_BIND *b;
+
+	snprintf(qbuf, sizeof(qbuf), q_select, rnum);
+	stmt = db->prepareCached(1, qbuf);
+	if (MYSQL_IS_ERR_OR_NULL<mysql::MySQLStmt>(stmt)) {
+		pr_err("Error on prepareCached(): %s", db->getError());
+		return 1;
+	}
+
+	if (unlikely(stmt->stmtInit())) {
+		stmtErrFunc = "stmtInit";
+		goto stmt_err;
+	}
+
+	b = stmt->bind(0, MYSQL_TYPE_LONGLONG, &from, sizeof(from));
+	b->is_unsigned = true;
+	if (unlikely(stmt->bindStmt())) {
+		stmtErrFunc = "bindStmt";
+		goto stmt_err;
+	}
+
+	if (unlikely(stmt->execute())) {
+		stmtErrFunc = "execute";
+		goto stmt_err;
+	}
+
+	cur = stmt->cursor();
+	assert(!MYSQL_IS_ERR_OR_NULL<mysql::MySQLStmtCursor>(cur));
+	assert(cur->numFields() == 5);
+
+	i = 0;
+	while (!(ret = cur->next())) {
+		test_stream_check_row(i, cur->getInt64(0), cur->getInt64(1),
+				      cur->getUInt64(2), cur->getString(3),
+				      cur->isNull(4), cur->getString(4));
+		i++;
+	}
+
+	assert(ret == 1);
+	assert(i == NR_ROWS);
+	delete cur;
+
+	/*
+	 * Stop half way, deleting the cursor must discard the rest so
+	 * that the connection is usable again.
+	 */
+	if (unlikely(stmt->execute())) {
+		stmtErrFunc = "execute";
+		goto stmt_err;
+	}
+
+	cur = stmt->cursor();
+	assert(!MYSQL_IS_ERR_OR_NULL<mysql::MySQLStmtCursor>(cur));
+	for (i = 0; i < NR_ROWS / 2; i++)
+		assert(!cur->next());
+	delete cur;
+
+	assert(!db->query("SELECT 1"));
+	delete db->storeResult();
+	return 0;
+
+stmt_err:
+	errret = stmt->getErrno();
+	pr_err("Error on %s(): (%d) %s", stmtErrFunc, errret, stmt->getError());
+	return errret;
+}
+
+
+static int test_stream_001_drop_table(mysql::MySQL *db, int rnum)
+{
+	static const char q_drop[] = "DROP TABLE `stream_cursor_%d`";
+
+	int ret;
+	char qbuf[QUERY_BUF_SIZE];
+
+	snprintf(qbuf, sizeof(qbuf), q_drop, rnum);
+	ret = db->query(qbuf);
+	if (unlikely(ret))
+		pr_err("Error on query(): %s", db->getError());
+
+	assert(!db->storeResult());
+	return ret;
+}
+
+
+static int test_stream_001(mysql::MySQL *db)
+{
+	int rnum, ret = 0;
+
+	rnum = rand();
+	ret |= test_stream_001_create_table(db, rnum);
+	if (unlikely(ret))
+		return ret;
+
+	ret |= test_stream_001_insert_data(db, rnum);
+	if (unlikely(ret))
+		goto drop_tbl;
+
+	ret |= test_stream_001_use_result(db, rnum);
+	if (unlikely(ret))
+		goto drop_tbl;
+
+	ret |= test_stream_001_cursor(db, rnum);
+	if (unlikely(ret))
+		goto drop_tbl;
+
+drop_tbl:
+	ret |= test_stream_001_drop_table(db, rnum);
+	return ret;
+}
+
+
+static int do_test(void)
+{
+	int ret = 0;
+	mysql::MySQL *db = nullptr;
+	const char *host = getenv("TEST_MYSQL_HOST");
+	const char *user = getenv("TEST_MYSQL_USER");
+	const char *passwd = getenv("TEST_MYSQL_PASSWORD");
+	const char *dbname = getenv("TEST_MYSQL_DBNAME");
+	const char *port_str = getenv("TEST_MYSQL_PORT");
+	uint16_t port = (uint16_t)atoi(port_str ? port_str : "0");
+
+	assert(host);
+	assert(user);
+	assert(passwd);
+	assert(dbname);
+
+	try {
+		db = new mysql::MySQL(host, user, passwd, dbname);
+		db->setPort(port);
+		if (unlikely(!db->connect()))
+			throw std::runtime_error(db->getError());
+
+		ret = test_stream_001(db);
+	} catch (const std::runtime_error& e) {
+		ret = 1;
+		std::cout << "Error: " << e.what() << std::endl;
+	}
+
+	delete db;
+	return ret;
+}
+
+
+int main(void)
+{
+	srand((unsigned int)time(NULL));
+	return do_test();
+}
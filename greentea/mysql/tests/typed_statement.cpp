@@ -0,0 +1,292 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Copyright (C) 2022  Ammar Faizi <ammarfaizi2@gmail.com>
+ */
+
+#include <time.h>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include "MySQL.hpp"
+#include "Statement.hpp"
+
+#define QUERY_BUF_SIZE	4096
+#define NR_ROWS		500
+#define BASE_TIME	1640995200	/* 2022-01-01 00:00:00 UTC */
+
+#define pr_err(FMT, ...) \
+	printf(FMT " at %s %s:%d\n", __VA_ARGS__, __FILE__, __func__, __LINE__)
+
+
+static_assert(mysql::fixed_string("SELECT ?, '?', \"?\", `?`").nr_params() == 1);
+static_assert(mysql::fixed_string("SELECT ? /* ? */, 'a\\'?', ?").nr_params() == 2);
+
+
+/*
+ * The query text of a typed statement is fixed, so every test uses
+ * the same table and cleans it up before it starts.
+ */
+static int test_typed_001_create_table(mysql::MySQL *db)
+{
+	static const char q_drop[] = "DROP TABLE IF EXISTS `typed_statement`";
+	static const char q_create[] =
+		"CREATE TABLE `typed_statement` ("			\
+			"`id` bigint unsigned NOT NULL,"		\
+			"`neg` int NOT NULL,"				\
+			"`flag` enum('0','1') NOT NULL,"		\
+			"`dt` datetime DEFAULT NULL,"			\
+			"`opt` varchar(32) DEFAULT NULL,"		\
+			"`dbl` double NOT NULL,"			\
+			"PRIMARY KEY (`id`)"				\
+		") ENGINE=InnoDB DEFAULT CHARSET=utf8mb4;";
+
+	int ret;
+
+	ret = db->query(q_drop);
+	if (unlikely(ret)) {
+		pr_err("Error on query(): %s", db->getError());
+		return ret;
+	}
+	assert(!db->storeResult());
+
+	ret = db->query(q_create);
+	if (unlikely(ret))
+		pr_err("Error on query(): %s", db->getError());
+
+	assert(!db->storeResult());
+	return ret;
+}
+
+
+static void test_opt_fill(char *buf, size_t size, int i)
+{
+	snprintf(buf, size, "opt_%d", i);
+}
+
+
+static int test_typed_001_insert_data(mysql::MySQL *db)
+{
+	mysql::Statement<
+		"INSERT INTO `typed_statement` VALUES (?, ?, ?, ?, ?, ?)",
+		uint64_t,
+		int32_t,
+		mysql::enum01,
+		std::optional<mysql::datetime>,
+		std::optional<std::string_view>,
+		double
+	> st(db);
+	char opt[32];
+	int i;
+
+	assert(!db->beginTransaction());
+	for (i = 0; i < NR_ROWS; i++) {
+		std::optional<mysql::datetime> dt;
+		std::optional<std::string_view> o;
+
+		if (i % 5)
+			dt = (time_t) (BASE_TIME + i * 3661);
+
+		test_opt_fill(opt, sizeof(opt), i);
+		if (i % 7)
+			o = opt;
+
+		if (unlikely(st.execute((uint64_t) i, -i, (bool) (i & 1), dt, o,
+					i / 4.0))) {
+			pr_err("Error on %s(): (%d) %s", st.getErrFunc(),
+			       st.getErrno(), st.getError());
+			db->rollback();
+			return 1;
+		}
+
+		assert(st.getAffectedRows() == 1);
+	}
+
+	assert(!db->commit());
+	return 0;
+}
+
+
+/*
+ * The flag goes over the wire as a TINY holding the ENUM index, make
+ * sure it lands on the right member.
+ */
+static int test_typed_001_check_enum(mysql::MySQL *db)
+{
+	static const char q[] =
+		"SELECT COUNT(*) FROM `typed_statement` WHERE `flag` = '1'";
+
+	mysql::MySQLRes *res;
+
+	assert(!db->query(q));
+	res = db->storeResult();
+	assert(!MYSQL_IS_ERR_OR_NULL<mysql::MySQLRes>(res));
+	assert(res->next());
+	assert(res->getInt64(0) == NR_ROWS / 2);
+	delete res;
+	return 0;
+}
+
+
+static int test_typed_001_select(mysql::MySQL *db)
+{
+	mysql::Select<
+		"SELECT `id`, `neg`, `flag`, `dt`, `opt`, `dbl` "
+		"FROM `typed_statement` WHERE `id` >= ? ORDER BY `id` ASC",
+		mysql::columns<
+			uint64_t,
+			int32_t,
+			std::string_view,
+			std::optional<std::string_view>,
+			std::optional<std::string_view>,
+			double
+		>,
+		uint64_t
+	> st(db);
+	uint64_t id;
+	int32_t neg;
+	std::string_view flag;
+	std::optional<std::string_view> dt, opt;
+	double dbl;
+	char obuf[32], dbuf[32];
+	int i = 0, ret;
+
+	if (unlikely(st.execute(0))) {
+		pr_err("Error on %s(): (%d) %s", st.getErrFunc(),
+		       st.getErrno(), st.getError());
+		return 1;
+	}
+
+	while (!(ret = st.next(id, neg, flag, dt, opt, dbl))) {
+		assert(id == (uint64_t) i);
+		assert(neg == -i);
+		assert(flag == ((i & 1) ? "1" : "0"));
+		assert(dbl == i / 4.0);
+
+		if (i % 5) {
+			time_t t = BASE_TIME + i * 3661;
+			struct tm tm;
+
+			gmtime_r(&t, &tm);
+			strftime(dbuf, sizeof(dbuf), "%Y-%m-%d %H:%M:%S", &tm);
+			assert(dt && *dt == dbuf);
+		} else {
+			assert(!dt);
+		}
+
+		test_opt_fill(obuf, sizeof(obuf), i);
+		if (i % 7)
+			assert(opt && *opt == obuf);
+		else
+			assert(!opt);
+
+		i++;
+	}
+
+	assert(ret == 1);
+	assert(i == NR_ROWS);
+	return 0;
+}
+
+
+/*
+ * A column count that doesn't match the result set is an error, not
+ * a silent misread.
+ */
+static int test_typed_001_select_mismatch(mysql::MySQL *db)
+{
+	mysql::Select<
+		"SELECT `id`, `neg` FROM `typed_statement` WHERE `id` = ?",
+		mysql::columns<uint64_t>,
+		uint64_t
+	> st(db);
+	uint64_t id;
+
+	assert(st.execute(1) == -EINVAL);
+	assert(!strcmp(st.getErrFunc(), "cursor"));
+	assert(st.next(id) < 0);
+	return 0;
+}
+
+
+static int test_typed_001_drop_table(mysql::MySQL *db)
+{
+	int ret;
+
+	ret = db->query("DROP TABLE `typed_statement`");
+	if (unlikely(ret))
+		pr_err("Error on query(): %s", db->getError());
+
+	assert(!db->storeResult());
+	return ret;
+}
+
+
+static int test_typed_001(mysql::MySQL *db)
+{
+	int ret = 0;
+
+	ret |= test_typed_001_create_table(db);
+	if (unlikely(ret))
+		return ret;
+
+	ret |= test_typed_001_insert_data(db);
+	if (unlikely(ret))
+		goto drop_tbl;
+
+	ret |= test_typed_001_check_enum(db);
+	if (unlikely(ret))
+		goto drop_tbl;
+
+	ret |= test_typed_001_select(db);
+	if (unlikely(ret))
+		goto drop_tbl;
+
+	ret |= test_typed_001_select_mismatch(db);
+	if (unlikely(ret))
+		goto drop_tbl;
+
+drop_tbl:
+	ret |= test_typed_001_drop_table(db);
+	return ret;
+}
+
+
+static int do_test(void)
+{
+	int ret = 0;
+	mysql::MySQL *db = nullptr;
+	const char *host = getenv("TEST_MYSQL_HOST");
+	const char *user = getenv("TEST_MYSQL_USER");
+	const char *passwd = getenv("TEST_MYSQL_PASSWORD");
+	const char *dbname = getenv("TEST_MYSQL_DBNAME");
+	const char *port_str = getenv("TEST_MYSQL_PORT");
+	uint16_t port = (uint16_t)atoi(port_str ? port_str : "0");
+
+	assert(host);
+	assert(user);
+	assert(passwd);
+	assert(dbname);
+
+	try {
+		db = new mysql::MySQL(host, user, passwd, dbname);
+		db->setPort(port);
+		if (unlikely(!db->connect()))
+			throw std::runtime_error(db->getError());
+
+		ret = test_typed_001(db);
+	} catch (const std::runtime_error& e) {
+		ret = 1;
+		std::cout << "Error: " << e.what() << std::endl;
+	}
+
+	delete db;
+	return ret;
+}
+
+
+int main(void)
+{
+	return do_test();
+}
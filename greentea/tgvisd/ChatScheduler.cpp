@@ -0,0 +1,142 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license GPL-2.0-only
+ * @package tgvisd
+ *
+ * Copyright (C) 2022 Ammar Faizi <ammarfaizi2@gmail.com>
+ */
+
+#include <tgvisd/ChatScheduler.hpp>
+
+
+namespace tgvisd {
+
+
+__cold ChatScheduler::ChatScheduler(int64_t min_interval_ms,
+				    int64_t max_interval_ms):
+	minIntervalMs_(min_interval_ms),
+	maxIntervalMs_(max_interval_ms)
+{
+	if (maxIntervalMs_ < minIntervalMs_)
+		maxIntervalMs_ = minIntervalMs_;
+}
+
+
+void ChatScheduler::setDue(int64_t chat_id, struct chat *c, int64_t due_ms)
+{
+	c->due_ms = due_ms;
+	heap_.emplace(due_ms, chat_id);
+}
+
+
+/*
+ * Pop the heap entries of chats that are gone, in flight or have been
+ * rescheduled since.
+ */
+void ChatScheduler::dropStale(void)
+{
+	while (!heap_.empty()) {
+		const heap_ent &top = heap_.top();
+		const auto &it = chats_.find(top.second);
+
+		if (it != chats_.end() && !it->second.in_flight &&
+		    it->second.due_ms == top.first)
+			break;
+
+		heap_.pop();
+	}
+}
+
+
+void ChatScheduler::setChats(const std::vector<int64_t> &chat_ids,
+			     int64_t now_ms)
+{
+	gen_++;
+	for (int64_t chat_id: chat_ids) {
+		auto it = chats_.find(chat_id);
+
+		if (it != chats_.end()) {
+			it->second.gen = gen_;
+			continue;
+		}
+
+		it = chats_.emplace(chat_id, chat{0.0, 0, 0, gen_, false}).first;
+		setDue(chat_id, &it->second, now_ms);
+	}
+
+	for (auto it = chats_.begin(); it != chats_.end();) {
+		if (it->second.gen != gen_ && !it->second.in_flight)
+			it = chats_.erase(it);
+		else
+			it++;
+	}
+}
+
+
+bool ChatScheduler::popDue(int64_t now_ms, int64_t *chat_id)
+{
+	dropStale();
+	if (heap_.empty() || heap_.top().first > now_ms)
+		return false;
+
+	*chat_id = heap_.top().second;
+	heap_.pop();
+	chats_[*chat_id].in_flight = true;
+	return true;
+}
+
+
+void ChatScheduler::complete(int64_t chat_id, const struct visit_stat *vs,
+			     int64_t now_ms)
+{
+	int64_t interval;
+	struct chat *c;
+	double sample;
+
+	auto it = chats_.find(chat_id);
+	if (unlikely(it == chats_.end()))
+		return;
+
+	c = &it->second;
+	c->in_flight = false;
+
+	if (vs->skipped) {
+		setDue(chat_id, c, now_ms + maxIntervalMs_ * 8);
+		return;
+	}
+
+	/*
+	 * The first visit's tail is whatever the chat has, not what it
+	 * got since we last looked.
+	 */
+	if (c->last_visit_ms && now_ms > c->last_visit_ms) {
+		sample = vs->nr_tail_new * 1000.0 / (double) (now_ms - c->last_visit_ms);
+		c->rate = RATE_ALPHA * sample + (1.0 - RATE_ALPHA) * c->rate;
+	}
+	c->last_visit_ms = now_ms;
+
+	if (vs->has_gap || c->rate * maxIntervalMs_ >= TARGET_NEW * 1000.0) {
+		if (vs->has_gap)
+			interval = minIntervalMs_;
+		else
+			interval = (int64_t) (TARGET_NEW * 1000.0 / c->rate);
+
+		if (interval < minIntervalMs_)
+			interval = minIntervalMs_;
+	} else {
+		interval = maxIntervalMs_;
+	}
+
+	setDue(chat_id, c, now_ms + interval);
+}
+
+
+int64_t ChatScheduler::nextDue(void)
+{
+	dropStale();
+	return heap_.empty() ? INT64_MAX : heap_.top().first;
+}
+
+
+} /* namespace tgvisd */
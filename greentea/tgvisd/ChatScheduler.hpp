@@ -0,0 +1,134 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license GPL-2.0-only
+ * @package tgvisd
+ *
+ * Copyright (C) 2022 Ammar Faizi <ammarfaizi2@gmail.com>
+ */
+
+#ifndef TGVISD__CHATSCHEDULER_HPP
+#define TGVISD__CHATSCHEDULER_HPP
+
+#include <queue>
+#include <vector>
+#include <cstdint>
+#include <utility>
+#include <functional>
+#include <unordered_map>
+#include <tgvisd/common.hpp>
+
+
+namespace tgvisd {
+
+
+/*
+ * What a chat visit found, filled by the Scraper.
+ */
+struct visit_stat {
+	uint32_t	nr_local_pages;
+	uint32_t	nr_pages;
+	uint32_t	nr_fetched;
+	uint32_t	nr_known;
+	uint32_t	nr_failed;
+
+	/* Text messages written by this visit. */
+	uint32_t	nr_saved;
+
+	/* Messages saved from the tail page, what the chat got lately. */
+	uint32_t	nr_tail_new;
+
+	/*
+	 * Every gap page of the visit made progress and there are gaps
+	 * left to fetch.
+	 */
+	bool		has_gap;
+
+	/* Not a chat we scrape (or getChat failed). */
+	bool		skipped;
+};
+
+
+/*
+ * Decides which chat the Scraper visits next.
+ *
+ * Every chat has a due time, the chats are kept in a min-heap on it.
+ * After a visit the chat is due again after roughly the time it takes
+ * to get TARGET_NEW new messages at its observed rate (an EWMA of new
+ * messages per second), bounded by [minIntervalMs, maxIntervalMs]. A
+ * chat with a gap left is due again right away, a dead chat only
+ * every maxIntervalMs and a chat we don't scrape 8 times less often.
+ * When more chats are due than can be visited, the most overdue ones
+ * go first.
+ *
+ * Only used by the scraper thread, not thread safe.
+ */
+class ChatScheduler
+{
+private:
+	/* Half a history page, so the tail page never leaves a hole. */
+	static constexpr double	TARGET_NEW = 50.0;
+
+	/* Weight of the newest sample in the rate EWMA. */
+	static constexpr double	RATE_ALPHA = 0.3;
+
+	struct chat {
+		/* New messages per second. */
+		double		rate;
+		int64_t		last_visit_ms;
+		int64_t		due_ms;
+		uint32_t	gen;
+		bool		in_flight;
+	};
+
+	using heap_ent = std::pair<int64_t, int64_t>;	/* due_ms, chat_id */
+
+	std::unordered_map<int64_t, struct chat>	chats_;
+	std::priority_queue<heap_ent, std::vector<heap_ent>,
+			    std::greater<heap_ent>>	heap_;
+	uint32_t					gen_ = 0;
+
+	int64_t						minIntervalMs_;
+	int64_t						maxIntervalMs_;
+
+	void setDue(int64_t chat_id, struct chat *c, int64_t due_ms);
+	void dropStale(void);
+
+public:
+	ChatScheduler(int64_t min_interval_ms, int64_t max_interval_ms);
+
+	/*
+	 * The current chat list: chats not seen before are due now,
+	 * chats gone from the list are dropped once they are idle.
+	 */
+	void setChats(const std::vector<int64_t> &chat_ids, int64_t now_ms);
+
+	/*
+	 * Take the most overdue chat. Returns false if no chat is due
+	 * at @now_ms.
+	 */
+	bool popDue(int64_t now_ms, int64_t *chat_id);
+
+	/*
+	 * The visit of @chat_id popped by popDue() is done, schedule
+	 * its next one.
+	 */
+	void complete(int64_t chat_id, const struct visit_stat *vs,
+		      int64_t now_ms);
+
+	/*
+	 * Due time of the next chat, INT64_MAX if there is none.
+	 */
+	int64_t nextDue(void);
+
+
+	inline size_t size(void) const
+	{
+		return chats_.size();
+	}
+};
+
+
+} /* namespace tgvisd */
+
+#endif /* #ifndef TGVISD__CHATSCHEDULER_HPP */
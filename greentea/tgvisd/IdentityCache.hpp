@@ -0,0 +1,140 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license GPL-2.0-only
+ * @package tgvisd
+ *
+ * Copyright (C) 2022 Ammar Faizi <ammarfaizi2@gmail.com>
+ */
+
+#ifndef TGVISD__IDENTITYCACHE_HPP
+#define TGVISD__IDENTITYCACHE_HPP
+
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <shared_mutex>
+#include <unordered_map>
+#include <tgvisd/common.hpp>
+
+
+namespace tgvisd {
+
+
+/*
+ * Telegram id -> database primary key map.
+ *
+ * The mapping never changes once the row exists, so this is a
+ * read-mostly map: lookups only take the shared lock of one shard.
+ * Keys are spread over NR_SHARDS independently locked shards, so
+ * that writers only stall the readers of their own shard. A primary
+ * key of 0 means "not cached".
+ */
+template <typename K, uint32_t NR_SHARDS = 1>
+class IdentityCache
+{
+	static_assert(NR_SHARDS && !(NR_SHARDS & (NR_SHARDS - 1)),
+		      "NR_SHARDS must be a power of 2");
+
+private:
+	struct shard {
+		std::shared_mutex		lock;
+		std::unordered_map<K, uint64_t>	map;
+	} __attribute__((__aligned__(64)));
+
+	struct shard			shards_[NR_SHARDS];
+	std::atomic<uint64_t>		nrHit_  = 0;
+	std::atomic<uint64_t>		nrMiss_ = 0;
+
+
+	inline struct shard *getShard(K key)
+	{
+		size_t h;
+
+		if (NR_SHARDS == 1)
+			return &shards_[0];
+
+		/*
+		 * Telegram ids are sequential-ish, mix the bits so
+		 * neighbouring ids don't all land in the same shard.
+		 */
+		h = std::hash<K>{}(key) * 0x9e3779b97f4a7c15ull;
+		return &shards_[(h >> 32) & (NR_SHARDS - 1)];
+	}
+
+public:
+	__hot inline uint64_t get(K key)
+	{
+		uint64_t ret = 0;
+		struct shard *s = getShard(key);
+
+		s->lock.lock_shared();
+		const auto &it = s->map.find(key);
+		if (it != s->map.end())
+			ret = it->second;
+		s->lock.unlock_shared();
+
+		if (likely(ret))
+			nrHit_.fetch_add(1, std::memory_order_relaxed);
+		else
+			nrMiss_.fetch_add(1, std::memory_order_relaxed);
+
+		return ret;
+	}
+
+
+	inline void set(K key, uint64_t pk)
+	{
+		struct shard *s;
+
+		if (unlikely(!pk))
+			return;
+
+		s = getShard(key);
+		s->lock.lock();
+		s->map[key] = pk;
+		s->lock.unlock();
+	}
+
+
+	inline void erase(K key)
+	{
+		struct shard *s = getShard(key);
+
+		s->lock.lock();
+		s->map.erase(key);
+		s->lock.unlock();
+	}
+
+
+	inline size_t size(void)
+	{
+		size_t ret = 0;
+		uint32_t i;
+
+		for (i = 0; i < NR_SHARDS; i++) {
+			shards_[i].lock.lock_shared();
+			ret += shards_[i].map.size();
+			shards_[i].lock.unlock_shared();
+		}
+		return ret;
+	}
+
+
+	inline uint64_t getNrHit(void)
+	{
+		return nrHit_.load(std::memory_order_relaxed);
+	}
+
+
+	inline uint64_t getNrMiss(void)
+	{
+		return nrMiss_.load(std::memory_order_relaxed);
+	}
+};
+
+
+} /* namespace tgvisd */
+
+#endif /* #ifndef TGVISD__IDENTITYCACHE_HPP */
@@ -0,0 +1,138 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license GPL-2.0-only
+ * @package tgvisd
+ *
+ * Copyright (C) 2022 Ammar Faizi <ammarfaizi2@gmail.com>
+ */
+
+#ifndef TGVISD__IDXSTACK_HPP
+#define TGVISD__IDXSTACK_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <tgvisd/common.hpp>
+
+
+namespace tgvisd {
+
+
+/*
+ * Lock-free LIFO of the indices 0 .. size - 1, each of them on the
+ * stack at most once.
+ *
+ * The links live in a fixed array next to the indices, the head is
+ * the top index tagged with a counter that changes on every update,
+ * so an index that is popped and pushed again between our load and
+ * our CAS (ABA) can't fool us.
+ *
+ * LIFO on purpose: the most recently used index is handed out first
+ * and the ones at the bottom are the ones that sit idle.
+ */
+class IdxStack
+{
+private:
+	static constexpr uint32_t NIL = UINT32_MAX;
+
+	std::atomic<uint32_t>		*next_ = nullptr;
+	size_t				size_  = 0;
+
+	alignas(64) std::atomic<uint64_t>	head_ = NIL;
+
+
+	static inline uint32_t headIdx(uint64_t head)
+	{
+		return (uint32_t)head;
+	}
+
+
+	static inline uint64_t makeHead(uint64_t old, uint32_t idx)
+	{
+		return ((old >> 32u) + 1u) << 32u | idx;
+	}
+
+public:
+	inline IdxStack(size_t size):
+		size_(size)
+	{
+		size_t i;
+
+		next_ = new std::atomic<uint32_t>[size];
+		for (i = 0; i < size; i++)
+			next_[i].store(NIL, std::memory_order_relaxed);
+	}
+
+
+	inline ~IdxStack(void)
+	{
+		delete[] next_;
+	}
+
+
+	IdxStack(const IdxStack &) = delete;
+	IdxStack &operator=(const IdxStack &) = delete;
+
+
+	__hot inline void push(uint32_t idx)
+	{
+		uint64_t old, nw;
+
+		old = head_.load(std::memory_order_relaxed);
+		do {
+			next_[idx].store(headIdx(old), std::memory_order_relaxed);
+			nw = makeHead(old, idx);
+		} while (!head_.compare_exchange_weak(old, nw,
+						      std::memory_order_release,
+						      std::memory_order_relaxed));
+	}
+
+
+	/*
+	 * Returns false if the stack is empty.
+	 */
+	__hot inline bool pop(uint32_t *idx)
+	{
+		uint64_t old, nw;
+		uint32_t top;
+
+		old = head_.load(std::memory_order_acquire);
+		do {
+			top = headIdx(old);
+			if (top == NIL)
+				return false;
+
+			/*
+			 * May be stale if @top is taken meanwhile, the tag
+			 * makes the CAS fail then.
+			 */
+			nw = makeHead(old, next_[top].load(std::memory_order_relaxed));
+		} while (!head_.compare_exchange_weak(old, nw,
+						      std::memory_order_acquire,
+						      std::memory_order_acquire));
+
+		*idx = top;
+		return true;
+	}
+
+
+	/*
+	 * Only a snapshot, it may be stale by the time it returns.
+	 */
+	inline bool empty(void)
+	{
+		return headIdx(head_.load(std::memory_order_seq_cst)) == NIL;
+	}
+
+
+	inline size_t capacity(void)
+	{
+		return size_;
+	}
+};
+
+
+} /* namespace tgvisd */
+
+#endif /* #ifndef TGVISD__IDXSTACK_HPP */
@@ -0,0 +1,316 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license GPL-2.0-only
+ * @package tgvisd
+ *
+ * Copyright (C) 2022 Ammar Faizi <ammarfaizi2@gmail.com>
+ */
+
+#if defined(__linux__)
+	#include <unistd.h>
+#endif
+
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <stdexcept>
+#include <tgvisd/KWorker.hpp>
+#include <tgvisd/IngestQueue.hpp>
+#include <tgvisd/Logger/Message.hpp>
+
+
+namespace tgvisd {
+
+
+struct ingest_payload {
+	td_api::object_ptr<td_api::message>	msg;
+};
+
+
+struct ingest_spill_rec {
+	int64_t					chat_id;
+	int64_t					msg_id;
+};
+
+
+static void ingest_payload_deleter(void *p)
+{
+	delete (struct ingest_payload *)p;
+}
+
+
+__cold IngestQueue::IngestQueue(Main *main, KWorker *kworker):
+	main_(main),
+	kworker_(kworker)
+{
+	initConfig();
+	ring_ = new td_api::object_ptr<td_api::message>[depth_];
+}
+
+
+__cold IngestQueue::~IngestQueue(void)
+{
+	if (ring_) {
+		delete[] ring_;
+		ring_ = nullptr;
+	}
+
+	if (spill_) {
+		fclose(spill_);
+		spill_ = nullptr;
+	}
+}
+
+
+__cold void IngestQueue::initConfig(void)
+{
+	const char *tmp;
+
+	tmp = getenv("TGVISD_INGEST_DEPTH");
+	if (tmp) {
+		depth_ = (uint32_t)strtoul(tmp, NULL, 10);
+		if (unlikely(!depth_))
+			throw std::runtime_error("Invalid TGVISD_INGEST_DEPTH env");
+	}
+
+	tmp = getenv("TGVISD_INGEST_BLOCK_MS");
+	if (tmp)
+		blockTimeout_ = std::chrono::milliseconds(strtoul(tmp, NULL, 10));
+
+	tmp = getenv("TGVISD_INGEST_POLICY");
+	if (!tmp || !strcmp(tmp, "block"))
+		policy_ = INGEST_BLOCK;
+	else if (!strcmp(tmp, "spill"))
+		policy_ = INGEST_SPILL;
+	else if (!strcmp(tmp, "drop"))
+		policy_ = INGEST_DROP;
+	else
+		throw std::runtime_error("Invalid TGVISD_INGEST_POLICY env");
+
+	if (policy_ != INGEST_SPILL)
+		return;
+
+	spillPath_ = getenv("TGVISD_INGEST_SPILL_PATH");
+	if (unlikely(!spillPath_))
+		throw std::runtime_error("Missing TGVISD_INGEST_SPILL_PATH env");
+
+	/*
+	 * Open in append mode, so whatever was spilled before a
+	 * restart is replayed too.
+	 */
+	spill_ = fopen(spillPath_, "a+b");
+	if (unlikely(!spill_))
+		throw std::runtime_error("Cannot open TGVISD_INGEST_SPILL_PATH");
+
+	fseek(spill_, 0, SEEK_END);
+	spillWPos_ = ftell(spill_);
+	spillWPos_ -= spillWPos_ % (long)sizeof(struct ingest_spill_rec);
+	spillRPos_ = 0;
+}
+
+
+/*
+ * Called from the Td loop.
+ */
+__hot void IngestQueue::push(td_api::object_ptr<td_api::message> msg)
+	__acquires(&lock_)
+	__releases(&lock_)
+{
+	uint64_t nr_dropped;
+	std::unique_lock<std::mutex> lk(lock_);
+
+	if (unlikely(!msg || stop_))
+		return;
+
+	if (unlikely(count_ == depth_)) {
+		switch (policy_) {
+		case INGEST_BLOCK:
+			pushCond_.wait_for(lk, blockTimeout_, [this]{
+				return count_ < depth_ || stop_;
+			});
+			if (count_ < depth_ && !stop_)
+				break;
+			goto drop;
+		case INGEST_SPILL:
+			if (spillMessage(*msg)) {
+				nrSpilled_++;
+				return;
+			}
+			goto drop;
+		case INGEST_DROP:
+			goto drop;
+		}
+	}
+
+	ring_[tail_] = std::move(msg);
+	tail_ = (tail_ + 1) % depth_;
+	count_++;
+	lk.unlock();
+	nrQueued_++;
+	popCond_.notify_one();
+	return;
+
+drop:
+	lk.unlock();
+	nr_dropped = ++nrDropped_;
+	if ((nr_dropped % 1000) == 1)
+		pr_notice("IngestQueue: queue is full, %llu message(s) "
+			  "dropped so far", (unsigned long long) nr_dropped);
+}
+
+
+__must_hold(&lock_)
+bool IngestQueue::spillMessage(const td_api::message &msg)
+{
+	struct ingest_spill_rec rec;
+
+	if (unlikely(!spill_))
+		return false;
+
+	rec.chat_id = msg.chat_id_;
+	rec.msg_id  = msg.id_;
+
+	/*
+	 * The stream may have been read from last, a write must not
+	 * follow a read without a positioning call in between.
+	 */
+	fseek(spill_, 0, SEEK_END);
+	if (unlikely(fwrite(&rec, sizeof(rec), 1, spill_) != 1)) {
+		pr_err("IngestQueue: cannot write to the spill file: "
+		       PRERF, PREAR(errno));
+		return false;
+	}
+
+	fflush(spill_);
+	spillWPos_ += (long)sizeof(rec);
+	return true;
+}
+
+
+__must_hold(&lock_)
+bool IngestQueue::unspillMessage(int64_t *chat_id, int64_t *msg_id)
+{
+	struct ingest_spill_rec rec;
+	bool ok = true;
+
+	if (spillRPos_ >= spillWPos_)
+		return false;
+
+	fseek(spill_, spillRPos_, SEEK_SET);
+	if (unlikely(fread(&rec, sizeof(rec), 1, spill_) != 1)) {
+		pr_err("IngestQueue: cannot read the spill file: "
+		       PRERF, PREAR(errno));
+		spillRPos_ = spillWPos_;
+		ok = false;
+	} else {
+		spillRPos_ += (long)sizeof(rec);
+	}
+
+	if (spillRPos_ >= spillWPos_) {
+		/*
+		 * Everything has been replayed, start over from an
+		 * empty file.
+		 */
+		if (unlikely(ftruncate(fileno(spill_), 0)))
+			pr_err("IngestQueue: cannot truncate the spill file: "
+			       PRERF, PREAR(errno));
+		spillRPos_ = 0;
+		spillWPos_ = 0;
+	}
+
+	if (unlikely(!ok))
+		return false;
+
+	*chat_id = rec.chat_id;
+	*msg_id  = rec.msg_id;
+	return true;
+}
+
+
+__hot void IngestQueue::dispatch(td_api::object_ptr<td_api::message> msg)
+{
+	int ret;
+	struct task_work tw;
+	struct ingest_payload *payload;
+
+	payload = new struct ingest_payload;
+	payload->msg = std::move(msg);
+
+	tw.func = [](struct tw_data *data){
+		struct ingest_payload *payload;
+
+		payload = (struct ingest_payload *)data->tw->payload;
+		tgvisd::Logger::Message m_msg(data->kwrk, *payload->msg);
+		m_msg.save();
+	};
+	tw.payload = (void *)payload;
+	tw.deleter = ingest_payload_deleter;
+
+	/*
+	 * When all task slots are busy, wait for a worker to put one
+	 * back, the ring keeps absorbing the burst meanwhile.
+	 */
+	do {
+		ret = kworker_->submitTaskWork(&tw, 100ms);
+		if (likely(!ret))
+			return;
+	} while (ret == -ETIMEDOUT && !shouldStop());
+
+	ingest_payload_deleter(payload);
+}
+
+
+__hot void IngestQueue::run(void)
+	__acquires(&lock_)
+	__releases(&lock_)
+{
+	std::unique_lock<std::mutex> lk(lock_, std::defer_lock);
+
+	while (!main_->isReady()) {
+		if (shouldStop())
+			return;
+		sleep(1);
+	}
+
+	while (!shouldStop()) {
+		td_api::object_ptr<td_api::message> msg;
+		int64_t chat_id, msg_id;
+		bool spilled;
+
+		lk.lock();
+		while (!count_ && spillRPos_ >= spillWPos_ && !shouldStop())
+			popCond_.wait_for(lk, 1000ms);
+
+		if (count_) {
+			msg = std::move(ring_[head_]);
+			head_ = (head_ + 1) % depth_;
+			count_--;
+			lk.unlock();
+			pushCond_.notify_one();
+			dispatch(std::move(msg));
+			continue;
+		}
+
+		/*
+		 * The ring is empty, now is a good time to replay the
+		 * spilled messages.
+		 */
+		spilled = spill_ && unspillMessage(&chat_id, &msg_id);
+		lk.unlock();
+		if (!spilled)
+			continue;
+
+		msg = kworker_->getMessage(chat_id, msg_id);
+		if (unlikely(!msg)) {
+			pr_notice("IngestQueue: cannot refetch spilled message "
+				  "%lld from %lld", (long long) msg_id,
+				  (long long) chat_id);
+			continue;
+		}
+		dispatch(std::move(msg));
+	}
+}
+
+
+} /* namespace tgvisd */
@@ -0,0 +1,148 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license GPL-2.0-only
+ * @package tgvisd
+ *
+ * Copyright (C) 2022 Ammar Faizi <ammarfaizi2@gmail.com>
+ */
+
+#ifndef TGVISD__INGESTQUEUE_HPP
+#define TGVISD__INGESTQUEUE_HPP
+
+#if defined(__linux__)
+	#include <unistd.h>
+	#include <pthread.h>
+#endif
+
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <cstdio>
+#include <tgvisd/Main.hpp>
+#include <tgvisd/Td/Td.hpp>
+#include <tgvisd/common.hpp>
+#include <condition_variable>
+
+
+namespace tgvisd {
+
+
+using namespace std::chrono_literals;
+
+
+/*
+ * What to do with a new message when the ingest queue is full.
+ */
+enum ingest_policy {
+	/*
+	 * Block the caller (the Td loop) until a slot is free. The wait
+	 * is bounded by blockTimeout_, because the Td loop is also the
+	 * one that delivers the replies our workers are waiting for.
+	 */
+	INGEST_BLOCK,
+
+	/*
+	 * Append (chat_id, msg_id) to a spill file and refetch the
+	 * message from TDLib once the queue has drained.
+	 */
+	INGEST_SPILL,
+
+	/*
+	 * Drop the message and bump nrDropped_. The scraper will pick
+	 * it up later from the chat history.
+	 */
+	INGEST_DROP
+};
+
+
+/*
+ * Bounded MPSC queue between the updateNewMessage callback and the
+ * KWorker thread pool.
+ */
+class IngestQueue
+{
+private:
+	volatile bool				stop_        = false;
+	Main					*main_       = nullptr;
+	KWorker					*kworker_    = nullptr;
+	td_api::object_ptr<td_api::message>	*ring_       = nullptr;
+	uint32_t				depth_       = 4096;
+	uint32_t				head_        = 0;
+	uint32_t				tail_        = 0;
+	uint32_t				count_       = 0;
+	enum ingest_policy			policy_      = INGEST_BLOCK;
+	std::chrono::milliseconds		blockTimeout_ = 1000ms;
+
+	const char				*spillPath_  = nullptr;
+	FILE					*spill_      = nullptr;
+	long					spillRPos_   = 0;
+	long					spillWPos_   = 0;
+
+	std::mutex				lock_;
+	std::condition_variable			pushCond_;
+	std::condition_variable			popCond_;
+
+	std::atomic<uint64_t>			nrQueued_    = 0;
+	std::atomic<uint64_t>			nrDropped_   = 0;
+	std::atomic<uint64_t>			nrSpilled_   = 0;
+
+	void initConfig(void);
+	void dispatch(td_api::object_ptr<td_api::message> msg);
+	bool spillMessage(const td_api::message &msg);
+	bool unspillMessage(int64_t *chat_id, int64_t *msg_id);
+
+public:
+	IngestQueue(Main *main, KWorker *kworker);
+	~IngestQueue(void);
+	void push(td_api::object_ptr<td_api::message> msg);
+	void run(void);
+
+
+	inline void stop(void)
+	{
+		std::unique_lock<std::mutex> lk(lock_);
+		stop_ = true;
+		popCond_.notify_all();
+		pushCond_.notify_all();
+	}
+
+
+	inline bool shouldStop(void)
+	{
+		return unlikely(stop_ || main_->getStop());
+	}
+
+
+	inline uint64_t getNrQueued(void)
+	{
+		return nrQueued_.load(std::memory_order_relaxed);
+	}
+
+
+	inline uint64_t getNrDropped(void)
+	{
+		return nrDropped_.load(std::memory_order_relaxed);
+	}
+
+
+	inline uint64_t getNrSpilled(void)
+	{
+		return nrSpilled_.load(std::memory_order_relaxed);
+	}
+
+
+	inline static void setThreadName(std::thread *task)
+	{
+#if defined(__linux__)
+		pthread_t pt = task->native_handle();
+		pthread_setname_np(pt, "tgv-ingest");
+#endif
+	}
+};
+
+
+} /* namespace tgvisd */
+
+#endif /* #ifndef TGVISD__INGESTQUEUE_HPP */
@@ -0,0 +1,220 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license GPL-2.0-only
+ * @package tgvisd
+ *
+ * Copyright (C) 2022 Ammar Faizi <ammarfaizi2@gmail.com>
+ */
+
+#ifndef TGVISD__INTERVALSET_HPP
+#define TGVISD__INTERVALSET_HPP
+
+#include <map>
+#include <string>
+#include <cstdint>
+#include <cstdlib>
+#include <cinttypes>
+#include <string_view>
+#include <tgvisd/common.hpp>
+
+
+namespace tgvisd {
+
+
+/*
+ * Set of closed uint64_t ranges. Overlapping and adjacent ranges are
+ * merged on insertion, so the ranges in the set are disjoint and
+ * there is at least one missing value between two of them.
+ */
+class IntervalSet
+{
+private:
+	/* lo -> hi */
+	std::map<uint64_t, uint64_t>	iv_;
+
+public:
+	inline void add(uint64_t lo, uint64_t hi)
+	{
+		if (unlikely(lo > hi))
+			return;
+
+		/*
+		 * The last range that begins at or before lo may reach
+		 * into [lo, hi] or end right before it.
+		 */
+		auto it = iv_.upper_bound(lo);
+		if (it != iv_.begin()) {
+			auto prev = std::prev(it);
+
+			if (prev->second == UINT64_MAX || prev->second + 1 >= lo) {
+				if (prev->second >= hi)
+					return;
+				lo = prev->first;
+				it = prev;
+			}
+		}
+
+		/* Swallow every range that starts inside [lo, hi + 1]. */
+		while (it != iv_.end() &&
+		       (hi == UINT64_MAX || it->first <= hi + 1)) {
+			if (it->second > hi)
+				hi = it->second;
+			it = iv_.erase(it);
+		}
+
+		iv_.emplace(lo, hi);
+	}
+
+
+	inline bool contains(uint64_t x) const
+	{
+		auto it = iv_.upper_bound(x);
+
+		if (it == iv_.begin())
+			return false;
+
+		return std::prev(it)->second >= x;
+	}
+
+
+	inline bool empty(void) const
+	{
+		return iv_.empty();
+	}
+
+
+	inline size_t nrRanges(void) const
+	{
+		return iv_.size();
+	}
+
+
+	inline uint64_t min(void) const
+	{
+		return iv_.empty() ? 0 : iv_.begin()->first;
+	}
+
+
+	inline uint64_t max(void) const
+	{
+		return iv_.empty() ? 0 : iv_.rbegin()->second;
+	}
+
+
+	/*
+	 * Call @fn(lo, hi) for every range, in ascending order.
+	 */
+	template <typename F>
+	inline void forEach(F fn) const
+	{
+		for (const auto &it: iv_)
+			fn(it.first, it.second);
+	}
+
+
+	/*
+	 * The highest hole between two ranges, as [*lo, *hi]. Returns
+	 * false if the set is one range or less.
+	 */
+	inline bool highestGap(uint64_t *lo, uint64_t *hi) const
+	{
+		if (iv_.size() < 2)
+			return false;
+
+		auto top = iv_.rbegin();
+		auto below = std::next(top);
+
+		*lo = below->second + 1;
+		*hi = top->first - 1;
+		return true;
+	}
+
+
+	/*
+	 * Call @fn(lo, hi) for every hole between two ranges, highest
+	 * first, until it returns false.
+	 */
+	template <typename F>
+	inline void forEachGapDesc(F fn) const
+	{
+		if (iv_.size() < 2)
+			return;
+
+		for (auto it = std::next(iv_.rbegin()); it != iv_.rend(); it++) {
+			if (!fn(it->second + 1, std::prev(it)->first - 1))
+				return;
+		}
+	}
+
+
+	/*
+	 * Number of values missing between min() and max().
+	 */
+	inline uint64_t nrMissing(void) const
+	{
+		uint64_t ret = 0, prev_hi = 0;
+		bool first = true;
+
+		for (const auto &it: iv_) {
+			if (!first)
+				ret += it.first - prev_hi - 1;
+			prev_hi = it.second;
+			first = false;
+		}
+		return ret;
+	}
+
+
+	/*
+	 * "lo-hi,lo-hi,...", what parse() reads back.
+	 */
+	inline std::string toString(void) const
+	{
+		std::string ret;
+		char buf[48];
+		int len;
+
+		for (const auto &it: iv_) {
+			len = snprintf(buf, sizeof(buf), "%s%" PRIu64 "-%" PRIu64,
+				       ret.empty() ? "" : ",", it.first,
+				       it.second);
+			ret.append(buf, (size_t) len);
+		}
+		return ret;
+	}
+
+
+	/*
+	 * Add the ranges in @str to the set. Returns false if @str is
+	 * malformed, the ranges before the bad one are kept.
+	 */
+	inline bool parse(std::string_view str)
+	{
+		std::string tmp(str);
+		const char *p = tmp.c_str();
+		char *end;
+
+		while (*p) {
+			uint64_t lo, hi;
+
+			lo = strtoull(p, &end, 10);
+			if (unlikely(end == p || *end != '-'))
+				return false;
+
+			p = end + 1;
+			hi = strtoull(p, &end, 10);
+			if (unlikely(end == p || (*end && *end != ',')))
+				return false;
+
+			add(lo, hi);
+			p = *end ? end + 1 : end;
+		}
+		return true;
+	}
+};
+
+
+} /* namespace tgvisd */
+
+#endif /* #ifndef TGVISD__INTERVALSET_HPP */
@@ -15,15 +15,22 @@
 #include <mutex>
 #include <queue>
 #include <chrono>
+#include <thread>
+#include <vector>
+#include <algorithm>
 #include <cstdio>
 #include <cstring>
 #include <cassert>
 #include <cstdlib>
+#include <cinttypes>
+#include <coroutine>
 #include <unordered_map>
 #include <mysql/MySQL.hpp>
+#include <mysql/errmsg.h>
 #include <tgvisd/common.hpp>
 #include <condition_variable>
 #include <tgvisd/KWorker.hpp>
+#include <tgvisd/Logger/BatchWriter.hpp>
 
 
 namespace tgvisd {
@@ -38,14 +45,16 @@ __cold KWorker::KWorker(Main *main, uint32_t maxThPool, uint32_t maxDbPool,
 	main_(main),
 	maxThPool_(maxThPool),
 	maxNRTasks_(maxNRTasks),
-	activeThPool_(0)
+	activeThPool_(0),
+	maxDbPool_(maxDbPool)
 {
 	uint32_t i;
 
 	initMySQLConfig();
 
 	thPool_ = new thpool[maxThPool];
-	dbPool_ = new dbpool[maxDbPool];
+	dbPool_ = new dbpool[maxDbPool_];
+	dbPoolFree_ = new IdxStack(maxDbPool_);
 
 	for (i = maxThPool; i--;) {
 		thPool_[i].idx  = i;
@@ -53,102 +62,704 @@ __cold KWorker::KWorker(Main *main, uint32_t maxThPool, uint32_t maxDbPool,
 		thPoolStk_.push(i);
 	}
 
-	for (i = maxDbPool; i--;) {
+	/* Slot 0 on top, the reaper warms up the first minDbPool_. */
+	for (i = maxDbPool_; i--;) {
 		dbPool_[i].idx = i;
-		dbPoolStk_.push(i);
+		dbPoolFree_->push(i);
 	}
 
+	/*
+	 * There are only maxNRTasks indices in flight, so neither ring
+	 * can ever be full.
+	 */
+	freeTask_   = new MPMCRing<uint32_t>(maxNRTasks);
+	tasksQueue_ = new MPMCRing<uint32_t>(maxNRTasks);
 	tasks_ = new task_work[maxNRTasks];
 	for (i = maxNRTasks; i--;) {
 		tasks_[i].idx = i;
-		freeTask_.push(i);
+		freeTask_->push(i);
 	}
+
+	readyQueue_ = new MPMCRing<void *>(4096);
+
+	dbReaperTh_ = new std::thread([this]{
+		this->runDbReaper();
+	});
+#if defined(__linux__)
+	pthread_setname_np(dbReaperTh_->native_handle(), "tgv-dbreaper");
+#endif
+
+	warmUpTh_ = new std::thread([this]{
+		this->warmUp();
+	});
+#if defined(__linux__)
+	pthread_setname_np(warmUpTh_->native_handle(), "tgv-warmup");
+#endif
+
+	/*
+	 * TDLib answers to co_await send_query_async() come back on the
+	 * Td loop thread, hand them over to the workers instead.
+	 */
+	td_->setAwaitResumer([this](std::coroutine_handle<> h){
+		this->scheduleHandle(h);
+	});
+
+	batchWriter_ = new Logger::BatchWriter(this);
 }
 
 
 __hot int KWorker::submitTaskWork(struct task_work *tw)
-	__acquires(&taskLock_)
-	__releases(&taskLock_)
 {
 	uint32_t idx;
 
-	taskLock_.lock();
-	if (unlikely(tasks_ == nullptr) || freeTask_.empty()) {
-		taskLock_.unlock();
+	if (unlikely(tasks_ == nullptr) || !freeTask_->pop(&idx)) {
+		nrRejected_.fetch_add(1, std::memory_order_relaxed);
 		return -EAGAIN;
 	}
-	idx = freeTask_.top();
-	freeTask_.pop();
+
 	tasks_[idx] = std::move(*tw);
 	tasks_[idx].idx = idx;
-	tasksQueue_.push(idx);
-	taskLock_.unlock();
+	tasksQueue_->push(idx);
+	nrSubmitted_.fetch_add(1, std::memory_order_relaxed);
+
+	notifyWork(tasksQueue_->size());
+	return 0;
+}
+
+
+/*
+ * Called after queueing a task or a coroutine, @nr_queued is how much
+ * work is waiting in the queue it was put on.
+ */
+__hot void KWorker::notifyWork(size_t nr_queued)
+{
+	uint32_t act_thread;
+
+	/*
+	 * Pairs with the fence in runThreadPool(). Either the worker
+	 * sees the work before it parks, or we see it parked.
+	 */
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (nrIdleWorkers_.load(std::memory_order_relaxed)) {
+		wakeWorker();
+		return;
+	}
 
-	if (activeThPool_.load() <= tasksQueue_.size())
+	act_thread = activeThPool_.load(std::memory_order_relaxed);
+	if (act_thread < maxThPool_ && act_thread <= nr_queued)
 		masterCond_.notify_one();
-	else
-		taskCond_.notify_one();
+}
 
-	return 0;
+
+/*
+ * Queue a suspended coroutine to be resumed by a worker.
+ */
+__hot void KWorker::scheduleHandle(std::coroutine_handle<> h)
+	__acquires(&readyLock_)
+	__releases(&readyLock_)
+{
+	if (likely(readyQueue_->push(h.address()))) {
+		notifyWork(readyQueue_->size());
+		return;
+	}
+
+	readyLock_.lock();
+	readyOverflow_.push(h.address());
+	nrReadyOverflow_.fetch_add(1);
+	readyLock_.unlock();
+	notifyWork(getNrReady());
+}
+
+
+bool KWorker::popReady(std::coroutine_handle<> *h)
+	__acquires(&readyLock_)
+	__releases(&readyLock_)
+{
+	void *addr = nullptr;
+
+	if (likely(readyQueue_->pop(&addr)))
+		goto out;
+
+	if (likely(!nrReadyOverflow_.load(std::memory_order_relaxed)))
+		return false;
+
+	readyLock_.lock();
+	if (!readyOverflow_.empty()) {
+		addr = readyOverflow_.front();
+		readyOverflow_.pop();
+		nrReadyOverflow_.fetch_sub(1);
+	}
+	readyLock_.unlock();
+
+	if (!addr)
+		return false;
+out:
+	*h = std::coroutine_handle<>::from_address(addr);
+	return true;
+}
+
+
+/*
+ * Resume a bounded batch of ready coroutines so queued tasks don't
+ * starve. Returns true if at least one was resumed.
+ */
+__hot bool KWorker::runReadyQueue(struct thpool *pool)
+{
+	std::coroutine_handle<> h;
+	uint32_t i;
+
+	for (i = 0; i < 64; i++) {
+		if (!popReady(&h))
+			break;
+
+		if (!i)
+			pool->setUninterruptible();
+
+		h.resume();
+	}
+
+	if (!i)
+		return false;
+
+	pool->setInterruptible();
+	nrResumed_.fetch_add(i, std::memory_order_relaxed);
+	return true;
+}
+
+
+struct detached_task {
+	struct promise_type {
+		inline detached_task get_return_object(void) noexcept
+		{
+			return {};
+		}
+
+
+		inline std::suspend_never initial_suspend(void) noexcept
+		{
+			return {};
+		}
+
+
+		inline std::suspend_never final_suspend(void) noexcept
+		{
+			return {};
+		}
+
+
+		inline void return_void(void) noexcept
+		{
+		}
+
+
+		inline void unhandled_exception(void) noexcept
+		{
+			std::terminate();
+		}
+	};
+};
+
+
+static detached_task run_detached(KWorker *kwrk, Task<void> task,
+				  std::shared_ptr<std::promise<void>> done)
+{
+	co_await kwrk->schedule();
+
+	try {
+		co_await std::move(task);
+	} catch (const std::exception &e) {
+		pr_err("Uncaught exception in KWorker task: %s", e.what());
+	}
+
+	if (done)
+		done->set_value();
+}
+
+
+/*
+ * Start @task on a worker thread and let it run on its own. When
+ * @done is not NULL, it receives a future that becomes ready once
+ * the task has finished.
+ */
+void KWorker::spawn(Task<void> task, std::future<void> *done)
+{
+	std::shared_ptr<std::promise<void>> p = nullptr;
+
+	if (done) {
+		p = std::make_shared<std::promise<void>>();
+		*done = p->get_future();
+	}
+
+	run_detached(this, std::move(task), std::move(p));
+}
+
+
+void KWorker::wakeWorker(void)
+	__acquires(&taskLock_)
+	__releases(&taskLock_)
+{
+	/*
+	 * A worker parks with taskLock_ held between its last check
+	 * of the queue and the wait, going through the lock makes sure
+	 * the notification can't fall into that window.
+	 */
+	taskLock_.lock();
+	taskLock_.unlock();
+	taskCond_.notify_one();
+	nrWakeups_.fetch_add(1, std::memory_order_relaxed);
+}
+
+
+static inline int64_t dbpool_now_ns(void)
+{
+	using namespace std::chrono;
+
+	return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+
+/*
+ * The server went away under this connection, don't hand it out
+ * again.
+ */
+static inline bool dbpool_conn_lost(mysql::MySQL *db)
+{
+	unsigned int err;
+
+	if (unlikely(!db->getConn()))
+		return true;
+
+	err = (unsigned int)db->getErrno();
+	return unlikely(err == CR_SERVER_GONE_ERROR || err == CR_SERVER_LOST);
 }
 
 
 void KWorker::putDbPool(mysql::MySQL *db)
-	__acquires(&dbPoolLock_)
-	__releases(&dbPoolLock_)
 {
 	struct dbpool *dbp;
+	int64_t now;
 
 	dbp = container_of(db, struct dbpool, db);
-	dbPoolLock_.lock();
-	dbPoolStk_.push(dbp->idx);
-	dbPoolLock_.unlock();
+	now = dbpool_now_ns();
+
+	if (dbpool_conn_lost(db))
+		closeDbSlot(dbp);
+
+	dbp->last_used = now;
+	dbp->last_ping = now;
+	putDbIdx(dbp->idx);
+}
+
+
+/*
+ * Put a free slot back and wake whoever waits for one.
+ */
+__hot void KWorker::putDbIdx(uint32_t idx)
+	__acquires(&dbPoolLock_)
+	__releases(&dbPoolLock_)
+{
+	dbPoolFree_->push(idx);
+
+	/*
+	 * Pairs with the fence in getDbPool(). Either it sees the slot
+	 * we just pushed, or we see it waiting.
+	 */
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (nrDbPoolWaiters_.load(std::memory_order_relaxed)) {
+		dbPoolLock_.lock();
+		dbPoolLock_.unlock();
+		dbPoolCond_.notify_one();
+	}
+}
+
+
+void KWorker::closeDbSlot(struct dbpool *dbp)
+{
+	dbp->db.close();
+	if (dbp->connected) {
+		dbp->connected = false;
+		nrDbConnected_.fetch_sub(1, std::memory_order_relaxed);
+	}
+}
+
+
+/*
+ * Double the wait between connect attempts, from 100ms up to 30s.
+ */
+void KWorker::backoffDb(int64_t now)
+{
+	uint32_t ms;
+
+	ms = dbBackoffMs_.load(std::memory_order_relaxed);
+	ms = ms ? std::min<uint32_t>(ms * 2, 30000) : 100;
+	dbBackoffMs_.store(ms, std::memory_order_relaxed);
+	dbRetryAt_.store(now + (int64_t)ms * 1000000, std::memory_order_release);
+}
+
+
+/*
+ * Returns false without touching the server while we are backing off
+ * from a failed connect, so nobody stalls behind a dead server.
+ */
+bool KWorker::connectDbSlot(struct dbpool *dbp, int64_t now)
+{
+	int64_t retry_at;
+	uint32_t ms;
+
+	retry_at = dbRetryAt_.load(std::memory_order_acquire);
+	if (unlikely(retry_at)) {
+		if (now < retry_at)
+			return false;
+
+		/* One probe per period, everybody else fails fast. */
+		ms = dbBackoffMs_.load(std::memory_order_relaxed);
+		if (!dbRetryAt_.compare_exchange_strong(retry_at,
+				now + (int64_t)ms * 1000000,
+				std::memory_order_acq_rel))
+			return false;
+	}
+
+	closeDbSlot(dbp);
+	try {
+		dbp->db.init(sqlHost_, sqlUser_, sqlPass_, sqlDBName_);
+	} catch (const std::runtime_error &e) {
+		pr_err("connectDbSlot(): %s", e.what());
+		return false;
+	}
+
+	dbp->db.setPort(sqlPort_);
+	dbp->db.setConnectTimeout(dbConnectTimeout_);
+	if (unlikely(!dbp->db.connect())) {
+		pr_err("connectDbSlot(): connect(): %s", dbp->db.getError());
+		nrDbConnectFails_.fetch_add(1, std::memory_order_relaxed);
+		dbp->db.close();
+		backoffDb(now);
+		return false;
+	}
+
+	dbp->connected = true;
+	dbp->last_used = now;
+	dbp->last_ping = now;
+	nrDbConnected_.fetch_add(1, std::memory_order_relaxed);
+	nrDbConnects_.fetch_add(1, std::memory_order_relaxed);
+
+	if (unlikely(retry_at)) {
+		pr_notice("MySQL connection is back");
+		dbBackoffMs_.store(0, std::memory_order_relaxed);
+		dbRetryAt_.store(0, std::memory_order_release);
+	}
+	return true;
+}
+
+
+void KWorker::accountDbWait(std::chrono::steady_clock::time_point wait_start)
+{
+	uint64_t ns, max;
+
+	nrDbAcquired_.fetch_add(1, std::memory_order_relaxed);
+	if (wait_start == std::chrono::steady_clock::time_point{})
+		return;
+
+	ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now() - wait_start).count();
+
+	nrDbWaited_.fetch_add(1, std::memory_order_relaxed);
+	dbWaitNsTotal_.fetch_add(ns, std::memory_order_relaxed);
+	max = dbWaitNsMax_.load(std::memory_order_relaxed);
+	while (ns > max && !dbWaitNsMax_.compare_exchange_weak(max, ns,
+					std::memory_order_relaxed))
+		;
+}
+
+
+/*
+ * Take ownership of the slot we popped and make sure its connection
+ * is alive. Returns NULL (and puts the slot back) if it isn't and
+ * can't be brought back right now.
+ */
+__hot mysql::MySQL *KWorker::prepareDbPool(uint32_t idx,
+				std::chrono::steady_clock::time_point wait_start)
+{
+	struct dbpool *dbp = &dbPool_[idx];
+	int64_t now;
+
+	accountDbWait(wait_start);
+	now = dbpool_now_ns();
+	if (dbp->connected &&
+	    now - dbp->last_ping > (int64_t)dbPingAfterMs_ * 1000000) {
+		if (unlikely(dbp->db.ping())) {
+			nrDbPingFails_.fetch_add(1, std::memory_order_relaxed);
+			closeDbSlot(dbp);
+		} else {
+			dbp->last_ping = now;
+		}
+	}
+
+	if (unlikely(!dbp->connected) && !connectDbSlot(dbp, now)) {
+		putDbIdx(idx);
+		return nullptr;
+	}
+
+	return &dbp->db;
 }
 
 
 mysql::MySQL *KWorker::getDbPool(void)
+{
+	uint32_t idx;
+
+	if (unlikely(!dbPoolFree_) || !dbPoolFree_->pop(&idx))
+		return nullptr;
+
+	return prepareDbPool(idx);
+}
+
+
+/*
+ * Wait up to @timeout for a connection to be put back. Returns
+ * NULL on timeout, when KWorker is stopping or when the server
+ * can't be reached.
+ */
+mysql::MySQL *KWorker::getDbPool(std::chrono::milliseconds timeout)
 	__acquires(&dbPoolLock_)
 	__releases(&dbPoolLock_)
 {
+	std::unique_lock<std::mutex> lk(dbPoolLock_, std::defer_lock);
+	std::chrono::steady_clock::time_point start = {};
+	std::chrono::steady_clock::time_point deadline;
+	bool timed_out = false;
 	uint32_t idx;
-	mysql::MySQL *ret;
 
-	dbPoolLock_.lock();
-	if (unlikely(dbPool_ == nullptr) || dbPoolStk_.empty()) {
-		dbPoolLock_.unlock();
+	if (unlikely(!dbPoolFree_))
 		return nullptr;
+
+	while (!dbPoolFree_->pop(&idx)) {
+		if (unlikely(shouldStop()) || timed_out) {
+			nrDbTimeouts_.fetch_add(1, std::memory_order_relaxed);
+			return nullptr;
+		}
+
+		if (start == std::chrono::steady_clock::time_point{}) {
+			start = std::chrono::steady_clock::now();
+			deadline = start + timeout;
+		}
+
+		lk.lock();
+		nrDbPoolWaiters_.fetch_add(1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (dbPoolFree_->empty() && !shouldStop())
+			timed_out = dbPoolCond_.wait_until(lk, deadline) ==
+				    std::cv_status::timeout;
+		nrDbPoolWaiters_.fetch_sub(1, std::memory_order_relaxed);
+		lk.unlock();
+	}
+
+	return prepareDbPool(idx, start);
+}
+
+
+void KWorker::getDbPoolStats(struct dbpool_stats *st)
+{
+	st->nr_conns         = nrDbConnected_.load(std::memory_order_relaxed);
+	st->nr_min           = minDbPool_;
+	st->nr_max           = maxDbPool_;
+	st->nr_acquired      = nrDbAcquired_.load(std::memory_order_relaxed);
+	st->nr_waited        = nrDbWaited_.load(std::memory_order_relaxed);
+	st->wait_ns_total    = dbWaitNsTotal_.load(std::memory_order_relaxed);
+	st->wait_ns_max      = dbWaitNsMax_.load(std::memory_order_relaxed);
+	st->nr_timeouts      = nrDbTimeouts_.load(std::memory_order_relaxed);
+	st->nr_connects      = nrDbConnects_.load(std::memory_order_relaxed);
+	st->nr_connect_fails = nrDbConnectFails_.load(std::memory_order_relaxed);
+	st->nr_ping_fails    = nrDbPingFails_.load(std::memory_order_relaxed);
+	st->nr_reaped        = nrDbReaped_.load(std::memory_order_relaxed);
+}
+
+
+/*
+ * One pass over the free slots: close the ones that have been idle
+ * for too long, keep the rest alive and bring the pool back up to
+ * minDbPool_ connections. Busy slots are left alone.
+ *
+ * The slots are taken off the free stack like any user would, so a
+ * worker never ends up with one we are pinging or connecting. The
+ * ones that need no network round trip go back right away, the
+ * others one by one as soon as they are done.
+ */
+void KWorker::reapDbPool(void)
+{
+	std::vector<uint32_t> taken, ping, conn;
+	int64_t now, idle_ns, ping_ns;
+	uint32_t idx, nr_conns;
+	size_t i;
+
+	now     = dbpool_now_ns();
+	idle_ns = (int64_t)dbIdleTimeoutMs_ * 1000000;
+	ping_ns = (int64_t)dbPingAfterMs_ * 1000000;
+
+	taken.reserve(maxDbPool_);
+	while (dbPoolFree_->pop(&idx))
+		taken.push_back(idx);
+
+	nr_conns = nrDbConnected_.load(std::memory_order_relaxed);
+	for (auto j: taken) {
+		struct dbpool *dbp = &dbPool_[j];
+
+		if (!dbp->connected)
+			continue;
+
+		if (now - dbp->last_used > idle_ns && nr_conns > minDbPool_) {
+			closeDbSlot(dbp);
+			nrDbReaped_.fetch_add(1, std::memory_order_relaxed);
+			nr_conns--;
+		}
 	}
-	idx = dbPoolStk_.top();
-	dbPoolStk_.pop();
-	dbPoolLock_.unlock();
 
-	ret = &dbPool_[idx].db;
-	if (!ret->getConn()) {
-		ret->init(sqlHost_, sqlUser_, sqlPass_, sqlDBName_);
-		ret->setPort(sqlPort_);
-		ret->connect();
+	/*
+	 * Keep the stack order: disconnected slots at the bottom, the
+	 * most recently used connection on top.
+	 */
+	for (auto j: taken) {
+		if (dbPool_[j].connected)
+			continue;
+
+		if (nr_conns + conn.size() < minDbPool_ && !shouldStop())
+			conn.push_back(j);
+		else
+			putDbIdx(j);
+	}
+
+	for (i = taken.size(); i--;) {
+		struct dbpool *dbp = &dbPool_[taken[i]];
+
+		if (!dbp->connected)
+			continue;
+
+		if (now - dbp->last_ping > ping_ns)
+			ping.push_back(taken[i]);
+		else
+			putDbIdx(taken[i]);
+	}
+
+	for (auto j: ping) {
+		struct dbpool *dbp = &dbPool_[j];
+
+		if (unlikely(dbp->db.ping())) {
+			nrDbPingFails_.fetch_add(1, std::memory_order_relaxed);
+			closeDbSlot(dbp);
+		} else {
+			dbp->last_ping = now;
+		}
+		putDbIdx(j);
+	}
+
+	for (auto j: conn) {
+		if (!shouldStop())
+			connectDbSlot(&dbPool_[j], now);
+		putDbIdx(j);
 	}
-	return ret;
 }
 
 
-struct task_work *KWorker::getTaskWork(void)
-	__acquires(&taskLock_)
-	__releases(&taskLock_)
+void KWorker::runDbReaper(void)
+	__acquires(&dbReaperLock_)
+	__releases(&dbReaperLock_)
+{
+	std::unique_lock<std::mutex> lk(dbReaperLock_, std::defer_lock);
+
+	while (!shouldStop()) {
+		reapDbPool();
+
+		lk.lock();
+		dbReaperCond_.wait_for(lk, 1000ms);
+		lk.unlock();
+	}
+}
+
+
+/*
+ * Load the scrape cursors and the message id index. Both are usable
+ * (just less useful) until this is done.
+ */
+__cold void KWorker::warmUp(void)
+{
+	mysql::MySQL *db = nullptr;
+
+	while (!shouldStop()) {
+		db = getDbPool(1000ms);
+		if (likely(db))
+			break;
+	}
+
+	if (unlikely(!db))
+		return;
+
+	scrapeState_.load(db);
+	if (!shouldStop())
+		warmMsgIdIndex(db);
+
+	putDbPool(db);
+	warm_.store(true, std::memory_order_release);
+}
+
+
+/*
+ * Load every stored (tg_group_id, tg_msg_id) pair into msgIdIndex_,
+ * the rows are streamed.
+ */
+__cold void KWorker::warmMsgIdIndex(mysql::MySQL *db)
+{
+	static const char q[] =
+		"SELECT gt_groups.tg_group_id, gt_messages.tg_msg_id "
+		"FROM gt_messages "
+		"INNER JOIN gt_chat_group ON gt_chat_group.chat_id = gt_messages.chat_id "
+		"INNER JOIN gt_groups ON gt_groups.id = gt_chat_group.group_id";
+
+	std::chrono::steady_clock::time_point start;
+	mysql::MySQLRes *res;
+	uint64_t nr_rows = 0;
+	int64_t ms;
+
+	start = std::chrono::steady_clock::now();
+	if (unlikely(db->realQuery(q, sizeof(q) - 1))) {
+		pr_err("warmMsgIdIndex(): query(): %s", db->getError());
+		return;
+	}
+
+	res = db->useResult();
+	if (MYSQL_IS_ERR_OR_NULL(res)) {
+		pr_err("warmMsgIdIndex(): useResult(): %s", db->getError());
+		return;
+	}
+
+	while (res->next()) {
+		msgIdIndex_.add(res->getInt64(0), res->getUInt64(1));
+
+		if (unlikely(!(++nr_rows % 65536) && shouldStop()))
+			break;
+	}
+
+	delete res;
+	if (unlikely(db->getErrno())) {
+		pr_err("warmMsgIdIndex(): useResult(): %s", db->getError());
+		return;
+	}
+
+	ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now() - start).count();
+	pr_notice("Message id index: %" PRIu64 " ids loaded in %" PRId64 " ms "
+		  "(%zu KiB)", nr_rows, ms, msgIdIndex_.memUsage() / 1024);
+}
+
+
+__hot struct task_work *KWorker::getTaskWork(void)
 {
 	uint32_t idx;
 	struct task_work *ret;
 
-	taskLock_.lock();
-	if (unlikely(tasks_ == nullptr) || tasksQueue_.empty()) {
-		taskLock_.unlock();
+	if (unlikely(tasks_ == nullptr) || !tasksQueue_->pop(&idx))
 		return nullptr;
-	}
-	idx = tasksQueue_.front();
-	tasksQueue_.pop();
-	ret = &tasks_[idx];
-	taskLock_.unlock();
 
+	ret = &tasks_[idx];
 	if (unlikely(ret->idx != idx)) {
 		panic("Bug ret->idx != idx");
 		__builtin_unreachable();
@@ -157,14 +768,24 @@ struct task_work *KWorker::getTaskWork(void)
 }
 
 
-void KWorker::putTaskWork(struct task_work *tw)
+__hot void KWorker::putTaskWork(struct task_work *tw)
 	__acquires(&taskLock_)
 	__releases(&taskLock_)
 {
-	taskLock_.lock();
-	freeTask_.push(tw->idx);
-	taskLock_.unlock();
-	taskPutCond_.notify_one();
+	if (tw->done) {
+		tw->done->set_value();
+		tw->done = nullptr;
+	}
+
+	freeTask_->push(tw->idx);
+
+	/* Pairs with the fence in waitQueue(). */
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (unlikely(nrPutWaiters_.load(std::memory_order_relaxed))) {
+		taskLock_.lock();
+		taskLock_.unlock();
+		taskPutCond_.notify_one();
+	}
 }
 
 
@@ -208,14 +829,28 @@ void KWorker::runThreadPool(struct thpool *pool)
 	struct task_work *tw;
 	std::unique_lock<std::mutex> lk(taskLock_, std::defer_lock);
 
+	currentThPool_ = pool;
 	activeThPool_++;
 	while (!(pool->stop || shouldStop())) {
 		struct tw_data data;
+		bool resumed;
 
+		resumed = runReadyQueue(pool);
 		tw = getTaskWork();
 		if (!tw) {
+			std::cv_status cvret = std::cv_status::no_timeout;
+
+			if (resumed) {
+				idle_c = 0;
+				continue;
+			}
+
 			lk.lock();
-			auto cvret = taskCond_.wait_for(lk, 5000ms);
+			nrIdleWorkers_.fetch_add(1);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (!tasksQueue_->size() && !getNrReady())
+				cvret = taskCond_.wait_for(lk, 5000ms);
+			nrIdleWorkers_.fetch_sub(1);
 			lk.unlock();
 
 			if (cvret != std::cv_status::timeout)
@@ -349,7 +984,7 @@ void KWorker::runMasterKWorker(void)
 		handleJoinQueue();
 
 		act_thread    = activeThPool_.load();
-		num_of_queues = tasksQueue_.size();
+		num_of_queues = tasksQueue_->size() + getNrReady();
 
 		if (num_of_queues >= act_thread && act_thread < maxThPool_) {
 			uint32_t i, loop_c;
@@ -394,6 +1029,38 @@ __cold void KWorker::initMySQLConfig(void)
 		throw std::runtime_error("Missing TGVISD_MYSQL_PORT env");
 
 	sqlPort_ = (uint16_t)atoi(tmp);
+
+	tmp = getenv("TGVISD_MYSQL_POOL_MAX");
+	if (tmp)
+		maxDbPool_ = (uint32_t)strtoul(tmp, NULL, 10);
+	if (unlikely(!maxDbPool_))
+		maxDbPool_ = 1;
+
+	tmp = getenv("TGVISD_MYSQL_POOL_MIN");
+	if (tmp)
+		minDbPool_ = (uint32_t)strtoul(tmp, NULL, 10);
+	if (minDbPool_ > maxDbPool_)
+		minDbPool_ = maxDbPool_;
+
+	tmp = getenv("TGVISD_MYSQL_PING_AFTER_MS");
+	if (tmp)
+		dbPingAfterMs_ = (uint32_t)strtoul(tmp, NULL, 10);
+
+	tmp = getenv("TGVISD_MYSQL_IDLE_TIMEOUT_MS");
+	if (tmp)
+		dbIdleTimeoutMs_ = (uint32_t)strtoul(tmp, NULL, 10);
+
+	tmp = getenv("TGVISD_MYSQL_CONNECT_TIMEOUT");
+	if (tmp)
+		dbConnectTimeout_ = (uint32_t)strtoul(tmp, NULL, 10);
+
+	tmp = getenv("TGVISD_MYSQL_SAVE_MODE");
+	if (tmp) {
+		if (!strcmp(tmp, "proc"))
+			dbSaveProc_ = true;
+		else if (unlikely(strcmp(tmp, "stmt")))
+			throw std::runtime_error("Invalid TGVISD_MYSQL_SAVE_MODE env");
+	}
 }
 
 
@@ -404,6 +1071,12 @@ __cold void KWorker::cleanUp(void)
 	dropChatLock_ = true;
 	dropUserLock_ = true;
 
+	/*
+	 * Td outlives us. Main has cancelled every pending query by now,
+	 * anything that still completes is resumed on the Td thread.
+	 */
+	td_->setAwaitResumer(nullptr);
+
 	if (thPool_) {
 		joinQueueLock_.lock();
 		thPoolLock_.lock();
@@ -437,11 +1110,41 @@ __cold void KWorker::cleanUp(void)
 	}
 
 
+	/*
+	 * The workers may be waiting for a group commit, only stop the
+	 * batch writer after all of them have been joined.
+	 */
+	if (batchWriter_) {
+		delete batchWriter_;
+		batchWriter_ = nullptr;
+	}
+
+	if (warmUpTh_) {
+		stop_ = true;
+		dbPoolCond_.notify_all();
+		warmUpTh_->join();
+		delete warmUpTh_;
+		warmUpTh_ = nullptr;
+	}
+
+	if (dbReaperTh_) {
+		stop_ = true;
+		dbReaperCond_.notify_all();
+		dbReaperTh_->join();
+		delete dbReaperTh_;
+		dbReaperTh_ = nullptr;
+	}
+
 	if (dbPool_) {
 		delete[] dbPool_;
 		dbPool_ = nullptr;
 	}
 
+	if (dbPoolFree_) {
+		delete dbPoolFree_;
+		dbPoolFree_ = nullptr;
+	}
+
 	if (tasks_) {
 		for (i = 0; i < maxNRTasks_; i++) {
 			struct task_work *tw;
@@ -452,11 +1155,33 @@ __cold void KWorker::cleanUp(void)
 				tw->deleter = nullptr;
 			}
 			tw->payload = nullptr;
+
+			/* Waiters get std::future_error(broken_promise). */
+			tw->done = nullptr;
 		}
 		delete[] tasks_;
 		tasks_ = nullptr;
 	}
 
+	if (freeTask_) {
+		delete freeTask_;
+		freeTask_ = nullptr;
+	}
+
+	if (tasksQueue_) {
+		delete tasksQueue_;
+		tasksQueue_ = nullptr;
+	}
+
+	/*
+	 * Coroutines still queued here never get resumed, their frames
+	 * are dropped with the process.
+	 */
+	if (readyQueue_) {
+		delete readyQueue_;
+		readyQueue_ = nullptr;
+	}
+
 	clmLock_.lock();
 	for (auto &i: chatLockMap_) {
 		std::mutex *mut;
@@ -19,19 +19,34 @@
 #include <mutex>
 #include <queue>
 #include <chrono>
+#include <future>
+#include <memory>
+#include <coroutine>
 #include <cstdio>
 #include <cstring>
 #include <cassert>
 #include <cstdlib>
+#include <exception>
 #include <functional>
 #include <unordered_map>
 #include <mysql/MySQL.hpp>
 #include <tgvisd/Main.hpp>
 #include <tgvisd/Td/Td.hpp>
 #include <tgvisd/common.hpp>
+#include <tgvisd/IdxStack.hpp>
+#include <tgvisd/MPMCRing.hpp>
+#include <tgvisd/MsgIdIndex.hpp>
+#include <tgvisd/ScrapeState.hpp>
+#include <tgvisd/IdentityCache.hpp>
+#include <tgvisd/Task.hpp>
 #include <condition_variable>
 
 
+namespace tgvisd::Logger {
+class BatchWriter;
+} /* namespace tgvisd::Logger */
+
+
 namespace tgvisd {
 
 
@@ -52,9 +67,35 @@ struct thpool {
 };
 
 
+/*
+ * A pool slot. Whoever popped @idx from the free stack (a worker or
+ * the reaper) owns the slot and everything below it until it is
+ * pushed back.
+ */
 struct dbpool {
 	mysql::MySQL				db;
 	uint32_t				idx;
+	bool					connected = false;
+
+	/* steady_clock, in nanoseconds. */
+	int64_t					last_used = 0;
+	int64_t					last_ping = 0;
+};
+
+
+struct dbpool_stats {
+	uint32_t				nr_conns;
+	uint32_t				nr_min;
+	uint32_t				nr_max;
+	uint64_t				nr_acquired;
+	uint64_t				nr_waited;
+	uint64_t				wait_ns_total;
+	uint64_t				wait_ns_max;
+	uint64_t				nr_timeouts;
+	uint64_t				nr_connects;
+	uint64_t				nr_connect_fails;
+	uint64_t				nr_ping_fails;
+	uint64_t				nr_reaped;
 };
 
 
@@ -70,6 +111,12 @@ struct task_work {
 	std::function<void(void *payload)>	deleter = nullptr;
 	void					*payload;
 	uint32_t				idx;
+
+	/*
+	 * Set by submitTaskWork() when the caller asks for a
+	 * completion handle. Fulfilled after @func and @deleter ran.
+	 */
+	std::shared_ptr<std::promise<void>>	done    = nullptr;
 };
 
 
@@ -85,6 +132,7 @@ private:
 	struct dbpool		*dbPool_       = nullptr;
 	std::thread		*masterTh_     = nullptr;
 	struct task_work	*tasks_        = nullptr;
+	Logger::BatchWriter	*batchWriter_  = nullptr;
 	uint32_t		maxThPool_     = 32;
 	uint32_t		maxNRTasks_    = 0;
 	std::atomic<uint32_t>	activeThPool_  = 0;
@@ -92,14 +140,84 @@ private:
 	std::condition_variable masterCond_;
 	std::mutex		thPoolLock_;
 	std::stack<uint32_t>	thPoolStk_;
+
+	/*
+	 * Free pool slots. Getting and putting a connection never takes
+	 * a lock, dbPoolLock_ is only used to park threads waiting for
+	 * one.
+	 */
+	IdxStack		*dbPoolFree_     = nullptr;
+	uint32_t		maxDbPool_       = 256;
+	uint32_t		minDbPool_       = 2;
 	std::mutex		dbPoolLock_;
-	std::stack<uint32_t>	dbPoolStk_;
+	std::condition_variable	dbPoolCond_;
+	std::atomic<uint32_t>	nrDbPoolWaiters_ = 0;
+
+	/*
+	 * Pool health. Connections that sat idle longer than
+	 * dbPingAfterMs_ are pinged before they are handed out. After a
+	 * failed connect, only one connect attempt per backoff period
+	 * is made (dbRetryAt_), everybody else fails right away.
+	 */
+	uint32_t		dbPingAfterMs_     = 30000;
+	uint32_t		dbIdleTimeoutMs_   = 300000;
+	uint32_t		dbConnectTimeout_  = 5;
+	std::atomic<int64_t>	dbRetryAt_         = 0;
+	std::atomic<uint32_t>	dbBackoffMs_       = 0;
+	std::atomic<uint32_t>	nrDbConnected_     = 0;
+
+	/* Closes idle connections, keeps minDbPool_ of them up. */
+	std::thread		*dbReaperTh_ = nullptr;
+	std::mutex		dbReaperLock_;
+	std::condition_variable	dbReaperCond_;
+
+	std::atomic<uint64_t>	nrDbAcquired_      = 0;
+	std::atomic<uint64_t>	nrDbWaited_        = 0;
+	std::atomic<uint64_t>	dbWaitNsTotal_     = 0;
+	std::atomic<uint64_t>	dbWaitNsMax_       = 0;
+	std::atomic<uint64_t>	nrDbTimeouts_      = 0;
+	std::atomic<uint64_t>	nrDbConnects_      = 0;
+	std::atomic<uint64_t>	nrDbConnectFails_  = 0;
+	std::atomic<uint64_t>	nrDbPingFails_     = 0;
+	std::atomic<uint64_t>	nrDbReaped_        = 0;
+
+	/*
+	 * Save each message with one CALL of gt_save_text_message()
+	 * (migrations/0002) instead of a statement per table. Cleared
+	 * if the procedure turns out to be missing.
+	 */
+	std::atomic<bool>	dbSaveProc_        = false;
+
+	/*
+	 * Task slot indices. Submitting and fetching a task never takes
+	 * a lock, taskLock_ is only used to park idle workers (and
+	 * submitters waiting for a free slot) on the condvars.
+	 */
+	MPMCRing<uint32_t>	*freeTask_     = nullptr;
+	MPMCRing<uint32_t>	*tasksQueue_   = nullptr;
 
 	std::condition_variable taskPutCond_;
 	std::condition_variable	taskCond_;
 	std::mutex		taskLock_;
-	std::stack<uint32_t>	freeTask_;
-	std::queue<uint32_t>	tasksQueue_;
+	std::atomic<uint32_t>	nrIdleWorkers_ = 0;
+	std::atomic<uint32_t>	nrPutWaiters_  = 0;
+
+	std::atomic<uint64_t>	nrSubmitted_   = 0;
+	std::atomic<uint64_t>	nrRejected_    = 0;
+	std::atomic<uint64_t>	nrWakeups_     = 0;
+
+	/*
+	 * Coroutines that are ready to run again. Workers drain this
+	 * before picking up a new task. The ring only overflows into
+	 * readyOverflow_ when thousands of them get ready at once.
+	 */
+	MPMCRing<void *>	*readyQueue_   = nullptr;
+	std::mutex		readyLock_;
+	std::queue<void *>	readyOverflow_;
+	std::atomic<size_t>	nrReadyOverflow_ = 0;
+	std::atomic<uint64_t>	nrResumed_     = 0;
+
+	static inline thread_local struct thpool *currentThPool_ = nullptr;
 
 	std::mutex		joinQueueLock_;
 	std::queue<uint32_t>	joinQueue_;
@@ -110,6 +228,26 @@ private:
 	std::mutex					ulmLock_;
 	std::unordered_map<int64_t, std::mutex *>	userLockMap_;
 
+	/* tg_group_id -> gt_chats.id and gt_groups.id */
+	IdentityCache<int64_t>	chatPKCache_;
+	IdentityCache<int64_t>	groupPKCache_;
+
+	/* tg_user_id -> gt_senders.id, the mapping never changes. */
+	IdentityCache<int64_t, 16>	senderPKCache_;
+
+	/*
+	 * tg_group_id -> stored tg_msg_ids, loaded from gt_messages by
+	 * warmUpTh_ at startup and kept up to date by the batch writer.
+	 */
+	MsgIdIndex<16>		msgIdIndex_;
+
+	/* tg_group_id -> where to resume scraping, see ScrapeState. */
+	ScrapeState		scrapeState_;
+	std::thread		*warmUpTh_ = nullptr;
+
+	/* Set once warmUpTh_ is done with both, successful or not. */
+	std::atomic<bool>	warm_ = false;
+
 	const char		*sqlHost_   = nullptr;
 	const char		*sqlUser_   = nullptr;
 	const char		*sqlPass_   = nullptr;
@@ -123,7 +261,22 @@ private:
 	struct task_work *getTaskWork(void);
 	struct thpool *getThPool(void);
 	void putTaskWork(struct task_work *tw);
+	void wakeWorker(void);
+	void notifyWork(size_t nr_queued);
+	bool popReady(std::coroutine_handle<> *h);
+	bool runReadyQueue(struct thpool *pool);
 	void initMySQLConfig(void);
+	mysql::MySQL *prepareDbPool(uint32_t idx,
+				    std::chrono::steady_clock::time_point wait_start = {});
+	void putDbIdx(uint32_t idx);
+	bool connectDbSlot(struct dbpool *dbp, int64_t now);
+	void closeDbSlot(struct dbpool *dbp);
+	void backoffDb(int64_t now);
+	void accountDbWait(std::chrono::steady_clock::time_point wait_start);
+	void runDbReaper(void);
+	void warmUp(void);
+	void warmMsgIdIndex(mysql::MySQL *db);
+	void reapDbPool(void);
 
 public:
 	inline ~KWorker(void)
@@ -136,16 +289,197 @@ public:
 		uint32_t maxNRTasks = 512);
 	int submitTaskWork(struct task_work *tw);
 	mysql::MySQL *getDbPool(void);
+	mysql::MySQL *getDbPool(std::chrono::milliseconds timeout);
 	void putDbPool(mysql::MySQL *db);
+	void getDbPoolStats(struct dbpool_stats *st);
 	std::mutex *getChatLock(int64_t tg_chat_id);
 	std::mutex *getUserLock(int64_t tg_user_id);
+	void scheduleHandle(std::coroutine_handle<> h);
+	void spawn(Task<void> task, std::future<void> *done = nullptr);
+
+
+	struct ScheduleAwaiter {
+		KWorker		*kwrk_;
+
+		inline bool await_ready(void) const noexcept
+		{
+			return false;
+		}
+
+
+		inline bool await_suspend(std::coroutine_handle<> h)
+		{
+			/* Nobody would pick it up, just keep going. */
+			if (unlikely(kwrk_->shouldStop()))
+				return false;
+
+			kwrk_->scheduleHandle(h);
+			return true;
+		}
+
+
+		inline void await_resume(void) const noexcept
+		{
+		}
+	};
+
+
+	/*
+	 * co_await kwrk->schedule() moves the calling coroutine onto a
+	 * KWorker thread.
+	 */
+	inline ScheduleAwaiter schedule(void)
+	{
+		return ScheduleAwaiter{this};
+	}
+
+
+	/*
+	 * The worker thread the caller runs on, NULL if it isn't one.
+	 */
+	inline static struct thpool *getCurrentThPool(void)
+	{
+		return currentThPool_;
+	}
+
+
+	/*
+	 * Number of coroutines waiting for a worker to resume them.
+	 */
+	inline size_t getNrReady(void)
+	{
+		if (unlikely(!readyQueue_))
+			return 0;
+
+		return readyQueue_->size() +
+		       nrReadyOverflow_.load(std::memory_order_relaxed);
+	}
+
+
+	inline uint64_t getNrResumed(void)
+	{
+		return nrResumed_.load(std::memory_order_relaxed);
+	}
 
 
 	template<class Rep, class Period>
 	inline void waitQueue(const duration<Rep, Period> &rel_time)
+	{
+		waitQueueUntil(std::chrono::steady_clock::now() + rel_time);
+	}
+
+
+	/*
+	 * Wait until a task slot is put back or @deadline passes.
+	 * Returns false on timeout.
+	 */
+	template<class Clock, class Duration>
+	inline bool waitQueueUntil(const std::chrono::time_point<Clock, Duration> &deadline)
 	{
 		std::unique_lock<std::mutex> lk(taskLock_);
-		taskPutCond_.wait_for(lk, rel_time);
+		bool ret = true;
+
+		nrPutWaiters_.fetch_add(1);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (freeTask_ && !freeTask_->size() && !shouldStop())
+			ret = taskPutCond_.wait_until(lk, deadline) !=
+			      std::cv_status::timeout;
+		nrPutWaiters_.fetch_sub(1);
+		return ret;
+	}
+
+
+	/*
+	 * Like submitTaskWork(), but wait up to @timeout for a free
+	 * task slot instead of failing right away. The caller is woken
+	 * as soon as a worker puts a slot back.
+	 *
+	 * If @done is not NULL, it receives a future that becomes
+	 * ready once the task has run.
+	 *
+	 * Returns 0 on success, -ETIMEDOUT or -ECANCELED (KWorker is
+	 * stopping). On failure @tw is left untouched, the caller
+	 * still owns its payload.
+	 */
+	template<class Rep, class Period>
+	inline int submitTaskWork(struct task_work *tw,
+				  const duration<Rep, Period> &timeout,
+				  std::future<void> *done = nullptr)
+	{
+		auto deadline = std::chrono::steady_clock::now() + timeout;
+		int ret;
+
+		if (done) {
+			tw->done = std::make_shared<std::promise<void>>();
+			*done = tw->done->get_future();
+		}
+
+		while (1) {
+			ret = submitTaskWork(tw);
+			if (likely(ret != -EAGAIN))
+				break;
+
+			if (unlikely(shouldStop())) {
+				ret = -ECANCELED;
+				break;
+			}
+
+			if (!waitQueueUntil(deadline)) {
+				ret = -ETIMEDOUT;
+				break;
+			}
+		}
+
+		if (unlikely(ret) && done) {
+			tw->done = nullptr;
+			*done = std::future<void>();
+		}
+		return ret;
+	}
+
+
+	/*
+	 * Number of submitted tasks no worker has picked up yet.
+	 */
+	inline size_t getQueueDepth(void)
+	{
+		return tasksQueue_ ? tasksQueue_->size() : 0;
+	}
+
+
+	inline uint32_t getNrActiveWorkers(void)
+	{
+		return activeThPool_.load(std::memory_order_relaxed);
+	}
+
+
+	inline uint32_t getNrIdleWorkers(void)
+	{
+		return nrIdleWorkers_.load(std::memory_order_relaxed);
+	}
+
+
+	inline uint64_t getNrSubmitted(void)
+	{
+		return nrSubmitted_.load(std::memory_order_relaxed);
+	}
+
+
+	/*
+	 * Number of submitTaskWork() calls that got -EAGAIN.
+	 */
+	inline uint64_t getNrRejected(void)
+	{
+		return nrRejected_.load(std::memory_order_relaxed);
+	}
+
+
+	/*
+	 * Number of times a submitter had to wake a parked worker.
+	 */
+	inline uint64_t getNrWakeups(void)
+	{
+		return nrWakeups_.load(std::memory_order_relaxed);
 	}
 
 
@@ -167,6 +501,8 @@ public:
 		taskCond_.notify_all();
 		masterCond_.notify_all();
 		taskPutCond_.notify_all();
+		dbPoolCond_.notify_all();
+		dbReaperCond_.notify_all();
 	}
 
 
@@ -182,6 +518,60 @@ public:
 	}
 
 
+	inline IdentityCache<int64_t> *getChatPKCache(void)
+	{
+		return &chatPKCache_;
+	}
+
+
+	inline IdentityCache<int64_t> *getGroupPKCache(void)
+	{
+		return &groupPKCache_;
+	}
+
+
+	inline IdentityCache<int64_t, 16> *getSenderPKCache(void)
+	{
+		return &senderPKCache_;
+	}
+
+
+	inline MsgIdIndex<16> *getMsgIdIndex(void)
+	{
+		return &msgIdIndex_;
+	}
+
+
+	inline ScrapeState *getScrapeState(void)
+	{
+		return &scrapeState_;
+	}
+
+
+	inline bool isWarm(void)
+	{
+		return warm_.load(std::memory_order_acquire);
+	}
+
+
+	inline Logger::BatchWriter *getBatchWriter(void)
+	{
+		return batchWriter_;
+	}
+
+
+	inline bool useSaveProc(void)
+	{
+		return dbSaveProc_.load(std::memory_order_relaxed);
+	}
+
+
+	inline void disableSaveProc(void)
+	{
+		dbSaveProc_.store(false, std::memory_order_relaxed);
+	}
+
+
 	inline static void setMasterThreadName(std::thread *task)
 	{
 #if defined(__linux__)
@@ -216,6 +606,16 @@ public:
 	}
 
 
+	inline td_api::object_ptr<td_api::message> getMessage(int64_t chat_id,
+							      int64_t msg_id)
+	{
+		return td_->send_query_sync<td_api::getMessage, td_api::message>(
+			td_api::make_object<td_api::getMessage>(chat_id, msg_id),
+			query_sync_timeout
+		);
+	}
+
+
 	inline td_api::object_ptr<td_api::messages> getChatHistory(
 				int64_t chat_id,
 				int64_t from_msg_id,
@@ -238,6 +638,43 @@ public:
 	}
 
 
+	/*
+	 * Send a getChatHistory without waiting for the answer, pick it
+	 * up later with waitChatHistory().
+	 */
+	inline std::future<Td::query_result<td_api::messages>>
+	getChatHistoryFuture(int64_t chat_id, int64_t from_msg_id,
+			     int32_t offset, int32_t limit,
+			     bool only_local = false)
+	{
+		if (unlikely(td_->getCancelDelayedWork()))
+			return {};
+
+		return td_->send_query_future<td_api::getChatHistory, td_api::messages>(
+			td_api::make_object<td_api::getChatHistory>(
+				chat_id,
+				from_msg_id,
+				offset,
+				limit,
+				only_local
+			)
+		);
+	}
+
+
+	inline td_api::object_ptr<td_api::messages> waitChatHistory(
+				std::future<Td::query_result<td_api::messages>> &fut,
+				td_api::object_ptr<td_api::error> *err = nullptr)
+	{
+		if (unlikely(!fut.valid()))
+			return nullptr;
+
+		return Td::query_future_get<td_api::messages>(fut,
+							      query_sync_timeout,
+							      err);
+	}
+
+
 	inline td_api::object_ptr<td_api::user> getUser(int64_t user_id)
 	{
 		return td_->send_query_sync<td_api::getUser, td_api::user>(
@@ -0,0 +1,620 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * @author Ammar Faizi <ammarfaizi2@gmail.com>
+ * @license GPL-2.0-only
+ * @package tgvisd::Logger
+ *
+ * Copyright (C) 2022  Ammar Faizi <ammarfaizi2@gmail.com>
+ */
+
+#include <map>
+#include <string>
+#include <optional>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <inttypes.h>
+#include <tgvisd/mysql_helpers.hpp>
+#include <tgvisd/Logger/Message.hpp>
+#include <tgvisd/Logger/BatchWriter.hpp>
+
+namespace tgvisd::Logger {
+
+struct batch_row {
+	struct batch_entry	*ent;
+	uint64_t		tg_msg_id;
+	uint64_t		pk_message_id;
+	std::optional<uint64_t>	fwd_sender_id;
+};
+
+using batch_key = std::pair<uint64_t, uint64_t>;
+
+BatchWriter::BatchWriter(KWorker *kworker):
+	kworker_(kworker)
+{
+	initConfig();
+	pending_.reserve(maxRows_);
+	thread_ = new std::thread([this]{
+		this->run();
+	});
+#if defined(__linux__)
+	pthread_setname_np(thread_->native_handle(), "tgv-batchwr");
+#endif
+}
+
+BatchWriter::~BatchWriter(void)
+{
+	stop();
+
+	if (db_) {
+		kworker_->putDbPool(db_);
+		db_ = nullptr;
+	}
+}
+
+__cold void BatchWriter::initConfig(void)
+{
+	const char *tmp;
+
+	tmp = getenv("TGVISD_BATCH_ROWS");
+	if (tmp) {
+		maxRows_ = (uint32_t)strtoul(tmp, NULL, 10);
+		if (unlikely(!maxRows_))
+			throw std::runtime_error("Invalid TGVISD_BATCH_ROWS env");
+	}
+
+	tmp = getenv("TGVISD_BATCH_DELAY_MS");
+	if (tmp)
+		maxDelay_ = std::chrono::milliseconds(strtoul(tmp, NULL, 10));
+}
+
+void BatchWriter::stop(void)
+	__acquires(&lock_)
+	__releases(&lock_)
+{
+	lock_.lock();
+	stop_ = true;
+	lock_.unlock();
+	cond_.notify_all();
+
+	if (thread_) {
+		thread_->join();
+		delete thread_;
+		thread_ = nullptr;
+	}
+}
+
+std::future<uint64_t> BatchWriter::submit(struct batch_entry *ent)
+	__acquires(&lock_)
+	__releases(&lock_)
+{
+	size_t nr_pending;
+	std::future<uint64_t> ret = ent->done.get_future();
+
+	lock_.lock();
+	if (unlikely(stop_)) {
+		lock_.unlock();
+		ent->done.set_value(0);
+		return ret;
+	}
+	pending_.push_back(ent);
+	nr_pending = pending_.size();
+	lock_.unlock();
+
+	/*
+	 * Only wake the writer when it has something new to do: the
+	 * first row starts the delay timer, a full batch ends it.
+	 */
+	if (nr_pending == 1 || nr_pending >= maxRows_)
+		cond_.notify_one();
+
+	return ret;
+}
+
+uint64_t BatchWriter::save(const td_api::message &message, uint64_t pk_chat_id,
+			   uint64_t pk_sender_id)
+{
+	struct batch_entry ent;
+
+	ent.message = &message;
+	ent.pk_chat_id = pk_chat_id;
+	ent.pk_sender_id = pk_sender_id;
+	return submit(&ent).get();
+}
+
+void BatchWriter::run(void)
+	__acquires(&lock_)
+	__releases(&lock_)
+{
+	std::vector<struct batch_entry *> batch;
+	std::unique_lock<std::mutex> lk(lock_, std::defer_lock);
+
+	batch.reserve(maxRows_);
+	while (1) {
+		lk.lock();
+		while (pending_.empty() && !stop_)
+			cond_.wait(lk);
+
+		if (pending_.empty()) {
+			/* stop_ is set and there is nothing left to write. */
+			lk.unlock();
+			break;
+		}
+
+		if (!stop_) {
+			auto deadline = std::chrono::steady_clock::now() + maxDelay_;
+
+			while (pending_.size() < maxRows_ && !stop_) {
+				if (cond_.wait_until(lk, deadline) == std::cv_status::timeout)
+					break;
+			}
+		}
+
+		if (pending_.size() <= maxRows_) {
+			batch.swap(pending_);
+		} else {
+			batch.assign(pending_.begin(), pending_.begin() + maxRows_);
+			pending_.erase(pending_.begin(), pending_.begin() + maxRows_);
+		}
+		lk.unlock();
+
+		flush(batch);
+		batch.clear();
+	}
+}
+
+/*
+ * Hand the result back to whoever submitted @ent. A stored message
+ * goes into the message id index and the scrape cursors first, @ent
+ * may be gone right after set_value().
+ */
+void BatchWriter::complete(struct batch_entry *ent, uint64_t pk_message_id)
+{
+	const td_api::message &message = *ent->message;
+
+	if (likely(pk_message_id)) {
+		uint64_t tg_msg_id = (uint64_t) message.id_ >> 20u;
+
+		kworker_->getMsgIdIndex()->add(message.chat_id_, tg_msg_id);
+		kworker_->getScrapeState()->note(message.chat_id_, tg_msg_id);
+	}
+
+	ent->done.set_value(pk_message_id);
+}
+
+bool BatchWriter::resolve_db_pool(void)
+{
+	if (likely(db_))
+		return true;
+
+	db_ = kworker_->getDbPool(32000ms);
+	return db_ != nullptr;
+}
+
+void BatchWriter::flush(std::vector<struct batch_entry *> &batch)
+{
+	if (unlikely(!resolve_db_pool())) {
+		pr_err("BatchWriter: could not get a DB connection, "
+		       "dropping %zu message(s)", batch.size());
+		for (auto ent: batch)
+			ent->done.set_value(0);
+		return;
+	}
+
+	/*
+	 * A lone message is cheaper through the stored procedure, one
+	 * round trip instead of the half a dozen writeBatch() needs.
+	 */
+	if (batch.size() == 1 && kworker_->useSaveProc()) {
+		struct batch_entry *ent = batch[0];
+
+		complete(ent, save_message_if_not_exist(kworker_, db_,
+							*ent->message,
+							ent->pk_chat_id,
+							ent->pk_sender_id));
+		goto out;
+	}
+
+	if (likely(writeBatch(db_, batch)))
+		goto out;
+
+	/*
+	 * One bad row, or a concurrent writer storing one of these
+	 * messages first, fails the whole batch. Retry them one by one
+	 * through the upsert path, so only the offending messages are
+	 * reported back as failed.
+	 */
+	nrFallbacks_++;
+	for (auto ent: batch) {
+		uint64_t pk;
+
+		pk = save_message_if_not_exist(kworker_, db_, *ent->message,
+					       ent->pk_chat_id,
+					       ent->pk_sender_id);
+		complete(ent, pk);
+	}
+
+out:
+	/*
+	 * Don't sit on it between batches, the pool keeps an eye on
+	 * idle connections and replaces the ones that went away.
+	 */
+	kworker_->putDbPool(db_);
+	db_ = nullptr;
+}
+
+/*
+ * Fill pk_message_id of the rows that don't have one yet with the
+ * ones already stored in gt_messages.
+ */
+static bool select_existing(mysql::MySQL *db, std::vector<struct batch_row> &rows,
+			    const std::map<batch_key, uint32_t> &keys)
+{
+	static const char q_head[] =
+		"SELECT id, chat_id, tg_msg_id FROM gt_messages WHERE "
+		"(chat_id, tg_msg_id) IN (";
+
+	int tmp;
+	std::string q;
+	char buf[64];
+	bool has_row = false;
+	mysql::MySQLRes *res;
+
+	q.reserve(sizeof(q_head) + rows.size() * 32);
+	q.append(q_head, sizeof(q_head) - 1);
+	for (auto &r: rows) {
+		int len;
+
+		if (r.pk_message_id)
+			continue;
+
+		len = snprintf(buf, sizeof(buf), "%s(%" PRIu64 ",%" PRIu64 ")",
+			       has_row ? "," : "", r.ent->pk_chat_id,
+			       r.tg_msg_id);
+		q.append(buf, (size_t) len);
+		has_row = true;
+	}
+	q.append(")", 1);
+
+	if (!has_row)
+		return true;
+
+	tmp = db->realQuery(q.c_str(), q.size());
+	if (unlikely(tmp)) {
+		pr_err("query(): %s", db->getError());
+		return false;
+	}
+
+	res = db->useResult();
+	if (MYSQL_IS_ERR_OR_NULL(res)) {
+		pr_err("useResult(): %s", db->getError());
+		return false;
+	}
+
+	while (res->next()) {
+		batch_key key;
+
+		key.first  = res->getUInt64(1);
+		key.second = res->getUInt64(2);
+		const auto &it = keys.find(key);
+		if (unlikely(it == keys.end()))
+			continue;
+
+		rows[it->second].pk_message_id = res->getUInt64(0);
+	}
+
+	delete res;
+	if (unlikely(db->getErrno())) {
+		pr_err("useResult(): %s", db->getError());
+		return false;
+	}
+	return true;
+}
+
+static bool insert_messages(mysql::MySQL *db, std::vector<struct batch_row> &rows,
+			    const std::vector<uint32_t> &new_rows)
+{
+	static const char q_head[] =
+		"INSERT IGNORE INTO `gt_messages` "
+		"("
+			"`chat_id`,"
+			"`sender_id`,"
+			"`tg_msg_id`,"
+			"`reply_to_tg_msg_id`,"
+			"`msg_type`,"
+			"`has_edited_msg`,"
+			"`is_forwarded_msg`,"
+			"`is_deleted`,"
+			"`created_at`,"
+			"`updated_at`"
+		")"
+			" VALUES ";
+
+	int tmp;
+	std::string q;
+	char buf[192];
+	char reply_buf[32];
+
+	/*
+	 * Every column here is numeric or a constant, so a plain text
+	 * query is safe and saves us 8 binds per row.
+	 */
+	q.reserve(sizeof(q_head) + new_rows.size() * 96);
+	q.append(q_head, sizeof(q_head) - 1);
+	for (size_t i = 0; i < new_rows.size(); i++) {
+		const struct batch_row &r = rows[new_rows[i]];
+		const td_api::message &message = *r.ent->message;
+		uint64_t reply_to_tg_msg_id;
+		int len;
+
+		reply_to_tg_msg_id = message.reply_to_message_id_ >> 20u;
+		if (reply_to_tg_msg_id)
+			snprintf(reply_buf, sizeof(reply_buf), "%" PRIu64,
+				 reply_to_tg_msg_id);
+		else
+			memcpy(reply_buf, "NULL", sizeof("NULL"));
+
+		len = snprintf(buf, sizeof(buf),
+			       "%s(%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%s,"
+			       "'text','%c','%c','0',NOW(),NULL)",
+			       i ? "," : "", r.ent->pk_chat_id,
+			       r.ent->pk_sender_id, r.tg_msg_id, reply_buf,
+			       message.edit_date_ ? '1' : '0',
+			       message.forward_info_ ? '1' : '0');
+		q.append(buf, (size_t) len);
+	}
+
+	tmp = db->realQuery(q.c_str(), q.size());
+	if (unlikely(tmp)) {
+		pr_err("query(): %s", db->getError());
+		return false;
+	}
+
+	/*
+	 * Fewer rows than expected means another writer stored some of
+	 * these messages after select_existing(). We can't tell which
+	 * ones, let the caller redo the batch row by row.
+	 */
+	if (unlikely(db->getAffectedRows() != new_rows.size()))
+		return false;
+
+	return true;
+}
+
+static bool insert_contents_chunk(mysql::MySQL *db,
+				  std::vector<struct batch_row> &rows,
+				  const uint32_t *new_rows, size_t nr_rows)
+{
+	static const char q_head[] =
+		"INSERT INTO `gt_message_content` "
+		"("
+			"`message_id`,"
+			"`text`,"
+			"`text_entities`,"
+			"`is_edited_msg`,"
+			"`tg_date`,"
+			"`created_at`"
+		")"
+			" VALUES ";
+
+	static const char q_row[] = "(?,?,?,?,?,NOW())";
+
+	bool ret = false;
+	std::string q;
+	size_t i;
+	mysql::MySQLStmt *stmt = nullptr;
+	const char *stmtErrFunc = nullptr;
+	std::vector<std::string> entities_txt(nr_rows);
+	std::vector<MYSQL_TIME> tg_date(nr_rows);
+	std::vector<int8_t> is_edited(nr_rows);
+
+	q.reserve(sizeof(q_head) + nr_rows * sizeof(q_row));
+	q.append(q_head, sizeof(q_head) - 1);
+	for (i = 0; i < nr_rows; i++) {
+		if (i)
+			q.append(",", 1);
+		q.append(q_row, sizeof(q_row) - 1);
+	}
+
+	stmt = db->prepareCachedLen(nr_rows * 5, q.c_str(), q.size());
+	if (MYSQL_IS_ERR_OR_NULL<mysql::MySQLStmt>(stmt)) {
+		mysql_handle_prepare_err(db, stmt);
+		return false;
+	}
+
+	if (unlikely(stmt->stmtInit())) {
+		stmtErrFunc = "stmtInit";
+		goto stmt_err;
+	}
+
+	for (i = 0; i < nr_rows; i++) {
+		struct batch_row &r = rows[new_rows[i]];
+		const td_api::message &message = *r.ent->message;
+		const auto &content = static_cast<const td_api::messageText &>(*message.content_);
+		const auto &formattedText = *content.text_;
+		const auto &text = formattedText.text_;
+		const auto &entities = formattedText.entities_;
+		size_t b = i * 5;
+		time_t tg_date_epoch;
+
+		stmt->bind(b + 0, MYSQL_TYPE_LONGLONG, (void *) &r.pk_message_id,
+			   sizeof(r.pk_message_id));
+		stmt->bind(b + 1, MYSQL_TYPE_STRING, (void *) text.c_str(),
+			   text.size());
+
+		if (!entities.size()) {
+			stmt->bind(b + 2, MYSQL_TYPE_NULL, NULL, 0);
+		} else {
+			entities_txt[i] = to_string(entities);
+			stmt->bind(b + 2, MYSQL_TYPE_STRING,
+				   (void *) entities_txt[i].c_str(),
+				   entities_txt[i].size());
+		}
+
+		mysql::stmt_param<mysql::enum01>::bind(stmt->getBind(b + 3),
+						       &is_edited[i],
+						       !!message.edit_date_);
+
+		if (message.edit_date_)
+			tg_date_epoch = message.edit_date_;
+		else
+			tg_date_epoch = message.date_;
+
+		mysql::stmt_param<mysql::datetime>::bind(stmt->getBind(b + 4),
+							 &tg_date[i],
+							 tg_date_epoch);
+	}
+
+	if (unlikely(stmt->bindStmt())) {
+		stmtErrFunc = "bindStmt";
+		goto stmt_err;
+	}
+
+	if (unlikely(stmt->execute())) {
+		stmtErrFunc = "execute";
+		goto stmt_err;
+	}
+
+	ret = true;
+	goto out;
+
+stmt_err:
+	mysql_handle_stmt_err(stmtErrFunc, stmt);
+out:
+	return ret;
+}
+
+/*
+ * The statement text depends on the number of rows and every pooled
+ * connection caches what it prepares, so only ever prepare a few
+ * fixed sizes and split the batch into them.
+ */
+static bool insert_contents(mysql::MySQL *db, std::vector<struct batch_row> &rows,
+			    const std::vector<uint32_t> &new_rows)
+{
+	static const size_t chunk_sizes[] = {64, 16, 4, 1};
+	size_t off = 0, left = new_rows.size();
+
+	for (size_t n: chunk_sizes) {
+		while (left >= n) {
+			if (unlikely(!insert_contents_chunk(db, rows,
+							    &new_rows[off], n)))
+				return false;
+			off  += n;
+			left -= n;
+		}
+	}
+
+	return true;
+}
+
+bool BatchWriter::writeBatch(mysql::MySQL *db,
+			     std::vector<struct batch_entry *> &ents)
+{
+	int tmp;
+	std::vector<struct batch_row> rows;
+	std::vector<uint32_t> ent_row(ents.size());
+	std::vector<uint32_t> new_rows;
+	std::map<batch_key, uint32_t> keys;
+	size_t i;
+
+	/*
+	 * The same message may be queued twice (e.g. the scraper and
+	 * the live update racing each other), collapse them here.
+	 */
+	rows.reserve(ents.size());
+	for (i = 0; i < ents.size(); i++) {
+		struct batch_entry *ent = ents[i];
+		batch_key key(ent->pk_chat_id, ent->message->id_ >> 20u);
+		const auto &it = keys.find(key);
+
+		if (it != keys.end()) {
+			ent_row[i] = it->second;
+			continue;
+		}
+
+		ent_row[i] = (uint32_t) rows.size();
+		keys.emplace(key, ent_row[i]);
+		rows.push_back({ent, key.second, 0, std::nullopt});
+	}
+
+	/*
+	 * A sender we haven't seen yet is created in a transaction of
+	 * its own, which would commit ours halfway. Resolve them first.
+	 */
+	for (auto &r: rows) {
+		const auto &fwd = r.ent->message->forward_info_;
+
+		if (fwd)
+			r.fwd_sender_id = get_fwd_sender_pk(kworker_, db, *fwd);
+	}
+
+	tmp = db->beginTransaction();
+	if (unlikely(tmp)) {
+		pr_err("beginTransaction(): %s", db->getError());
+		return false;
+	}
+
+	if (unlikely(!select_existing(db, rows, keys)))
+		goto rollback;
+
+	for (i = 0; i < rows.size(); i++) {
+		const td_api::message &message = *rows[i].ent->message;
+		const auto &content = static_cast<const td_api::messageText &>(*message.content_);
+
+		if (rows[i].pk_message_id)
+			continue;
+
+		if (unlikely(!content.text_))
+			goto rollback;
+
+		new_rows.push_back((uint32_t) i);
+	}
+
+	if (new_rows.size()) {
+		if (unlikely(!insert_messages(db, rows, new_rows)))
+			goto rollback;
+
+		if (unlikely(!select_existing(db, rows, keys)))
+			goto rollback;
+
+		for (auto idx: new_rows) {
+			struct batch_row &r = rows[idx];
+			const auto &fwd = r.ent->message->forward_info_;
+
+			if (unlikely(!r.pk_message_id))
+				goto rollback;
+
+			if (!fwd)
+				continue;
+
+			if (unlikely(!save_msg_fwd_info(db, *fwd, r.pk_message_id,
+							r.fwd_sender_id)))
+				goto rollback;
+		}
+
+		if (unlikely(!insert_contents(db, rows, new_rows)))
+			goto rollback;
+	}
+
+	tmp = db->commit();
+	if (unlikely(tmp)) {
+		pr_err("commit(): %s", db->getError());
+		goto rollback;
+	}
+
+	nrBatches_++;
+	nrRows_ += new_rows.size();
+	for (i = 0; i < ents.size(); i++)
+		complete(ents[i], rows[ent_row[i]].pk_message_id);
+
+	return true;
+
+rollback:
+	tmp = db->rollback();
+	if (unlikely(tmp))
+		pr_err("rollback(): %s", db->getError());
+	return false;
+}
+
+} /* namespace tgvisd::Logger */
@@ -0,0 +1,103 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * @author Ammar Faizi <ammarfaizi2@gmail.com>
+ * @license GPL-2.0-only
+ * @package tgvisd::Logger
+ *
+ * Copyright (C) 2022  Ammar Faizi <ammarfaizi2@gmail.com>
+ */
+
+#ifndef TGVISD__LOGGER__BATCHWRITER_HPP
+#define TGVISD__LOGGER__BATCHWRITER_HPP
+
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <thread>
+#include <vector>
+#include <tgvisd/KWorker.hpp>
+#include <condition_variable>
+
+namespace tgvisd::Logger {
+
+using namespace std::chrono_literals;
+
+struct batch_entry {
+	const td_api::message		*message;
+	uint64_t			pk_chat_id;
+	uint64_t			pk_sender_id;
+
+	/*
+	 * Fulfilled with the gt_messages primary key, or 0 if the
+	 * message could not be saved.
+	 */
+	std::promise<uint64_t>		done;
+};
+
+/*
+ * Group-commit stage for gt_messages and gt_message_content.
+ *
+ * Resolved messages from all chats are collected for up to
+ * maxRows_ rows or maxDelay_, whichever comes first, and written
+ * with multi-row INSERTs inside a single transaction. If the batch
+ * fails, every message is retried on its own so that each caller
+ * still gets its own result.
+ */
+class BatchWriter
+{
+public:
+	BatchWriter(KWorker *kworker);
+	~BatchWriter(void);
+
+	std::future<uint64_t> submit(struct batch_entry *ent);
+	uint64_t save(const td_api::message &message, uint64_t pk_chat_id,
+		      uint64_t pk_sender_id);
+	void stop(void);
+
+	/*
+	 * Write @ents in one transaction on @db. The caller owns @db.
+	 */
+	bool writeBatch(mysql::MySQL *db, std::vector<struct batch_entry *> &ents);
+
+	inline uint64_t getNrBatches(void)
+	{
+		return nrBatches_.load(std::memory_order_relaxed);
+	}
+
+	inline uint64_t getNrRows(void)
+	{
+		return nrRows_.load(std::memory_order_relaxed);
+	}
+
+	inline uint64_t getNrFallbacks(void)
+	{
+		return nrFallbacks_.load(std::memory_order_relaxed);
+	}
+
+private:
+	volatile bool				stop_ = false;
+	KWorker					*kworker_ = nullptr;
+	mysql::MySQL				*db_ = nullptr;
+	std::thread				*thread_ = nullptr;
+	uint32_t				maxRows_ = 128;
+	std::chrono::milliseconds		maxDelay_ = 5ms;
+
+	std::mutex				lock_;
+	std::condition_variable			cond_;
+	std::vector<struct batch_entry *>	pending_;
+
+	std::atomic<uint64_t>			nrBatches_ = 0;
+	std::atomic<uint64_t>			nrRows_ = 0;
+	std::atomic<uint64_t>			nrFallbacks_ = 0;
+
+	void initConfig(void);
+	void run(void);
+	void flush(std::vector<struct batch_entry *> &batch);
+	void complete(struct batch_entry *ent, uint64_t pk_message_id);
+	bool resolve_db_pool(void);
+};
+
+} /* namespace tgvisd::Logger */
+
+#endif /* #ifndef TGVISD__LOGGER__BATCHWRITER_HPP */
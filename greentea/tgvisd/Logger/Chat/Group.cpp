@@ -14,34 +14,30 @@
 namespace tgvisd::Logger::Chat {
 
 struct chat_data {
+	KWorker						*kworker_;
 	const td_api::chat				&chat_;
-	td_api::object_ptr<td_api::supergroup>		sgroup_;
-	td_api::object_ptr<td_api::supergroupFullInfo>	sgroup_full_;
+	std::shared_ptr<const td_api::supergroup>	sgroup_;
+	std::shared_ptr<const td_api::supergroupFullInfo> sgroup_full_;
+	uint64_t					pk_group_id_ = 0;
 
 	inline ~chat_data(void) = default;
 
-	inline chat_data(const td_api::chat &chat):
+	inline chat_data(KWorker *kworker, const td_api::chat &chat):
+		kworker_(kworker),
 		chat_(chat)
 	{
 	}
 };
 
-static inline void *bn_str(bool p)
-{
-	return (void *) (p ? "1" : "0");
-}
-
 static uint64_t create_group_history(mysql::MySQL *db, struct chat_data *cd,
 				     uint64_t pk_group_id)
 {
-	uint64_t pk_id;
-	const char *stmtErrFunc = nullptr;
-	mysql::MySQLStmt *stmt = nullptr;
 	const td_api::chat &chat = cd->chat_;
 	const td_api::supergroup &sgroup = *cd->sgroup_;
 	const td_api::supergroupFullInfo &sgroup_full = *cd->sgroup_full_;
+	std::optional<std::string_view> link;
 
-	stmt = db->prepare(9,
+	mysql::Statement<
 		"INSERT INTO `gt_groups_history` "
 		"("
 			"`group_id`,"
@@ -67,83 +63,46 @@ static uint64_t create_group_history(mysql::MySQL *db, struct chat_data *cd,
 			"?,"		/* is_channel */
 			"?,"		/* is_verified */
 			"NOW()"		/* created_at */
-		");"
-	);
-
-	if (MYSQL_IS_ERR_OR_NULL<mysql::MySQLStmt>(stmt)) {
-		mysql_handle_prepare_err(db, stmt);
+		");",
+		uint64_t,
+		std::optional<std::string_view>,
+		std::optional<std::string_view>,
+		std::string_view,
+		std::optional<std::string_view>,
+		mysql::enum01,
+		mysql::enum01,
+		mysql::enum01,
+		mysql::enum01
+	> st(db);
+
+	if (sgroup_full.invite_link_)
+		link = mysql::str_or_null(sgroup_full.invite_link_->invite_link_);
+
+	if (unlikely(st.execute(pk_group_id,
+				mysql::str_or_null(sgroup.username_),
+				link,
+				chat.title_,
+				mysql::str_or_null(sgroup_full.description_),
+				sgroup.has_linked_chat_,
+				sgroup.is_slow_mode_enabled_,
+				sgroup.is_channel_,
+				sgroup.is_verified_))) {
+		mysql_handle_stmt_err(&st);
 		return 0;
 	}
 
-	if (unlikely(stmt->stmtInit())) {
-		stmtErrFunc = "stmtInit";
-		goto stmt_err;
-	}
-
-	stmt->bind(0, MYSQL_TYPE_LONGLONG, (void *) &pk_group_id,
-		   sizeof(pk_group_id));
-
-	if (!sgroup.username_.size())
-		stmt->bind(1, MYSQL_TYPE_NULL, NULL, 0);
-	else
-		stmt->bind(1, MYSQL_TYPE_STRING,
-			   (void *) sgroup.username_.c_str(),
-			   sgroup.username_.size());
-
-	if (!sgroup_full.invite_link_ ||
-	    !sgroup_full.invite_link_->invite_link_.size())
-		stmt->bind(2, MYSQL_TYPE_NULL, NULL, 0);
-	else
-		stmt->bind(2, MYSQL_TYPE_STRING,
-			   (void *) sgroup_full.invite_link_->invite_link_.c_str(),
-			   sgroup_full.invite_link_->invite_link_.size());
-
-	stmt->bind(3, MYSQL_TYPE_STRING, (void *) chat.title_.c_str(),
-		   chat.title_.size());
-
-	if (!sgroup_full.description_.size())
-		stmt->bind(4, MYSQL_TYPE_NULL, NULL, 0);
-	else
-		stmt->bind(4, MYSQL_TYPE_STRING,
-			   (void *) sgroup_full.description_.c_str(),
-			   sgroup_full.description_.size());
-
-	stmt->bind(5, MYSQL_TYPE_STRING, bn_str(sgroup.has_linked_chat_), 1);
-	stmt->bind(6, MYSQL_TYPE_STRING, bn_str(sgroup.is_slow_mode_enabled_), 1);
-	stmt->bind(7, MYSQL_TYPE_STRING, bn_str(sgroup.is_channel_), 1);
-	stmt->bind(8, MYSQL_TYPE_STRING, bn_str(sgroup.is_verified_), 1);
-
-	if (unlikely(stmt->bindStmt())) {
-		stmtErrFunc = "bindStmt";
-		goto stmt_err;
-	}
-
-	if (unlikely(stmt->execute())) {
-		stmtErrFunc = "execute";
-		goto stmt_err;
-	}
-
-	pk_id = stmt->getInsertId();
-	goto out;
-
-stmt_err:
-	mysql_handle_stmt_err(stmtErrFunc, stmt);
-	pk_id = 0;
-out:
-	delete stmt;
-	return pk_id;
+	return st.getInsertId();
 }
 
 static uint64_t create_group(mysql::MySQL *db, struct chat_data *cd)
 {
 	uint64_t pk_group_id;
-	const char *stmtErrFunc = nullptr;
-	mysql::MySQLStmt *stmt = nullptr;
 	const td_api::chat &chat = cd->chat_;
 	const td_api::supergroup &sgroup = *cd->sgroup_;
 	const td_api::supergroupFullInfo &sgroup_full = *cd->sgroup_full_;
+	std::optional<std::string_view> link;
 
-	stmt = db->prepare(9,
+	mysql::Statement<
 		"INSERT INTO `gt_groups` "
 		"("
 			"`tg_group_id`,"
@@ -171,72 +130,38 @@ static uint64_t create_group(mysql::MySQL *db, struct chat_data *cd)
 			"?,"		/* is_verified */
 			"NOW(),"	/* created_at */
 			"NULL"		/* updated_at */
-		");"
-	);
-
-	if (MYSQL_IS_ERR_OR_NULL<mysql::MySQLStmt>(stmt)) {
-		mysql_handle_prepare_err(db, stmt);
+		");",
+		int64_t,
+		std::optional<std::string_view>,
+		std::optional<std::string_view>,
+		std::string_view,
+		std::optional<std::string_view>,
+		mysql::enum01,
+		mysql::enum01,
+		mysql::enum01,
+		mysql::enum01
+	> st(db);
+
+	if (sgroup_full.invite_link_)
+		link = mysql::str_or_null(sgroup_full.invite_link_->invite_link_);
+
+	if (unlikely(st.execute(chat.id_,
+				mysql::str_or_null(sgroup.username_),
+				link,
+				chat.title_,
+				mysql::str_or_null(sgroup_full.description_),
+				sgroup.has_linked_chat_,
+				sgroup.is_slow_mode_enabled_,
+				sgroup.is_channel_,
+				sgroup.is_verified_))) {
+		mysql_handle_stmt_err(&st);
 		return 0;
 	}
 
-	if (unlikely(stmt->stmtInit())) {
-		stmtErrFunc = "stmtInit";
-		goto stmt_err;
-	}
-
-	stmt->bind(0, MYSQL_TYPE_LONGLONG, (void *) &chat.id_, sizeof(chat.id_));
-
-	if (!sgroup.username_.size())
-		stmt->bind(1, MYSQL_TYPE_NULL, NULL, 0);
-	else
-		stmt->bind(1, MYSQL_TYPE_STRING,
-			   (void *) sgroup.username_.c_str(),
-			   sgroup.username_.size());
-
-	if (!sgroup_full.invite_link_ ||
-	    !sgroup_full.invite_link_->invite_link_.size())
-		stmt->bind(2, MYSQL_TYPE_NULL, NULL, 0);
-	else
-		stmt->bind(2, MYSQL_TYPE_STRING,
-			   (void *) sgroup_full.invite_link_->invite_link_.c_str(),
-			   sgroup_full.invite_link_->invite_link_.size());
-
-	stmt->bind(3, MYSQL_TYPE_STRING, (void *) chat.title_.c_str(),
-		   chat.title_.size());
-
-	if (!sgroup_full.description_.size())
-		stmt->bind(4, MYSQL_TYPE_NULL, NULL, 0);
-	else
-		stmt->bind(4, MYSQL_TYPE_STRING,
-			   (void *) sgroup_full.description_.c_str(),
-			   sgroup_full.description_.size());
-
-	stmt->bind(5, MYSQL_TYPE_STRING, bn_str(sgroup.has_linked_chat_), 1);
-	stmt->bind(6, MYSQL_TYPE_STRING, bn_str(sgroup.is_slow_mode_enabled_), 1);
-	stmt->bind(7, MYSQL_TYPE_STRING, bn_str(sgroup.is_channel_), 1);
-	stmt->bind(8, MYSQL_TYPE_STRING, bn_str(sgroup.is_verified_), 1);
-
-	if (unlikely(stmt->bindStmt())) {
-		stmtErrFunc = "bindStmt";
-		goto stmt_err;
-	}
-
-	if (unlikely(stmt->execute())) {
-		stmtErrFunc = "execute";
-		goto stmt_err;
-	}
-
-	pk_group_id = stmt->getInsertId();
+	pk_group_id = st.getInsertId();
 	if (!create_group_history(db, cd, pk_group_id))
 		pk_group_id = 0;
 
-	goto out;
-
-stmt_err:
-	mysql_handle_stmt_err(stmtErrFunc, stmt);
-	pk_group_id = 0;
-out:
-	delete stmt;
 	return pk_group_id;
 }
 
@@ -250,6 +175,11 @@ static uint64_t get_group_pk(mysql::MySQL *db, struct chat_data *cd)
 	MYSQL_ROW row;
 	mysql::MySQLRes *res;
 	char qbuf[sizeof(q) + 64];
+	IdentityCache<int64_t> *cache = cd->kworker_->getGroupPKCache();
+
+	ret = cache->get(cd->chat_.id_);
+	if (likely(ret))
+		return ret;
 
 	qlen = snprintf(qbuf, sizeof(qbuf), q, cd->chat_.id_);
 
@@ -267,11 +197,17 @@ static uint64_t get_group_pk(mysql::MySQL *db, struct chat_data *cd)
 
 	row = res->fetchRow();
 	if (unlikely(!row)) {
+		/*
+		 * Don't cache it yet, we are inside the chat creation
+		 * transaction. create_chat_in_trx() will do it after
+		 * commit.
+		 */
 		ret = create_group(db, cd);
 		goto out;
 	}
 
 	ret = strtoull(row[0], NULL, 10);
+	cache->set(cd->chat_.id_, ret);
 out:
 	delete res;
 	return ret;
@@ -300,71 +236,43 @@ static uint64_t create_chat_group(mysql::MySQL *db, uint64_t pk_chat_id,
 
 static uint64_t create_chat(mysql::MySQL *db, struct chat_data *cd)
 {
-	size_t chat_type_len;
 	uint64_t pk_chat_id = 0;
 	uint64_t pk_group_id = 0;
-	const char *stmtErrFunc = nullptr;
-	const char *chat_type = nullptr;
-	mysql::MySQLStmt *stmt = nullptr;
+	std::string_view chat_type;
+	mysql::Statement<"INSERT INTO `gt_chats` (type) VALUES (?)",
+			 std::string_view> st(db);
 
 	pk_group_id = get_group_pk(db, cd);
 	if (unlikely(!pk_group_id))
 		return 0;
 
-	stmt = db->prepare(1, "INSERT INTO `gt_chats` (type) VALUES (?)");
-
-	if (MYSQL_IS_ERR_OR_NULL<mysql::MySQLStmt>(stmt)) {
-		mysql_handle_prepare_err(db, stmt);
-		return 0;
-	}
-
-	if (unlikely(stmt->stmtInit())) {
-		stmtErrFunc = "stmtInit";
-		goto stmt_err;
-	}
+	cd->pk_group_id_ = pk_group_id;
 
 	switch (cd->chat_.type_->get_id()) {
 	case td_api::chatTypeBasicGroup::ID:
 		chat_type = "chatTypeBasicGroup";
-		chat_type_len = sizeof("chatTypeBasicGroup") - 1;
 		break;
 	case td_api::chatTypeSupergroup::ID:
 		chat_type = "chatTypeSupergroup";
-		chat_type_len = sizeof("chatTypeSupergroup") - 1;
 		break;
 	case td_api::chatTypeSecret::ID:
 		chat_type = "chatTypeSecret";
-		chat_type_len = sizeof("chatTypeSecret") - 1;
 		break;
 	case td_api::chatTypePrivate::ID:
 		chat_type = "chatTypePrivate";
-		chat_type_len = sizeof("chatTypePrivate") - 1;
 		break;
 	default:
 		pr_err("Invalid chat type on create_chat()");
 		goto out;
 	}
-	stmt->bind(0, MYSQL_TYPE_STRING, (void *)chat_type, chat_type_len);
-
-	if (unlikely(stmt->bindStmt())) {
-		stmtErrFunc = "bindStmt";
-		goto stmt_err;
-	}
 
-	if (unlikely(stmt->execute())) {
-		stmtErrFunc = "execute";
-		goto stmt_err;
+	if (unlikely(st.execute(chat_type))) {
+		mysql_handle_stmt_err(&st);
+		goto out;
 	}
 
-	pk_chat_id = stmt->getInsertId();
-	goto out;
-
-stmt_err:
-	mysql_handle_stmt_err(stmtErrFunc, stmt);
-	pk_chat_id = 0;
+	pk_chat_id = st.getInsertId();
 out:
-	delete stmt;
-
 	if (pk_chat_id) {
 		if (!create_chat_group(db, pk_chat_id, pk_group_id))
 			pk_chat_id = 0;
@@ -394,6 +302,8 @@ static uint64_t create_chat_in_trx(mysql::MySQL *db, struct chat_data *cd)
 	}
 
 	/* Creation successful! */
+	cd->kworker_->getChatPKCache()->set(cd->chat_.id_, pk_chat_id);
+	cd->kworker_->getGroupPKCache()->set(cd->chat_.id_, cd->pk_group_id_);
 	return pk_chat_id;
 
 rollback:
@@ -440,6 +350,7 @@ static uint64_t get_chat_pk(mysql::MySQL *db, struct chat_data *cd)
 	}
 
 	pk_chat_id = strtoull(row[0], NULL, 10);
+	cd->kworker_->getChatPKCache()->set(chat.id_, pk_chat_id);
 out:
 	delete res;
 	return pk_chat_id;
@@ -450,34 +361,66 @@ static bool get_chat_data(KWorker *kworker, const td_api::chat &chat,
 {
 	tgvisd::Td::Td *td;
 	const uint32_t timeout = 60;
+	tgvisd::Td::ObjectCache<td_api::supergroup> *sg_cache;
+	tgvisd::Td::ObjectCache<td_api::supergroupFullInfo> *sgf_cache;
+	std::future<tgvisd::Td::query_result<td_api::supergroup>> sg_fut;
+	std::future<tgvisd::Td::query_result<td_api::supergroupFullInfo>> sgf_fut;
 
 	const auto &tmp = static_cast<const td_api::chatTypeSupergroup &>(*chat.type_);
 	int32_t supergroup_id = tmp.supergroup_id_;
 
 	td = kworker->getTd();
 	assert(td);
-
-	cd->sgroup_ = td->send_query_sync<td_api::getSupergroup, td_api::supergroup>(
-		td_api::make_object<td_api::getSupergroup>(supergroup_id),
-		timeout
-	);
+	sg_cache  = td->getSupergroupCache();
+	sgf_cache = td->getSupergroupFullInfoCache();
+
+	/*
+	 * The caches are fed by updateSupergroup and
+	 * updateSupergroupFullInfo, only ask TDLib on a cold miss.
+	 * When both are missing, both queries are in flight at once.
+	 */
+	cd->sgroup_ = sg_cache->get(supergroup_id);
 	if (unlikely(!cd->sgroup_))
-		return false;
+		sg_fut = td->send_query_future<td_api::getSupergroup, td_api::supergroup>(
+			td_api::make_object<td_api::getSupergroup>(supergroup_id)
+		);
 
-	cd->sgroup_full_ = td->send_query_sync<td_api::getSupergroupFullInfo, td_api::supergroupFullInfo>(
-		td_api::make_object<td_api::getSupergroupFullInfo>(supergroup_id),
-		timeout
-	);
+	cd->sgroup_full_ = sgf_cache->get(supergroup_id);
 	if (unlikely(!cd->sgroup_full_))
-		return false;
+		sgf_fut = td->send_query_future<td_api::getSupergroupFullInfo, td_api::supergroupFullInfo>(
+			td_api::make_object<td_api::getSupergroupFullInfo>(supergroup_id)
+		);
+
+	if (sg_fut.valid()) {
+		cd->sgroup_ = sg_cache->put(supergroup_id,
+			tgvisd::Td::query_future_get<td_api::supergroup>(sg_fut, timeout));
+		if (unlikely(!cd->sgroup_))
+			return false;
+	}
+
+	if (sgf_fut.valid()) {
+		cd->sgroup_full_ = sgf_cache->put(supergroup_id,
+			tgvisd::Td::query_future_get<td_api::supergroupFullInfo>(sgf_fut, timeout));
+		if (unlikely(!cd->sgroup_full_))
+			return false;
+	}
 
 	return true;
 }
 
 uint64_t Group::getPK(void)
 {
+	uint64_t pk_chat_id;
 	mysql::MySQL *db;
-	struct chat_data cd(chat_);
+	struct chat_data cd(kworker_, chat_);
+
+	/*
+	 * Hot path: the chat is already known, no TDLib nor SQL
+	 * round trip is needed.
+	 */
+	pk_chat_id = kworker_->getChatPKCache()->get(chat_.id_);
+	if (likely(pk_chat_id))
+		return pk_chat_id;
 
 	if (unlikely(!get_chat_data(kworker_, chat_, &cd))) {
 		pr_err("Cannot get chat data on getPK");
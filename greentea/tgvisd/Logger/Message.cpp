@@ -8,10 +8,11 @@
  * Copyright (C) 2022  Ammar Faizi <ammarfaizi2@gmail.com>
  */
 
-#include <time.h>
 #include <inttypes.h>
+#include <mysql/mysqld_error.h>
 #include <tgvisd/mysql_helpers.hpp>
 #include <tgvisd/Logger/Message.hpp>
+#include <tgvisd/Logger/BatchWriter.hpp>
 
 using SenderUser = tgvisd::Logger::Sender::User;
 using SenderChat = tgvisd::Logger::Sender::Chat;
@@ -20,11 +21,6 @@ using ChatUser = tgvisd::Logger::Chat::User;
 
 namespace tgvisd::Logger {
 
-static inline void *bn_str(bool p)
-{
-	return (void *) (p ? "1" : "0");
-}
-
 Message::Message(KWorker *kworker, const td_api::message &message):
 	message_(message),
 	kworker_(kworker)
@@ -125,20 +121,12 @@ bool Message::resolve_sender(void)
 
 bool Message::resolve_db_pool(void)
 {
-	const uint32_t max_try = 32;
-	uint32_t try_num = 0;
-
 	assert(m_chat_);
 	assert(m_sender_);
 
-	db_ = kworker_->getDbPool();
-	while (unlikely(!db_)) {
-		if (unlikely(++try_num >= max_try))
-			return false;
-
-		sleep(1);
-		db_ = kworker_->getDbPool();
-	}
+	db_ = kworker_->getDbPool(32000ms);
+	if (unlikely(!db_))
+		return false;
 
 	m_chat_->setDbPool(db_);
 	m_sender_->setDbPool(db_);
@@ -173,61 +161,48 @@ bool Message::resolve_pk(void)
 	return true;
 }
 
-static uint64_t save_message_if_not_exist(KWorker *kwrk, mysql::MySQL *db,
-					  const td_api::message &message,
-					  uint64_t pk_chat_id,
-					  uint64_t pk_sender_id);
-
-void Message::save(void)
+bool Message::save(void)
 {
 	if (unlikely(!message_.content_))
-		return;
+		return true;
 
 	/*
 	 * Currently, we only save text message.
 	 * TODO: Handle other types of message, like photo, sticker, etc.
 	 */
 	if (message_.content_->get_id() != td_api::messageText::ID)
-		return;
+		return true;
 
 	if (!resolve_sender())
-		return;
+		return false;
 
 	if (!resolve_chat())
-		return;
+		return false;
 
 	if (!resolve_db_pool())
-		return;
+		return false;
 
 	if (!resolve_pk())
-		return;
-
-	chat_lock_->lock();
-	save_message_if_not_exist(kworker_, db_, message_, pk_chat_id_,
-				  pk_sender_id_);
-	chat_lock_->unlock();
-}
+		return false;
 
-static size_t convert_epoch_to_db_format(char *buf, size_t buf_size,
-					 time_t time)
-{
-	struct tm tm;
-	memset(&tm, 0, sizeof(struct tm));
-	gmtime_r(&time, &tm);
-	return strftime(buf, buf_size, "%Y-%m-%d %H:%M:%S", &tm);
+	/*
+	 * The batch writer owns its connection and serializes all the
+	 * message writes, so neither our connection nor the chat lock
+	 * is needed while we wait for the group commit.
+	 */
+	kworker_->putDbPool(db_);
+	db_ = nullptr;
+	return kworker_->getBatchWriter()->save(message_, pk_chat_id_,
+						pk_sender_id_) != 0;
 }
 
 static uint64_t create_message_content(mysql::MySQL *db,
 				       const td_api::message &message,
 				       uint64_t pk_message_id)
 {
-	char tg_date[64];
-	size_t tg_date_size;
 	time_t tg_date_epoch;
 	std::string entities_txt;
-	uint64_t pk_message_content_id;
-	mysql::MySQLStmt *stmt = nullptr;
-	const char *stmtErrFunc = nullptr;
+	std::optional<std::string_view> entities_p;
 
 	const auto &content = static_cast<const td_api::messageText &>(*message.content_);
 	if (unlikely(!content.text_))
@@ -237,7 +212,7 @@ static uint64_t create_message_content(mysql::MySQL *db,
 	const auto &text = formattedText.text_;
 	const auto &entities = formattedText.entities_;
 
-	stmt = db->prepare(5,
+	mysql::Statement<
 		"INSERT INTO `gt_message_content` "
 		"("
 			"`message_id`,"
@@ -255,270 +230,190 @@ static uint64_t create_message_content(mysql::MySQL *db,
 			"?,"	/* is_edited_msg */
 			"?,"	/* tg_date */
 			"NOW()"	/* created_at */
-		");"
-	);
-
-	if (MYSQL_IS_ERR_OR_NULL<mysql::MySQLStmt>(stmt)) {
-		mysql_handle_prepare_err(db, stmt);
-		return 0;
-	}
-
-	if (unlikely(stmt->stmtInit())) {
-		stmtErrFunc = "stmtInit";
-		goto stmt_err;
-	}
-
-	stmt->bind(0, MYSQL_TYPE_LONGLONG, (void *) &pk_message_id,
-		   sizeof(pk_message_id));
-	stmt->bind(1, MYSQL_TYPE_STRING, (void *) text.c_str(), text.size());
-
-	if (!entities.size()) {
-		stmt->bind(2, MYSQL_TYPE_NULL, NULL, 0);
-	} else {
+		");",
+		uint64_t,
+		std::string_view,
+		std::optional<std::string_view>,
+		mysql::enum01,
+		mysql::datetime
+	> st(db);
+
+	if (entities.size()) {
 		entities_txt = to_string(entities);
-		void *p = (void *) entities_txt.c_str();
-		stmt->bind(2, MYSQL_TYPE_STRING, p, entities_txt.size());
+		entities_p = entities_txt;
 	}
 
-	stmt->bind(3, MYSQL_TYPE_STRING, bn_str(!!message.edit_date_), 1);
-
 	if (message.edit_date_)
 		tg_date_epoch = message.edit_date_;
 	else
 		tg_date_epoch = message.date_;
 
-	tg_date_size = convert_epoch_to_db_format(tg_date, sizeof(tg_date),
-						  tg_date_epoch);
-
-	if (tg_date_size)
-		stmt->bind(4, MYSQL_TYPE_STRING, tg_date, tg_date_size);
-	else
-		stmt->bind(4, MYSQL_TYPE_NULL, NULL, 0);
-
-	if (unlikely(stmt->bindStmt())) {
-		stmtErrFunc = "bindStmt";
-		goto stmt_err;
-	}
-
-	if (unlikely(stmt->execute())) {
-		stmtErrFunc = "execute";
-		goto stmt_err;
+	if (unlikely(st.execute(pk_message_id, text, entities_p,
+				!!message.edit_date_, tg_date_epoch))) {
+		mysql_handle_stmt_err(&st);
+		return 0;
 	}
 
-	pk_message_content_id = stmt->getInsertId();
-	goto out;
-
-stmt_err:
-	mysql_handle_stmt_err(stmtErrFunc, stmt);
-	pk_message_content_id = 0;
-out:
-	delete stmt;
-	return pk_message_content_id;
+	return st.getInsertId();
 }
 
-static uint64_t save_msg_fwd_info(KWorker *kwrk, mysql::MySQL *db,
-				  const td_api::messageForwardInfo &mfi,
-				  uint64_t pk_chat_id)
+/*
+ * The gt_msg_fwd_info columns that take some work to get out of a
+ * messageForwardInfo. The views point into @extra or the message.
+ */
+struct msg_fwd_cols {
+	std::string				extra;
+	std::optional<uint64_t>			sender_id;
+	std::optional<int64_t>			from_tg_chat_id;
+	std::optional<int64_t>			from_tg_msg_id;
+	std::optional<std::string_view>		sender_name;
+	std::optional<std::string_view>		author_signature;
+};
+
+/*
+ * gt_senders.id of the user @mfi was forwarded from, if it has one.
+ * Resolving it may create the sender in a transaction of its own, so
+ * don't call this with a transaction open on @db.
+ */
+std::optional<uint64_t> get_fwd_sender_pk(KWorker *kwrk, mysql::MySQL *db,
+					  const td_api::messageForwardInfo &mfi)
 {
-	char tg_date[64];
-	size_t tg_date_size;
-	uint64_t pk_msg_fwd_info_id = 0;
-	mysql::MySQLStmt *stmt = nullptr;
-	const char *stmtErrFunc = nullptr;
-	union {
-		uint64_t sender_id;
-	} p;
-
-	enum {
-		f_message_id = 0,
-		f_sender_id = 1,
-		f_tg_date = 2,
-		f_public_service_announcement_type = 3,
-		f_from_tg_chat_id = 4,
-		f_from_tg_msg_id = 5,
-		f_sender_name = 6,
-		f_author_signature = 7,
-		f_extra = 8
-	};
-
-	std::string extra = "";
 	const auto &origin = *mfi.origin_;
-	const auto obj_id = origin.get_id();
-	const std::string &psat = mfi.public_service_announcement_type_;
+	uint64_t pk_sender_id;
 
-	stmt = db->prepare(9,
-		"INSERT INTO `gt_msg_fwd_info`"
-		"("
-			"`message_id`,"
-			"`sender_id`,"
-			"`tg_date`,"
-			"`public_service_announcement_type`,"
-			"`from_tg_chat_id`,"
-			"`from_tg_msg_id`,"
-			"`sender_name`,"
-			"`author_signature`,"
-			"`extra`"
-		")"
-			" VALUES "
-		"("
-			"?,"
-			"?,"
-			"?,"
-			"?,"
-			"?,"
-			"?,"
-			"?,"
-			"?,"
-			"?"
-		");"
-	);
+	if (origin.get_id() != td_api::messageForwardOriginUser::ID)
+		return std::nullopt;
 
-	if (MYSQL_IS_ERR_OR_NULL<mysql::MySQLStmt>(stmt)) {
-		mysql_handle_prepare_err(db, stmt);
-		return 0;
-	}
+	auto &tmp1 = static_cast<const td_api::messageForwardOriginUser &>(origin);
+	auto tmp2  = td_api::messageSenderUser(tmp1.sender_user_id_);
+	auto tmp3  = SenderUser(kwrk, tmp2);
 
-	if (unlikely(stmt->stmtInit())) {
-		stmtErrFunc = "stmtInit";
-		goto stmt_err;
+	tmp3.setDbPool(db);
+	pk_sender_id = tmp3.getPK();
+	if (unlikely(!pk_sender_id)) {
+		pr_err("Cannot get sender_id in get_fwd_sender_pk");
+		return std::nullopt;
 	}
 
-	stmt->bind(f_message_id, MYSQL_TYPE_LONGLONG, (void *) &pk_chat_id,
-		   sizeof(pk_chat_id));
-
-	tg_date_size = convert_epoch_to_db_format(tg_date, sizeof(tg_date),
-						  (time_t) mfi.date_);
-
-	if (tg_date_size)
-		stmt->bind(f_tg_date, MYSQL_TYPE_STRING, tg_date, tg_date_size);
-	else
-		stmt->bind(f_tg_date, MYSQL_TYPE_NULL, NULL, 0);
+	return pk_sender_id;
+}
 
-	if (psat.size())
-		stmt->bind(f_public_service_announcement_type,
-			   MYSQL_TYPE_STRING, (void *) psat.c_str(),
-			   psat.size());
-	else
-		stmt->bind(f_public_service_announcement_type, MYSQL_TYPE_NULL,
-			   NULL, 0);
+/*
+ * Everything but sender_id, see get_fwd_sender_pk().
+ */
+static void get_msg_fwd_cols(const td_api::messageForwardInfo &mfi,
+			     struct msg_fwd_cols *c)
+{
+	const auto &origin = *mfi.origin_;
+	const auto obj_id = origin.get_id();
 
 	if (mfi.from_chat_id_)
-		stmt->bind(f_from_tg_chat_id,
-			   MYSQL_TYPE_LONGLONG, (void *) &mfi.from_chat_id_,
-			   sizeof(mfi.from_chat_id_));
-	else
-		stmt->bind(f_from_tg_chat_id, MYSQL_TYPE_NULL, NULL, 0);
+		c->from_tg_chat_id = mfi.from_chat_id_;
 
 	if (mfi.from_message_id_)
-		stmt->bind(f_from_tg_msg_id,
-			   MYSQL_TYPE_LONGLONG, (void *) &mfi.from_message_id_,
-			   sizeof(mfi.from_message_id_));
-	else
-		stmt->bind(f_from_tg_msg_id, MYSQL_TYPE_NULL, NULL, 0);
-
+		c->from_tg_msg_id = mfi.from_message_id_;
 
 	if (obj_id == td_api::messageForwardOriginUser::ID) {
-		auto &tmp1 = static_cast<const td_api::messageForwardOriginUser &>(origin);
-		auto tmp2  = td_api::messageSenderUser(tmp1.sender_user_id_);
-		auto tmp3  = SenderUser(kwrk, tmp2);
-		tmp3.setDbPool(db);
-		p.sender_id = tmp3.getPK();
-		if (unlikely(!p.sender_id)) {
-			pr_err("Cannot get sender_id in save_msg_fwd_info");
-			stmt->bind(f_sender_id, MYSQL_TYPE_NULL, NULL, 0);
-		} else {
-			stmt->bind(f_sender_id, MYSQL_TYPE_LONGLONG,
-				   (void *) &p.sender_id, sizeof(p.sender_id));
-		}
-		stmt->bind(f_sender_name, MYSQL_TYPE_NULL, NULL, 0);
-		stmt->bind(f_author_signature, MYSQL_TYPE_NULL, NULL, 0);
+		/* Nothing else to take from it. */
 
 	} else if (obj_id == td_api::messageForwardOriginChannel::ID) {
 		auto &tmp1 = static_cast<const td_api::messageForwardOriginChannel &>(origin);
-		const std::string &tmp2 = tmp1.author_signature_;
-		extra = to_string(tmp1);
+		c->extra = to_string(tmp1);
 
 		/* TODO: Handle chat sender. */
-		stmt->bind(f_sender_id, MYSQL_TYPE_NULL, NULL, 0);
-		stmt->bind(f_sender_name, MYSQL_TYPE_NULL, NULL, 0);
-		if (tmp2.size())
-			stmt->bind(f_author_signature, MYSQL_TYPE_STRING,
-				   (void *) tmp2.c_str(), tmp2.size());
-		else
-			stmt->bind(f_author_signature, MYSQL_TYPE_NULL, NULL, 0);
+		c->author_signature = mysql::str_or_null(tmp1.author_signature_);
 
 	} else if (obj_id == td_api::messageForwardOriginChat::ID) {
 		auto &tmp1 = static_cast<const td_api::messageForwardOriginChat &>(origin);
-		extra = to_string(tmp1);
+		c->extra = to_string(tmp1);
 
 		/* TODO: Handle chat sender. */
-		stmt->bind(f_sender_id, MYSQL_TYPE_NULL, NULL, 0);
-		stmt->bind(f_sender_name, MYSQL_TYPE_NULL, NULL, 0);
-		stmt->bind(f_author_signature, MYSQL_TYPE_NULL, NULL, 0);
 
 	} else if (obj_id == td_api::messageForwardOriginHiddenUser::ID) {
 		auto &tmp1 = static_cast<const td_api::messageForwardOriginHiddenUser &>(origin);
 
-		stmt->bind(f_sender_id, MYSQL_TYPE_NULL, NULL, 0);
-		stmt->bind(f_sender_name, MYSQL_TYPE_STRING,
-			   (void *)tmp1.sender_name_.c_str(),
-			   tmp1.sender_name_.size());
-		stmt->bind(f_author_signature, MYSQL_TYPE_NULL, NULL, 0);
+		c->sender_name = tmp1.sender_name_;
 
 	} else if (obj_id == td_api::messageForwardOriginMessageImport::ID) {
 		auto &tmp1 = static_cast<const td_api::messageForwardOriginMessageImport &>(origin);
-		extra = to_string(tmp1);
+		c->extra = to_string(tmp1);
 
 		/* TODO: Handle chat sender. */
-		stmt->bind(f_sender_id, MYSQL_TYPE_NULL, NULL, 0);
-		stmt->bind(f_sender_name, MYSQL_TYPE_NULL, NULL, 0);
-		stmt->bind(f_author_signature, MYSQL_TYPE_NULL, NULL, 0);
 	} else {
-		extra = "unknown_type";
+		c->extra = "unknown_type";
 		/* TODO: Handle chat sender. */
-		stmt->bind(f_sender_id, MYSQL_TYPE_NULL, NULL, 0);
-		stmt->bind(f_sender_name, MYSQL_TYPE_NULL, NULL, 0);
-		stmt->bind(f_author_signature, MYSQL_TYPE_NULL, NULL, 0);
 	}
+}
 
-	if (extra.size())
-		stmt->bind(f_extra, MYSQL_TYPE_STRING, (void *) extra.c_str(),
-			   extra.size());
-	else
-		stmt->bind(f_extra, MYSQL_TYPE_NULL, NULL, 0);
-
-	if (unlikely(stmt->bindStmt())) {
-		stmtErrFunc = "bindStmt";
-		goto stmt_err;
-	}
+uint64_t save_msg_fwd_info(mysql::MySQL *db,
+			   const td_api::messageForwardInfo &mfi,
+			   uint64_t pk_chat_id,
+			   std::optional<uint64_t> fwd_sender_id)
+{
+	struct msg_fwd_cols c;
 
-	if (unlikely(stmt->execute())) {
-		stmtErrFunc = "execute";
-		goto stmt_err;
+	mysql::Statement<
+		"INSERT INTO `gt_msg_fwd_info`"
+		"("
+			"`message_id`,"
+			"`sender_id`,"
+			"`tg_date`,"
+			"`public_service_announcement_type`,"
+			"`from_tg_chat_id`,"
+			"`from_tg_msg_id`,"
+			"`sender_name`,"
+			"`author_signature`,"
+			"`extra`"
+		")"
+			" VALUES "
+		"("
+			"?,"
+			"?,"
+			"?,"
+			"?,"
+			"?,"
+			"?,"
+			"?,"
+			"?,"
+			"?"
+		");",
+		uint64_t,				/* message_id */
+		std::optional<uint64_t>,		/* sender_id */
+		mysql::datetime,			/* tg_date */
+		std::optional<std::string_view>,	/* public_service_announcement_type */
+		std::optional<int64_t>,			/* from_tg_chat_id */
+		std::optional<int64_t>,			/* from_tg_msg_id */
+		std::optional<std::string_view>,	/* sender_name */
+		std::optional<std::string_view>,	/* author_signature */
+		std::optional<std::string_view>		/* extra */
+	> st(db);
+
+	get_msg_fwd_cols(mfi, &c);
+	c.sender_id = fwd_sender_id;
+	if (unlikely(st.execute(pk_chat_id, c.sender_id, (time_t) mfi.date_,
+				mysql::str_or_null(mfi.public_service_announcement_type_),
+				c.from_tg_chat_id, c.from_tg_msg_id, c.sender_name,
+				c.author_signature, mysql::str_or_null(c.extra)))) {
+		mysql_handle_stmt_err(&st);
+		return 0;
 	}
 
-	pk_msg_fwd_info_id = stmt->getInsertId();
-	goto out;
-
-stmt_err:
-	mysql_handle_stmt_err(stmtErrFunc, stmt);
-	pk_msg_fwd_info_id = 0;
-out:
-	delete stmt;
-	return pk_msg_fwd_info_id;
+	return st.getInsertId();
 }
 
-static uint64_t create_message(KWorker *kwrk, mysql::MySQL *db,
-			       const td_api::message &message,
-			       uint64_t pk_chat_id, uint64_t pk_sender_id)
+static uint64_t create_message(mysql::MySQL *db, const td_api::message &message,
+			       uint64_t pk_chat_id, uint64_t pk_sender_id,
+			       std::optional<uint64_t> fwd_sender_id)
 {
-	uint64_t tg_msg_id;
 	uint64_t pk_message_id;
-	uint64_t reply_to_tg_msg_id;
-	mysql::MySQLStmt *stmt = nullptr;
-	const char *stmtErrFunc = nullptr;
+	std::optional<uint64_t> reply_to_tg_msg_id;
 
-	stmt = db->prepare(8,
+	/*
+	 * (chat_id, tg_msg_id) is unique. If the message is already
+	 * there, LAST_INSERT_ID(id) makes getInsertId() return the
+	 * existing row and the affected rows count is 0.
+	 */
+	mysql::Statement<
 		"INSERT INTO `gt_messages` "
 		"("
 			"`chat_id`,"
@@ -544,126 +439,175 @@ static uint64_t create_message(KWorker *kwrk, mysql::MySQL *db,
 			"?,"		/* is_deleted */
 			"NOW(),"	/* created_at */
 			"NULL"		/* updated_at */
-		");"
-	);
-
-	if (MYSQL_IS_ERR_OR_NULL<mysql::MySQLStmt>(stmt)) {
-		mysql_handle_prepare_err(db, stmt);
+		") "
+		"ON DUPLICATE KEY UPDATE `id` = LAST_INSERT_ID(`id`);",
+		uint64_t,
+		uint64_t,
+		uint64_t,
+		std::optional<uint64_t>,
+		std::string_view,
+		mysql::enum01,
+		mysql::enum01,
+		mysql::enum01
+	> st(db);
+
+	if (message.reply_to_message_id_ >> 20u)
+		reply_to_tg_msg_id = (uint64_t) message.reply_to_message_id_ >> 20u;
+
+	if (unlikely(st.execute(pk_chat_id, pk_sender_id,
+				(uint64_t) message.id_ >> 20u,
+				reply_to_tg_msg_id, "text",
+				!!message.edit_date_, !!message.forward_info_,
+				false))) {
+		mysql_handle_stmt_err(&st);
 		return 0;
 	}
 
-	if (unlikely(stmt->stmtInit())) {
-		stmtErrFunc = "stmtInit";
-		goto stmt_err;
-	}
-
-	tg_msg_id = message.id_ >> 20u;
-	reply_to_tg_msg_id = message.reply_to_message_id_ >> 20u;
+	pk_message_id = st.getInsertId();
 
-	stmt->bind(0, MYSQL_TYPE_LONGLONG, (void *) &pk_chat_id,
-		   sizeof(pk_chat_id));
-	stmt->bind(1, MYSQL_TYPE_LONGLONG, (void *) &pk_sender_id,
-		   sizeof(pk_sender_id));
-	stmt->bind(2, MYSQL_TYPE_LONGLONG, (void *) &tg_msg_id,
-		   sizeof(tg_msg_id));
-
-	if (reply_to_tg_msg_id)
-		stmt->bind(3, MYSQL_TYPE_LONGLONG, (void *) &reply_to_tg_msg_id,
-			   sizeof(reply_to_tg_msg_id));
-	else
-		stmt->bind(3, MYSQL_TYPE_NULL, NULL, 0);
-
-	stmt->bind(4, MYSQL_TYPE_STRING, (void *) "text", 4);
-	stmt->bind(5, MYSQL_TYPE_STRING,
-		   (void *) (message.edit_date_ ? "1" : "0"), 1);
-	stmt->bind(6, MYSQL_TYPE_STRING,
-		   (void *) (message.forward_info_ ? "1" : "0"), 1);
-	stmt->bind(7, MYSQL_TYPE_STRING, (void *) "0" , 1);
-
-	if (unlikely(stmt->bindStmt())) {
-		stmtErrFunc = "bindStmt";
-		goto stmt_err;
-	}
-
-	if (unlikely(stmt->execute())) {
-		stmtErrFunc = "execute";
-		goto stmt_err;
-	}
-
-	pk_message_id = stmt->getInsertId();
+	/* Already saved, together with its content. */
+	if (st.getAffectedRows() != 1)
+		return pk_message_id;
 
 	if (message.forward_info_) {
-		if (unlikely(!save_msg_fwd_info(kwrk, db,
-						*message.forward_info_,
-						pk_message_id))) {
-			pk_message_id = 0;
-			goto out;
-		}
+		if (unlikely(!save_msg_fwd_info(db, *message.forward_info_,
+						pk_message_id, fwd_sender_id)))
+			return 0;
 	}
 
 	if (unlikely(!create_message_content(db, message, pk_message_id)))
-		pk_message_id = 0;
-
-	goto out;
+		return 0;
 
-stmt_err:
-	mysql_handle_stmt_err(stmtErrFunc, stmt);
-	pk_message_id = 0;
-out:
-	delete stmt;
 	return pk_message_id;
 }
 
-static uint64_t get_message_pk(KWorker *kwrk, mysql::MySQL *db,
-			       const td_api::message &message,
-			       uint64_t pk_chat_id, uint64_t pk_sender_id)
+/*
+ * Same as create_message() in a transaction, done by the server in
+ * one CALL, so the whole save costs a single round trip. Resolving
+ * a forwarded message's sender may still need its own queries.
+ */
+static uint64_t save_message_proc(KWorker *kwrk, mysql::MySQL *db,
+				  const td_api::message &message,
+				  uint64_t pk_chat_id, uint64_t pk_sender_id)
 {
-	static const char q[] =
-		"SELECT id FROM gt_messages WHERE "
-		"chat_id = %" PRIu64 " AND tg_msg_id = %" PRIu64;
-
-	int qlen, tmp;
-	MYSQL_ROW row;
-	mysql::MySQLRes *res;
-	uint64_t tg_msg_id;
+	int ret;
 	uint64_t pk_message_id;
-	char qbuf[sizeof(q) + 128];
-
-	tg_msg_id = message.id_ >> 20u;
-	qlen = snprintf(qbuf, sizeof(qbuf), q, pk_chat_id, tg_msg_id);
+	int64_t is_new;
+	time_t tg_date_epoch;
+	std::string entities_txt;
+	std::optional<std::string_view> entities_p;
+	std::optional<uint64_t> reply_to_tg_msg_id;
+	struct msg_fwd_cols fwd;
+	std::optional<mysql::datetime> fwd_tg_date;
+	std::optional<std::string_view> fwd_psa_type, fwd_extra;
 
-	tmp = db->realQuery(qbuf, (size_t) qlen);
-	if (unlikely(tmp)) {
-		pr_err("query(): %s", db->getError());
+	const auto &content = static_cast<const td_api::messageText &>(*message.content_);
+	if (unlikely(!content.text_))
 		return 0;
+
+	const auto &formattedText = *content.text_;
+	const auto &mfi = message.forward_info_;
+
+	mysql::Select<
+		"CALL `gt_save_text_message`"
+		"("
+			"?,?,?,?,?,?,?,?,"
+			"?,?,?,?,?,?,?,?,?"
+		");",
+		mysql::columns<
+			uint64_t,			/* id */
+			int64_t				/* is_new */
+		>,
+		uint64_t,				/* chat_id */
+		uint64_t,				/* sender_id */
+		uint64_t,				/* tg_msg_id */
+		std::optional<uint64_t>,		/* reply_to_tg_msg_id */
+		bool,					/* is_edited */
+		std::string_view,			/* text */
+		std::optional<std::string_view>,	/* text_entities */
+		mysql::datetime,			/* tg_date */
+		bool,					/* is_forwarded */
+		std::optional<uint64_t>,		/* fwd_sender_id */
+		std::optional<mysql::datetime>,		/* fwd_tg_date */
+		std::optional<std::string_view>,	/* fwd_psa_type */
+		std::optional<int64_t>,			/* fwd_from_tg_chat_id */
+		std::optional<int64_t>,			/* fwd_from_tg_msg_id */
+		std::optional<std::string_view>,	/* fwd_sender_name */
+		std::optional<std::string_view>,	/* fwd_author_signature */
+		std::optional<std::string_view>		/* fwd_extra */
+	> st(db);
+
+	if (formattedText.entities_.size()) {
+		entities_txt = to_string(formattedText.entities_);
+		entities_p = entities_txt;
 	}
 
-	res = db->storeResult();
-	if (MYSQL_IS_ERR_OR_NULL(res)) {
-		pr_err("storeResult(): %s", db->getError());
+	if (message.edit_date_)
+		tg_date_epoch = message.edit_date_;
+	else
+		tg_date_epoch = message.date_;
+
+	if (message.reply_to_message_id_ >> 20u)
+		reply_to_tg_msg_id = (uint64_t) message.reply_to_message_id_ >> 20u;
+
+	if (mfi) {
+		get_msg_fwd_cols(*mfi, &fwd);
+		fwd.sender_id = get_fwd_sender_pk(kwrk, db, *mfi);
+		fwd_tg_date = (time_t) mfi->date_;
+		fwd_psa_type = mysql::str_or_null(mfi->public_service_announcement_type_);
+		fwd_extra = mysql::str_or_null(fwd.extra);
+	}
+
+	ret = st.execute(pk_chat_id, pk_sender_id, (uint64_t) message.id_ >> 20u,
+			 reply_to_tg_msg_id, !!message.edit_date_,
+			 formattedText.text_, entities_p, tg_date_epoch,
+			 !!mfi, fwd.sender_id, fwd_tg_date, fwd_psa_type,
+			 fwd.from_tg_chat_id, fwd.from_tg_msg_id,
+			 fwd.sender_name, fwd.author_signature, fwd_extra);
+	if (unlikely(ret)) {
+		if (st.getErrno() == ER_SP_DOES_NOT_EXIST) {
+			pr_err("gt_save_text_message() is missing, apply "
+			       "migrations/0002_gt_save_text_message.sql. "
+			       "Falling back to TGVISD_MYSQL_SAVE_MODE=stmt");
+			kwrk->disableSaveProc();
+			return 0;
+		}
+
+		mysql_handle_stmt_err(&st);
 		return 0;
 	}
 
-	row = res->fetchRow();
-	if (!row) {
-		pk_message_id = create_message(kwrk, db, message, pk_chat_id,
-					       pk_sender_id);
-		goto out;
+	ret = st.next(pk_message_id, is_new);
+	if (unlikely(ret)) {
+		if (ret < 0)
+			mysql_handle_stmt_err(&st);
+		else
+			pr_err("gt_save_text_message() returned no row");
+		return 0;
 	}
 
-	pk_message_id = strtoull(row[0], NULL, 10);
-out:
-	delete res;
 	return pk_message_id;
 }
 
-static uint64_t save_message_if_not_exist(KWorker *kwrk, mysql::MySQL *db,
-					  const td_api::message &message,
-					  uint64_t pk_chat_id,
-					  uint64_t pk_sender_id)
+uint64_t save_message_if_not_exist(KWorker *kwrk, mysql::MySQL *db,
+				   const td_api::message &message,
+				   uint64_t pk_chat_id, uint64_t pk_sender_id)
 {
 	int tmp;
 	uint64_t pk_message_id;
+	std::optional<uint64_t> fwd_sender_id;
+
+	if (kwrk->useSaveProc()) {
+		pk_message_id = save_message_proc(kwrk, db, message, pk_chat_id,
+						  pk_sender_id);
+
+		/* Unless the procedure is missing, that is all. */
+		if (likely(pk_message_id) || kwrk->useSaveProc())
+			return pk_message_id;
+	}
+
+	if (message.forward_info_)
+		fwd_sender_id = get_fwd_sender_pk(kwrk, db, *message.forward_info_);
 
 	tmp = db->beginTransaction();
 	if (unlikely(tmp)) {
@@ -671,8 +615,8 @@ static uint64_t save_message_if_not_exist(KWorker *kwrk, mysql::MySQL *db,
 		return 0;
 	}
 
-	pk_message_id = get_message_pk(kwrk, db, message, pk_chat_id,
-				       pk_sender_id);
+	pk_message_id = create_message(db, message, pk_chat_id, pk_sender_id,
+				       fwd_sender_id);
 	if (unlikely(!pk_message_id))
 		goto rollback;
 
@@ -694,26 +638,50 @@ rollback:
 }
 
 /* static */
+static const char min_max_msg_id_q[] =
+	"SELECT gt_messages.tg_msg_id FROM gt_messages "
+	"WHERE gt_messages.chat_id = ( "
+		"SELECT gt_chats.id FROM gt_chats "
+		"INNER JOIN gt_chat_group ON gt_chats.id = gt_chat_group.chat_id "
+		"INNER JOIN gt_groups ON gt_groups.id = gt_chat_group.group_id "
+		"WHERE gt_groups.tg_group_id = %" PRId64 " LIMIT 1"
+	") "
+	"ORDER BY gt_messages.tg_msg_id %s LIMIT 1;";
+
+
+static int min_max_msg_id_query(char *qbuf, size_t size, int64_t tg_group_id,
+				bool minMax)
+{
+	const char *order_type = minMax ? "ASC" : "DESC";
+
+	return snprintf(qbuf, size, min_max_msg_id_q, tg_group_id, order_type);
+}
+
+
+static int64_t min_max_msg_id_fetch(mysql::MySQLRes *res)
+{
+	MYSQL_ROW row;
+
+	row = res->fetchRow();
+	if (!row)
+		/*
+		 * The query didn't fail, we just don't yet have any
+		 * record for this tg_group_id.
+		 */
+		return 0;
+
+	return strtoll(row[0], NULL, 10);
+}
+
+
 int64_t Message::getMinMaxMsgIdByTgGroupId(KWorker *kwrk, int64_t tg_group_id,
 					   bool minMax)
 {
-	static const char q[] =
-		"SELECT gt_messages.tg_msg_id FROM gt_messages "
-		"WHERE gt_messages.chat_id = ( "
-			"SELECT gt_chats.id FROM gt_chats "
-			"INNER JOIN gt_chat_group ON gt_chats.id = gt_chat_group.chat_id "
-			"INNER JOIN gt_groups ON gt_groups.id = gt_chat_group.group_id "
-			"WHERE gt_groups.tg_group_id = %" PRId64 " LIMIT 1"
-		") "
-		"ORDER BY gt_messages.tg_msg_id %s LIMIT 1;";
-
 	int64_t ret;
 	int qlen, tmp;
-	MYSQL_ROW row;
 	mysql::MySQL *db;
-	char qbuf[sizeof(q) + 128];
+	char qbuf[sizeof(min_max_msg_id_q) + 128];
 	mysql::MySQLRes *res = nullptr;
-	const char *order_type = minMax ? "ASC" : "DESC";
 
 
 	db = kwrk->getDbPool();
@@ -721,7 +689,7 @@ int64_t Message::getMinMaxMsgIdByTgGroupId(KWorker *kwrk, int64_t tg_group_id,
 		return -1;
 
 	ret  = -1;
-	qlen = snprintf(qbuf, sizeof(qbuf), q, tg_group_id, order_type);
+	qlen = min_max_msg_id_query(qbuf, sizeof(qbuf), tg_group_id, minMax);
 	tmp  = db->realQuery(qbuf, (size_t) qlen);
 	if (unlikely(tmp)) {
 		pr_err("query(): %s", db->getError());
@@ -734,16 +702,7 @@ int64_t Message::getMinMaxMsgIdByTgGroupId(KWorker *kwrk, int64_t tg_group_id,
 		goto out;
 	}
 
-	row = res->fetchRow();
-	if (!row)
-		/*
-		 * The query didn't fail, we just don't yet have any
-		 * record for this tg_group_id. Set the @ret to 0.
-		 */
-		ret = 0;
-	else
-		ret = strtoll(row[0], NULL, 10);
-
+	ret = min_max_msg_id_fetch(res);
 	delete res;
 out:
 	kwrk->putDbPool(db);
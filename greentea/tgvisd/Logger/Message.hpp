@@ -10,6 +10,7 @@
 #ifndef TGVISD__LOGGER__MESSAGE_HPP
 #define TGVISD__LOGGER__MESSAGE_HPP
 
+#include <optional>
 #include <tgvisd/KWorker.hpp>
 #include <tgvisd/Logger/Chat/Group.hpp>
 #include <tgvisd/Logger/Chat/User.hpp>
@@ -39,7 +40,11 @@ public:
 		return std::move(chat_);
 	}
 
-	void save(void);
+	/*
+	 * Returns false if the message should have been saved but
+	 * couldn't be. Messages we don't store count as saved.
+	 */
+	bool save(void);
 
 	static int64_t getMinMaxMsgIdByTgGroupId(KWorker *kwrk,
 						int64_t tg_group_id,
@@ -82,6 +87,22 @@ private:
 	bool resolve_pk(void);
 };
 
+std::optional<uint64_t> get_fwd_sender_pk(KWorker *kwrk, mysql::MySQL *db,
+					  const td_api::messageForwardInfo &mfi);
+
+/*
+ * @fwd_sender_id comes from get_fwd_sender_pk(), called before the
+ * transaction this runs in was started.
+ */
+uint64_t save_msg_fwd_info(mysql::MySQL *db,
+			   const td_api::messageForwardInfo &mfi,
+			   uint64_t pk_message_id,
+			   std::optional<uint64_t> fwd_sender_id);
+
+uint64_t save_message_if_not_exist(KWorker *kwrk, mysql::MySQL *db,
+				   const td_api::message &message,
+				   uint64_t pk_chat_id, uint64_t pk_sender_id);
+
 } /* namespace tgvisd::Logger */
 
 #endif /* #ifndef TGVISD__LOGGER__MESSAGE_HPP */
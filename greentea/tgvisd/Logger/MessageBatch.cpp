@@ -0,0 +1,214 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * @author Ammar Faizi <ammarfaizi2@gmail.com>
+ * @license GPL-2.0-only
+ * @package tgvisd::Logger
+ *
+ * Copyright (C) 2022  Ammar Faizi <ammarfaizi2@gmail.com>
+ */
+
+#include <future>
+#include <tgvisd/Logger/Chat/Group.hpp>
+#include <tgvisd/Logger/Chat/User.hpp>
+#include <tgvisd/Logger/Sender/Chat.hpp>
+#include <tgvisd/Logger/Sender/User.hpp>
+#include <tgvisd/Logger/BatchWriter.hpp>
+#include <tgvisd/Logger/MessageBatch.hpp>
+
+using SenderUser = tgvisd::Logger::Sender::User;
+using SenderChat = tgvisd::Logger::Sender::Chat;
+using ChatGroup = tgvisd::Logger::Chat::Group;
+using ChatUser = tgvisd::Logger::Chat::User;
+
+namespace tgvisd::Logger {
+
+MessageBatch::MessageBatch(KWorker *kworker, const td_api::chat &chat,
+			   std::mutex *chat_lock):
+	kworker_(kworker),
+	chat_(chat),
+	chat_lock_(chat_lock)
+{
+}
+
+uint64_t MessageBatch::resolve_chat_pk(mysql::MySQL *db)
+	__acquires(chat_lock_)
+	__releases(chat_lock_)
+{
+	ChatFoundation *m_chat;
+	uint64_t ret;
+
+	switch (chat_.type_->get_id()) {
+	case td_api::chatTypeBasicGroup::ID:
+	case td_api::chatTypeSupergroup::ID:
+		m_chat = new ChatGroup(kworker_, chat_);
+		break;
+	case td_api::chatTypeSecret::ID:
+	case td_api::chatTypePrivate::ID:
+		m_chat = new ChatUser(kworker_, chat_);
+		break;
+	default:
+		pr_err("Invalid chat type on resolve_chat_pk()");
+		return 0;
+	}
+
+	m_chat->setDbPool(db);
+	chat_lock_->lock();
+	ret = m_chat->getPK();
+	chat_lock_->unlock();
+	delete m_chat;
+	return ret;
+}
+
+uint64_t MessageBatch::resolve_sender_pk(mysql::MySQL *db,
+					 const td_api::MessageSender &sender)
+{
+	SenderFoundation *m_sender;
+	std::mutex *sender_lock;
+	sender_key key;
+	uint64_t ret;
+
+	switch (sender.get_id()) {
+	case td_api::messageSenderUser::ID:
+		key.second = static_cast<const td_api::messageSenderUser &>(sender).user_id_;
+		sender_lock = kworker_->getUserLock(key.second);
+		break;
+	case td_api::messageSenderChat::ID:
+		key.second = static_cast<const td_api::messageSenderChat &>(sender).chat_id_;
+		sender_lock = kworker_->getChatLock(key.second);
+		break;
+	default:
+		pr_err("Invalid sender type on resolve_sender_pk()");
+		return 0;
+	}
+	key.first = sender.get_id();
+
+	const auto &it = senderPKs_.find(key);
+	if (it != senderPKs_.end())
+		return it->second;
+
+	if (unlikely(!sender_lock)) {
+		pr_err("resolve_sender_pk(): Could not get sender lock (%ld)",
+		       key.second);
+		return 0;
+	}
+
+	if (key.first == td_api::messageSenderUser::ID)
+		m_sender = new SenderUser(kworker_, sender);
+	else
+		m_sender = new SenderChat(kworker_, sender);
+
+	m_sender->setDbPool(db);
+	sender_lock->lock();
+	ret = m_sender->getPK();
+	sender_lock->unlock();
+	delete m_sender;
+
+	if (likely(ret))
+		senderPKs_.emplace(key, ret);
+
+	return ret;
+}
+
+size_t MessageBatch::save(std::vector<bool> *ok)
+{
+	BatchWriter *bw = kworker_->getBatchWriter();
+	std::vector<struct batch_entry> ents;
+	std::vector<struct batch_entry *> batch;
+	std::vector<std::future<uint64_t>> futs;
+	std::vector<size_t> ent_msg, batch_msg;
+	uint64_t pk_chat_id, pk_sender_id;
+	size_t i, nr_failed = 0;
+	mysql::MySQL *db;
+
+	ok->assign(messages_.size(), true);
+
+	/*
+	 * Currently, we only save text message.
+	 * TODO: Handle other types of message, like photo, sticker, etc.
+	 */
+	for (i = 0; i < messages_.size(); i++) {
+		const td_api::message *msg = messages_[i];
+
+		if (unlikely(!msg->content_))
+			continue;
+
+		if (msg->content_->get_id() != td_api::messageText::ID)
+			continue;
+
+		ent_msg.push_back(i);
+	}
+
+	if (ent_msg.empty())
+		return 0;
+
+	db = kworker_->getDbPool(32000ms);
+	if (unlikely(!db))
+		goto out_fail_all;
+
+	pk_chat_id = resolve_chat_pk(db);
+	if (unlikely(!pk_chat_id)) {
+		kworker_->putDbPool(db);
+		goto out_fail_all;
+	}
+
+	ents.resize(ent_msg.size());
+	batch.reserve(ent_msg.size());
+	for (i = 0; i < ent_msg.size(); i++) {
+		const td_api::message *msg = messages_[ent_msg[i]];
+		struct batch_entry *ent = &ents[i];
+
+		pk_sender_id = resolve_sender_pk(db, *msg->sender_id_);
+		if (unlikely(!pk_sender_id)) {
+			(*ok)[ent_msg[i]] = false;
+			nr_failed++;
+			continue;
+		}
+
+		ent->message = msg;
+		ent->pk_chat_id = pk_chat_id;
+		ent->pk_sender_id = pk_sender_id;
+		batch.push_back(ent);
+		batch_msg.push_back(ent_msg[i]);
+	}
+
+	if (unlikely(batch.empty())) {
+		kworker_->putDbPool(db);
+		return nr_failed;
+	}
+
+	futs.reserve(batch.size());
+	for (auto ent: batch)
+		futs.push_back(ent->done.get_future());
+
+	if (unlikely(!bw->writeBatch(db, batch))) {
+		/*
+		 * Nothing has been completed, let the batch writer sort
+		 * out which of them are bad.
+		 */
+		for (i = 0; i < batch.size(); i++) {
+			batch[i]->done = std::promise<uint64_t>();
+			futs[i] = bw->submit(batch[i]);
+		}
+	}
+	kworker_->putDbPool(db);
+
+	for (i = 0; i < futs.size(); i++) {
+		if (likely(futs[i].get())) {
+			nrStored_++;
+			continue;
+		}
+
+		(*ok)[batch_msg[i]] = false;
+		nr_failed++;
+	}
+
+	return nr_failed;
+
+out_fail_all:
+	for (i = 0; i < ent_msg.size(); i++)
+		(*ok)[ent_msg[i]] = false;
+
+	return ent_msg.size();
+}
+
+} /* namespace tgvisd::Logger */
@@ -0,0 +1,82 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * @author Ammar Faizi <ammarfaizi2@gmail.com>
+ * @license GPL-2.0-only
+ * @package tgvisd::Logger
+ *
+ * Copyright (C) 2022  Ammar Faizi <ammarfaizi2@gmail.com>
+ */
+
+#ifndef TGVISD__LOGGER__MESSAGEBATCH_HPP
+#define TGVISD__LOGGER__MESSAGEBATCH_HPP
+
+#include <map>
+#include <mutex>
+#include <vector>
+#include <utility>
+#include <tgvisd/KWorker.hpp>
+
+namespace tgvisd::Logger {
+
+/*
+ * Saves a page of messages from one chat at once, the way Message
+ * saves a single one.
+ *
+ * The chat and every distinct sender are resolved once for the whole
+ * page. The text messages are then written with
+ * BatchWriter::writeBatch() in one transaction on our own connection:
+ * one IN (...) lookup for the ones already stored, multi-row INSERTs
+ * for the rest. If that transaction fails, the messages go through
+ * the batch writer, which retries them one by one.
+ */
+class MessageBatch
+{
+public:
+	MessageBatch(KWorker *kworker, const td_api::chat &chat,
+		     std::mutex *chat_lock);
+
+	inline void add(const td_api::message *message)
+	{
+		messages_.push_back(message);
+	}
+
+	inline size_t size(void) const
+	{
+		return messages_.size();
+	}
+
+	/*
+	 * Save every message added so far. (*ok)[i] tells whether the
+	 * i-th one made it, messages we don't store count as saved.
+	 * Returns the number of messages that didn't.
+	 */
+	size_t save(std::vector<bool> *ok);
+
+	/*
+	 * Number of messages save() actually wrote (or found stored),
+	 * the ones we don't store aren't counted.
+	 */
+	inline size_t getNrStored(void) const
+	{
+		return nrStored_;
+	}
+
+private:
+	/* MessageSender constructor id, user or chat id. */
+	using sender_key = std::pair<int32_t, int64_t>;
+
+	KWorker					*kworker_ = nullptr;
+	const td_api::chat			&chat_;
+	std::mutex				*chat_lock_ = nullptr;
+	std::vector<const td_api::message *>	messages_;
+	std::map<sender_key, uint64_t>		senderPKs_;
+	size_t					nrStored_ = 0;
+
+	uint64_t resolve_chat_pk(mysql::MySQL *db);
+	uint64_t resolve_sender_pk(mysql::MySQL *db,
+				   const td_api::MessageSender &sender);
+};
+
+} /* namespace tgvisd::Logger */
+
+#endif /* #ifndef TGVISD__LOGGER__MESSAGEBATCH_HPP */
@@ -16,35 +16,42 @@
 namespace tgvisd::Logger::Sender {
 
 struct user_data {
+	KWorker						*kworker_;
 	const td_api::MessageSender			&sender_;
-	td_api::object_ptr<td_api::user>		user_;
-	td_api::object_ptr<td_api::userFullInfo>	userFull_;
+	std::shared_ptr<const td_api::user>		user_;
+	std::shared_ptr<const td_api::userFullInfo>	userFull_;
 
 	inline ~user_data(void) = default;
 
-	inline user_data(const td_api::MessageSender &sender):
+	inline user_data(KWorker *kworker, const td_api::MessageSender &sender):
+		kworker_(kworker),
 		sender_(sender)
 	{
 	}
 };
 
-static inline void *bn_str(bool p)
+static std::string_view user_type_str(const td_api::user &user)
 {
-	return (void *) (p ? "1" : "0");
+	switch (user.type_->get_id()) {
+	case td_api::userTypeBot::ID:
+		return "bot";
+	case td_api::userTypeDeleted::ID:
+		return "deleted";
+	case td_api::userTypeRegular::ID:
+		return "user";
+	case td_api::userTypeUnknown::ID:
+	default:
+		return "unknown";
+	}
 }
 
 static uint64_t create_user_history(mysql::MySQL *db, struct user_data *ud,
 				    uint64_t pk_user_id)
 {
-	uint64_t pk_id;
-	size_t user_type_len;
-	const char *user_type;
-	const char *stmtErrFunc = nullptr;
-	mysql::MySQLStmt *stmt = nullptr;
 	const td_api::user &user = *ud->user_;
 	const td_api::userFullInfo &userFull = *ud->userFull_;
 
-	stmt = db->prepare(10,
+	mysql::Statement<
 		"INSERT INTO `gt_users_history` "
 		"("
 			"`user_id`,"
@@ -72,114 +79,43 @@ static uint64_t create_user_history(mysql::MySQL *db, struct user_data *ud,
 			"?,"		/* bio */
 			"?,"		/* type */
 			"NOW()"		/* created_at */
-		");"
-	);
-
-	if (MYSQL_IS_ERR_OR_NULL<mysql::MySQLStmt>(stmt)) {
-		mysql_handle_prepare_err(db, stmt);
+		");",
+		uint64_t,
+		std::optional<std::string_view>,
+		std::optional<std::string_view>,
+		std::optional<std::string_view>,
+		std::optional<std::string_view>,
+		mysql::enum01,
+		mysql::enum01,
+		mysql::enum01,
+		std::optional<std::string_view>,
+		std::string_view
+	> st(db);
+
+	if (unlikely(st.execute(pk_user_id,
+				mysql::str_or_null(user.username_),
+				mysql::str_or_null(user.first_name_),
+				mysql::str_or_null(user.last_name_),
+				mysql::str_or_null(user.phone_number_),
+				user.is_verified_,
+				user.is_support_,
+				user.is_scam_,
+				mysql::str_or_null(userFull.bio_),
+				user_type_str(user)))) {
+		mysql_handle_stmt_err(&st);
 		return 0;
 	}
 
-	if (unlikely(stmt->stmtInit())) {
-		stmtErrFunc = "stmtInit";
-		goto stmt_err;
-	}
-
-	stmt->bind(0, MYSQL_TYPE_LONGLONG, (void *) &pk_user_id,
-		   sizeof(pk_user_id));
-
-	if (!user.username_.size())
-		stmt->bind(1, MYSQL_TYPE_NULL, NULL, 0);
-	else
-		stmt->bind(1, MYSQL_TYPE_STRING,
-			   (void *) user.username_.c_str(),
-			   user.username_.size());
-
-	if (!user.first_name_.size())
-		stmt->bind(2, MYSQL_TYPE_NULL, NULL, 0);
-	else
-		stmt->bind(2, MYSQL_TYPE_STRING,
-			   (void *) user.first_name_.c_str(),
-			   user.first_name_.size());
-
-	if (!user.last_name_.size())
-		stmt->bind(3, MYSQL_TYPE_NULL, NULL, 0);
-	else
-		stmt->bind(3, MYSQL_TYPE_STRING,
-			   (void *) user.last_name_.c_str(),
-			   user.last_name_.size());
-
-	if (!user.phone_number_.size())
-		stmt->bind(4, MYSQL_TYPE_NULL, NULL, 0);
-	else
-		stmt->bind(4, MYSQL_TYPE_STRING,
-			   (void *) user.phone_number_.c_str(),
-			   user.phone_number_.size());
-
-	stmt->bind(5, MYSQL_TYPE_STRING, bn_str(user.is_verified_), 1);
-	stmt->bind(6, MYSQL_TYPE_STRING, bn_str(user.is_support_), 1);
-	stmt->bind(7, MYSQL_TYPE_STRING, bn_str(user.is_scam_), 1);
-
-	if (!userFull.bio_.size())
-		stmt->bind(8, MYSQL_TYPE_NULL, NULL, 0);
-	else
-		stmt->bind(8, MYSQL_TYPE_STRING,
-			   (void *) userFull.bio_.c_str(),
-			   userFull.bio_.size());
-
-	switch (ud->user_->type_->get_id()) {
-	case td_api::userTypeBot::ID:
-		user_type = "bot";
-		user_type_len = sizeof("bot") - 1;
-		break;
-	case td_api::userTypeDeleted::ID:
-		user_type = "deleted";
-		user_type_len = sizeof("deleted") - 1;
-		break;
-	case td_api::userTypeRegular::ID:
-		user_type = "user";
-		user_type_len = sizeof("user") - 1;
-		break;
-	case td_api::userTypeUnknown::ID:
-	default:
-		user_type = "unknown";
-		user_type_len = sizeof("unknown") - 1;
-		break;
-	}
-	stmt->bind(9, MYSQL_TYPE_STRING, (void *) user_type, user_type_len);
-
-	if (unlikely(stmt->bindStmt())) {
-		stmtErrFunc = "bindStmt";
-		goto stmt_err;
-	}
-
-	if (unlikely(stmt->execute())) {
-		stmtErrFunc = "execute";
-		goto stmt_err;
-	}
-
-	pk_id = stmt->getInsertId();
-	goto out;
-
-stmt_err:
-	mysql_handle_stmt_err(stmtErrFunc, stmt);
-	pk_id = 0;
-out:
-	delete stmt;
-	return pk_id;
+	return st.getInsertId();
 }
 
 static uint64_t create_user(mysql::MySQL *db, struct user_data *ud)
 {
 	uint64_t pk_user_id;
-	size_t user_type_len;
-	const char *user_type;
-	const char *stmtErrFunc = nullptr;
-	mysql::MySQLStmt *stmt = nullptr;
 	const td_api::user &user = *ud->user_;
 	const td_api::userFullInfo &userFull = *ud->userFull_;
 
-	stmt = db->prepare(10,
+	mysql::Statement<
 		"INSERT INTO `gt_users` "
 		"("
 			"`tg_user_id`,"
@@ -209,102 +145,37 @@ static uint64_t create_user(mysql::MySQL *db, struct user_data *ud)
 			"?,"		/* type */
 			"NOW(),"	/* created_at */
 			"NULL"		/* updated_at */
-		");"
-	);
-
-	if (MYSQL_IS_ERR_OR_NULL<mysql::MySQLStmt>(stmt)) {
-		mysql_handle_prepare_err(db, stmt);
+		");",
+		int64_t,
+		std::optional<std::string_view>,
+		std::optional<std::string_view>,
+		std::optional<std::string_view>,
+		std::optional<std::string_view>,
+		mysql::enum01,
+		mysql::enum01,
+		mysql::enum01,
+		std::optional<std::string_view>,
+		std::string_view
+	> st(db);
+
+	if (unlikely(st.execute(user.id_,
+				mysql::str_or_null(user.username_),
+				mysql::str_or_null(user.first_name_),
+				mysql::str_or_null(user.last_name_),
+				mysql::str_or_null(user.phone_number_),
+				user.is_verified_,
+				user.is_support_,
+				user.is_scam_,
+				mysql::str_or_null(userFull.bio_),
+				user_type_str(user)))) {
+		mysql_handle_stmt_err(&st);
 		return 0;
 	}
 
-	if (unlikely(stmt->stmtInit())) {
-		stmtErrFunc = "stmtInit";
-		goto stmt_err;
-	}
-
-	stmt->bind(0, MYSQL_TYPE_LONGLONG, (void *) &user.id_, sizeof(user.id_));
-
-	if (!user.username_.size())
-		stmt->bind(1, MYSQL_TYPE_NULL, NULL, 0);
-	else
-		stmt->bind(1, MYSQL_TYPE_STRING,
-			   (void *) user.username_.c_str(),
-			   user.username_.size());
-
-	if (!user.first_name_.size())
-		stmt->bind(2, MYSQL_TYPE_NULL, NULL, 0);
-	else
-		stmt->bind(2, MYSQL_TYPE_STRING,
-			   (void *) user.first_name_.c_str(),
-			   user.first_name_.size());
-
-	if (!user.last_name_.size())
-		stmt->bind(3, MYSQL_TYPE_NULL, NULL, 0);
-	else
-		stmt->bind(3, MYSQL_TYPE_STRING,
-			   (void *) user.last_name_.c_str(),
-			   user.last_name_.size());
-
-	if (!user.phone_number_.size())
-		stmt->bind(4, MYSQL_TYPE_NULL, NULL, 0);
-	else
-		stmt->bind(4, MYSQL_TYPE_STRING,
-			   (void *) user.phone_number_.c_str(),
-			   user.phone_number_.size());
-
-	stmt->bind(5, MYSQL_TYPE_STRING, bn_str(user.is_verified_), 1);
-	stmt->bind(6, MYSQL_TYPE_STRING, bn_str(user.is_support_), 1);
-	stmt->bind(7, MYSQL_TYPE_STRING, bn_str(user.is_scam_), 1);
-
-	if (!userFull.bio_.size())
-		stmt->bind(8, MYSQL_TYPE_NULL, NULL, 0);
-	else
-		stmt->bind(8, MYSQL_TYPE_STRING,
-			   (void *) userFull.bio_.c_str(),
-			   userFull.bio_.size());
-
-	switch (ud->user_->type_->get_id()) {
-	case td_api::userTypeBot::ID:
-		user_type = "bot";
-		user_type_len = sizeof("bot") - 1;
-		break;
-	case td_api::userTypeDeleted::ID:
-		user_type = "deleted";
-		user_type_len = sizeof("deleted") - 1;
-		break;
-	case td_api::userTypeRegular::ID:
-		user_type = "user";
-		user_type_len = sizeof("user") - 1;
-		break;
-	case td_api::userTypeUnknown::ID:
-	default:
-		user_type = "unknown";
-		user_type_len = sizeof("unknown") - 1;
-		break;
-	}
-	stmt->bind(9, MYSQL_TYPE_STRING, (void *) user_type, user_type_len);
-
-	if (unlikely(stmt->bindStmt())) {
-		stmtErrFunc = "bindStmt";
-		goto stmt_err;
-	}
-
-	if (unlikely(stmt->execute())) {
-		stmtErrFunc = "execute";
-		goto stmt_err;
-	}
-
-	pk_user_id = stmt->getInsertId();
+	pk_user_id = st.getInsertId();
 	if (!create_user_history(db, ud, pk_user_id))
 		pk_user_id = 0;
 
-	goto out;
-
-stmt_err:
-	mysql_handle_stmt_err(stmtErrFunc, stmt);
-	pk_user_id = 0;
-out:
-	delete stmt;
 	return pk_user_id;
 }
 
@@ -369,63 +240,35 @@ static uint64_t create_sender_user(mysql::MySQL *db, uint64_t pk_sender_id,
 
 static uint64_t create_sender(mysql::MySQL *db, struct user_data *ud)
 {
-	size_t sender_type_len;
 	uint64_t pk_sender_id = 0;
 	uint64_t pk_user_id = 0;
-	const char *stmtErrFunc = nullptr;
-	const char *sender_type = nullptr;
-	mysql::MySQLStmt *stmt = nullptr;
+	std::string_view sender_type;
+	mysql::Statement<"INSERT INTO `gt_senders` (type) VALUES (?)",
+			 std::string_view> st(db);
 
 	pk_user_id = get_user_pk(db, ud);
 	if (unlikely(!pk_user_id))
 		return 0;
 
-	stmt = db->prepare(1, "INSERT INTO `gt_senders` (type) VALUES (?)");
-
-	if (MYSQL_IS_ERR_OR_NULL<mysql::MySQLStmt>(stmt)) {
-		mysql_handle_prepare_err(db, stmt);
-		return 0;
-	}
-
-	if (unlikely(stmt->stmtInit())) {
-		stmtErrFunc = "stmtInit";
-		goto stmt_err;
-	}
-
 	switch (ud->sender_.get_id()) {
 	case td_api::messageSenderChat::ID:
 		sender_type = "messageSenderChat";
-		sender_type_len = sizeof("messageSenderChat") - 1;
 		break;
 	case td_api::messageSenderUser::ID:
 		sender_type = "messageSenderUser";
-		sender_type_len = sizeof("messageSenderUser") - 1;
 		break;
 	default:
 		pr_err("Invalid chat type on create_chat()");
 		goto out;
 	}
-	stmt->bind(0, MYSQL_TYPE_STRING, (void *) sender_type, sender_type_len);
-
-	if (unlikely(stmt->bindStmt())) {
-		stmtErrFunc = "bindStmt";
-		goto stmt_err;
-	}
 
-	if (unlikely(stmt->execute())) {
-		stmtErrFunc = "execute";
-		goto stmt_err;
+	if (unlikely(st.execute(sender_type))) {
+		mysql_handle_stmt_err(&st);
+		goto out;
 	}
 
-	pk_sender_id = stmt->getInsertId();
-	goto out;
-
-stmt_err:
-	mysql_handle_stmt_err(stmtErrFunc, stmt);
-	pk_sender_id = 0;
+	pk_sender_id = st.getInsertId();
 out:
-	delete stmt;
-
 	if (pk_sender_id) {
 		if (!create_sender_user(db, pk_sender_id, pk_user_id))
 			pk_sender_id = 0;
@@ -455,6 +298,7 @@ static uint64_t create_sender_in_trx(mysql::MySQL *db, struct user_data *cd)
 	}
 
 	/* Creation successful! */
+	cd->kworker_->getSenderPKCache()->set(cd->user_->id_, pk_chat_id);
 	return pk_chat_id;
 
 rollback:
@@ -501,6 +345,7 @@ static uint64_t get_sender_pk(mysql::MySQL *db, struct user_data *ud)
 	}
 
 	pk_chat_id = strtoull(row[0], NULL, 10);
+	ud->kworker_->getSenderPKCache()->set(user.id_, pk_chat_id);
 out:
 	delete res;
 	return pk_chat_id;
@@ -513,31 +358,65 @@ static bool get_user_data(KWorker *kworker, const td_api::MessageSender &sender,
 	const uint32_t timeout = 60;
 	const auto &tmp = static_cast<const td_api::messageSenderUser &>(sender);
 	int64_t user_id = tmp.user_id_;
+	tgvisd::Td::ObjectCache<td_api::user> *u_cache;
+	tgvisd::Td::ObjectCache<td_api::userFullInfo> *uf_cache;
+	std::future<tgvisd::Td::query_result<td_api::user>> u_fut;
+	std::future<tgvisd::Td::query_result<td_api::userFullInfo>> uf_fut;
 
 	td = kworker->getTd();
 	assert(td);
-
-	ud->user_ = td->send_query_sync<td_api::getUser, td_api::user>(
-		td_api::make_object<td_api::getUser>(user_id),
-		timeout
-	);
+	u_cache  = td->getUserCache();
+	uf_cache = td->getUserFullInfoCache();
+
+	/*
+	 * TDLib sends updateUser before a user is ever referenced, so
+	 * the user cache is normally warm. Only go to TDLib for users
+	 * it has never told us about, with both queries in flight at
+	 * once.
+	 */
+	ud->user_ = u_cache->get(user_id);
 	if (unlikely(!ud->user_))
-		return false;
+		u_fut = td->send_query_future<td_api::getUser, td_api::user>(
+			td_api::make_object<td_api::getUser>(user_id)
+		);
 
-	ud->userFull_ = td->send_query_sync<td_api::getUserFullInfo, td_api::userFullInfo>(
-		td_api::make_object<td_api::getUserFullInfo>(user_id),
-		timeout
-	);
+	ud->userFull_ = uf_cache->get(user_id);
 	if (unlikely(!ud->userFull_))
-		return false;
+		uf_fut = td->send_query_future<td_api::getUserFullInfo, td_api::userFullInfo>(
+			td_api::make_object<td_api::getUserFullInfo>(user_id)
+		);
+
+	if (u_fut.valid()) {
+		ud->user_ = u_cache->put(user_id,
+			tgvisd::Td::query_future_get<td_api::user>(u_fut, timeout));
+		if (unlikely(!ud->user_))
+			return false;
+	}
+
+	if (uf_fut.valid()) {
+		ud->userFull_ = uf_cache->put(user_id,
+			tgvisd::Td::query_future_get<td_api::userFullInfo>(uf_fut, timeout));
+		if (unlikely(!ud->userFull_))
+			return false;
+	}
 
 	return true;
 }
 
 uint64_t User::getPK(void)
 {
+	uint64_t pk_sender_id;
 	mysql::MySQL *db;
-	struct user_data ud(sender_);
+	struct user_data ud(kworker_, sender_);
+	const auto &s = static_cast<const td_api::messageSenderUser &>(sender_);
+
+	/*
+	 * Hot path: a known sender costs one hash lookup, no TDLib nor
+	 * SQL round trip.
+	 */
+	pk_sender_id = kworker_->getSenderPKCache()->get(s.user_id_);
+	if (likely(pk_sender_id))
+		return pk_sender_id;
 
 	if (unlikely(!get_user_data(kworker_, sender_, &ud))) {
 		pr_err("Cannot get chat data on getPK");
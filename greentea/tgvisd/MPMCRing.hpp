@@ -0,0 +1,157 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license GPL-2.0-only
+ * @package tgvisd
+ *
+ * Copyright (C) 2022 Ammar Faizi <ammarfaizi2@gmail.com>
+ */
+
+#ifndef TGVISD__MPMCRING_HPP
+#define TGVISD__MPMCRING_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <tgvisd/common.hpp>
+
+
+namespace tgvisd {
+
+
+/*
+ * Bounded lock-free multi-producer multi-consumer ring.
+ *
+ * Every cell carries a sequence number that tells whether it is
+ * ready to be written (seq == pos) or read (seq == pos + 1) by the
+ * producer/consumer that claimed position @pos. Claiming a position
+ * is a single CAS on head_/tail_, so neither side ever sleeps on a
+ * lock and the cost doesn't grow with the number of threads.
+ */
+template <typename T>
+class MPMCRing
+{
+private:
+	struct cell {
+		std::atomic<size_t>	seq;
+		T			data;
+	};
+
+	struct cell			*cells_ = nullptr;
+	size_t				mask_   = 0;
+
+	alignas(64) std::atomic<size_t>	head_ = 0;
+	alignas(64) std::atomic<size_t>	tail_ = 0;
+
+public:
+	inline MPMCRing(size_t min_size)
+	{
+		size_t size = 2, i;
+
+		while (size < min_size)
+			size <<= 1;
+
+		cells_ = new struct cell[size];
+		mask_  = size - 1;
+		for (i = 0; i < size; i++)
+			cells_[i].seq.store(i, std::memory_order_relaxed);
+	}
+
+
+	inline ~MPMCRing(void)
+	{
+		delete[] cells_;
+	}
+
+
+	MPMCRing(const MPMCRing &) = delete;
+	MPMCRing &operator=(const MPMCRing &) = delete;
+
+
+	/*
+	 * Returns false if the ring is full.
+	 */
+	__hot inline bool push(const T &val)
+	{
+		struct cell *c;
+		size_t pos, seq;
+		intptr_t dif;
+
+		pos = head_.load(std::memory_order_relaxed);
+		while (1) {
+			c   = &cells_[pos & mask_];
+			seq = c->seq.load(std::memory_order_acquire);
+			dif = (intptr_t)seq - (intptr_t)pos;
+
+			if (likely(!dif)) {
+				if (head_.compare_exchange_weak(pos, pos + 1,
+						std::memory_order_relaxed))
+					break;
+			} else if (dif < 0) {
+				return false;
+			} else {
+				pos = head_.load(std::memory_order_relaxed);
+			}
+		}
+
+		c->data = val;
+		c->seq.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+
+	/*
+	 * Returns false if the ring is empty.
+	 */
+	__hot inline bool pop(T *val)
+	{
+		struct cell *c;
+		size_t pos, seq;
+		intptr_t dif;
+
+		pos = tail_.load(std::memory_order_relaxed);
+		while (1) {
+			c   = &cells_[pos & mask_];
+			seq = c->seq.load(std::memory_order_acquire);
+			dif = (intptr_t)seq - (intptr_t)(pos + 1);
+
+			if (likely(!dif)) {
+				if (tail_.compare_exchange_weak(pos, pos + 1,
+						std::memory_order_relaxed))
+					break;
+			} else if (dif < 0) {
+				return false;
+			} else {
+				pos = tail_.load(std::memory_order_relaxed);
+			}
+		}
+
+		*val = c->data;
+		c->seq.store(pos + mask_ + 1, std::memory_order_release);
+		return true;
+	}
+
+
+	/*
+	 * Only a snapshot, it may be stale by the time it returns.
+	 */
+	inline size_t size(void)
+	{
+		size_t head, tail;
+
+		tail = tail_.load(std::memory_order_seq_cst);
+		head = head_.load(std::memory_order_seq_cst);
+		return head > tail ? head - tail : 0;
+	}
+
+
+	inline size_t capacity(void)
+	{
+		return mask_ + 1;
+	}
+};
+
+
+} /* namespace tgvisd */
+
+#endif /* #ifndef TGVISD__MPMCRING_HPP */
@@ -11,7 +11,7 @@
 #include <tgvisd/Main.hpp>
 #include <tgvisd/KWorker.hpp>
 #include <tgvisd/Scraper.hpp>
-#include <tgvisd/Logger/Message.hpp>
+#include <tgvisd/IngestQueue.hpp>
 
 #if defined(__linux__)
 	#include <signal.h>
@@ -31,6 +31,7 @@ __cold Main::Main(uint32_t api_id, const char *api_hash, const char *data_path):
 
 	kworker_ = new KWorker(this);
 	scraper_ = new Scraper(this);
+	ingest_  = new IngestQueue(this, kworker_);
 
 	pr_notice("Spawning kworker thread...");
 	kworkerThread_ = new std::thread([this]{
@@ -44,15 +45,14 @@ __cold Main::Main(uint32_t api_id, const char *api_hash, const char *data_path):
 	});
 	Scraper::setThreadName(scraperThread_);
 
+	pr_notice("Spawning ingest thread...");
+	ingestThread_ = new std::thread([this]{
+		this->ingest_->run();
+	});
+	IngestQueue::setThreadName(ingestThread_);
+
 	td_.callback.updateNewMessage = [this](td_api::updateNewMessage &u){
-		std::cout << "Get a new message" << std::endl;
-		std::thread tr([this, u = std::move(u)](){
-			tgvisd::Logger::Message *msg;
-			msg = new tgvisd::Logger::Message(kworker_, *u.message_);
-			msg->save();
-			delete msg;
-		});
-		tr.detach();
+		this->ingest_->push(std::move(u.message_));
 	};
 }
 
@@ -61,6 +61,20 @@ __cold Main::~Main(void)
 {
 	td_.setCancelDelayedWork(true);
 
+	/*
+	 * td_.close() below still runs the Td loop, make sure it won't
+	 * call into the ingest queue we are about to free.
+	 */
+	td_.callback.updateNewMessage = nullptr;
+
+	if (ingest_) {
+		ingest_->stop();
+		pr_notice("Waiting for ingest thread to exit...");
+		ingestThread_->join();
+		delete ingestThread_;
+		delete ingest_;
+	}
+
 	if (kworker_)
 		kworker_->stop();
 
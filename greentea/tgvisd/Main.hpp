@@ -22,6 +22,8 @@ class Scraper;
 
 class KWorker;
 
+class IngestQueue;
+
 
 class Main
 {
@@ -30,8 +32,10 @@ private:
 	volatile bool	isReady_ = false;
 	std::thread	*kworkerThread_ = nullptr;
 	std::thread	*scraperThread_ = nullptr;
+	std::thread	*ingestThread_ = nullptr;
 	KWorker		*kworker_ = nullptr;
 	Scraper		*scraper_ = nullptr;
+	IngestQueue	*ingest_ = nullptr;
 
 public:
 	Main(uint32_t api_id, const char *api_hash, const char *data_path);
@@ -45,6 +49,12 @@ public:
 	}
 
 
+	inline IngestQueue *getIngestQueue(void)
+	{
+		return ingest_;
+	}
+
+
 	inline void doStop(void)
 	{
 		stopEventLoop = true;
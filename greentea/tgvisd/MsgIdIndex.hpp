@@ -0,0 +1,315 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license GPL-2.0-only
+ * @package tgvisd
+ *
+ * Copyright (C) 2022 Ammar Faizi <ammarfaizi2@gmail.com>
+ */
+
+#ifndef TGVISD__MSGIDINDEX_HPP
+#define TGVISD__MSGIDINDEX_HPP
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <functional>
+#include <shared_mutex>
+#include <unordered_map>
+#include <tgvisd/common.hpp>
+
+
+namespace tgvisd {
+
+
+/*
+ * Set of message ids, Roaring style: ids are grouped by their upper
+ * bits into chunks of 65536, a chunk is a sorted array of the low 16
+ * bits while it is sparse and a plain bitmap (8K) once it isn't.
+ * Message ids within a chat are dense, so most chunks end up as
+ * bitmaps, about one bit per id.
+ *
+ * Exact, unlike a Bloom filter: contains() never says yes for an id
+ * that hasn't been added. Not thread safe, see MsgIdIndex.
+ */
+class MsgIdSet
+{
+private:
+	static constexpr uint32_t ARR_MAX   = 4096;
+	static constexpr uint32_t BMP_WORDS = 65536 / 64;
+
+	struct chunk {
+		std::vector<uint16_t>		arr;
+		std::unique_ptr<uint64_t[]>	bmp;
+	};
+
+	std::unordered_map<uint64_t, struct chunk>	chunks_;
+	size_t						size_ = 0;
+
+
+	static inline void toBitmap(struct chunk *c)
+	{
+		c->bmp.reset(new uint64_t[BMP_WORDS]);
+		memset(c->bmp.get(), 0, BMP_WORDS * sizeof(uint64_t));
+		for (uint16_t lo: c->arr)
+			c->bmp[lo >> 6u] |= 1ull << (lo & 63u);
+
+		std::vector<uint16_t>().swap(c->arr);
+	}
+
+public:
+	__hot inline bool contains(uint64_t id) const
+	{
+		uint16_t lo = (uint16_t) id;
+
+		const auto &it = chunks_.find(id >> 16u);
+		if (it == chunks_.end())
+			return false;
+
+		const struct chunk &c = it->second;
+		if (c.bmp)
+			return !!(c.bmp[lo >> 6u] & (1ull << (lo & 63u)));
+
+		return std::binary_search(c.arr.begin(), c.arr.end(), lo);
+	}
+
+
+	/*
+	 * Returns true if @id wasn't in the set yet.
+	 */
+	inline bool add(uint64_t id)
+	{
+		uint16_t lo = (uint16_t) id;
+		struct chunk &c = chunks_[id >> 16u];
+
+		if (c.bmp) {
+			uint64_t &w = c.bmp[lo >> 6u];
+			uint64_t bit = 1ull << (lo & 63u);
+
+			if (w & bit)
+				return false;
+			w |= bit;
+		} else {
+			auto it = std::lower_bound(c.arr.begin(), c.arr.end(), lo);
+
+			if (it != c.arr.end() && *it == lo)
+				return false;
+			c.arr.insert(it, lo);
+			if (c.arr.size() > ARR_MAX)
+				toBitmap(&c);
+		}
+
+		size_++;
+		return true;
+	}
+
+
+	inline size_t size(void) const
+	{
+		return size_;
+	}
+
+
+	/*
+	 * Call @fn(lo, hi) for every run of consecutive ids, in
+	 * ascending order.
+	 */
+	template <typename F>
+	inline void forEachRun(F fn) const
+	{
+		std::vector<uint64_t> keys;
+		uint64_t lo = 0, hi = 0;
+		bool open = false;
+
+		auto push = [&](uint64_t id) {
+			if (open && id == hi + 1) {
+				hi = id;
+				return;
+			}
+
+			if (open)
+				fn(lo, hi);
+
+			lo = hi = id;
+			open = true;
+		};
+
+		keys.reserve(chunks_.size());
+		for (const auto &it: chunks_)
+			keys.push_back(it.first);
+		std::sort(keys.begin(), keys.end());
+
+		for (uint64_t k: keys) {
+			const struct chunk &c = chunks_.at(k);
+			uint64_t base = k << 16u;
+			uint32_t w;
+
+			if (!c.bmp) {
+				for (uint16_t v: c.arr)
+					push(base | v);
+				continue;
+			}
+
+			for (w = 0; w < BMP_WORDS; w++) {
+				uint64_t bits = c.bmp[w];
+
+				while (bits) {
+					push(base | (w * 64u + (uint32_t) __builtin_ctzll(bits)));
+					bits &= bits - 1;
+				}
+			}
+		}
+
+		if (open)
+			fn(lo, hi);
+	}
+
+
+	inline size_t memUsage(void) const
+	{
+		size_t ret = 0;
+
+		for (const auto &it: chunks_) {
+			if (it.second.bmp)
+				ret += BMP_WORDS * sizeof(uint64_t);
+			else
+				ret += it.second.arr.capacity() * sizeof(uint16_t);
+		}
+		return ret;
+	}
+};
+
+
+/*
+ * tg_chat_id -> the tg_msg_ids already stored in gt_messages.
+ *
+ * Only filled from the database and after a successful commit, so a
+ * hit means the message is there for sure and the caller can drop it
+ * before doing any work. A miss means nothing, the message goes down
+ * the normal path and the unique key has the last word. Sharded like
+ * IdentityCache.
+ */
+template <uint32_t NR_SHARDS = 16>
+class MsgIdIndex
+{
+	static_assert(NR_SHARDS && !(NR_SHARDS & (NR_SHARDS - 1)),
+		      "NR_SHARDS must be a power of 2");
+
+private:
+	struct shard {
+		std::shared_mutex			lock;
+		std::unordered_map<int64_t, MsgIdSet>	map;
+	} __attribute__((__aligned__(64)));
+
+	struct shard			shards_[NR_SHARDS];
+	std::atomic<uint64_t>		nrHit_  = 0;
+	std::atomic<uint64_t>		nrMiss_ = 0;
+
+
+	inline struct shard *getShard(int64_t tg_chat_id)
+	{
+		size_t h;
+
+		if (NR_SHARDS == 1)
+			return &shards_[0];
+
+		h = std::hash<int64_t>{}(tg_chat_id) * 0x9e3779b97f4a7c15ull;
+		return &shards_[(h >> 32) & (NR_SHARDS - 1)];
+	}
+
+public:
+	__hot inline bool contains(int64_t tg_chat_id, uint64_t tg_msg_id)
+	{
+		bool ret = false;
+		struct shard *s = getShard(tg_chat_id);
+
+		s->lock.lock_shared();
+		const auto &it = s->map.find(tg_chat_id);
+		if (it != s->map.end())
+			ret = it->second.contains(tg_msg_id);
+		s->lock.unlock_shared();
+
+		if (ret)
+			nrHit_.fetch_add(1, std::memory_order_relaxed);
+		else
+			nrMiss_.fetch_add(1, std::memory_order_relaxed);
+
+		return ret;
+	}
+
+
+	inline void add(int64_t tg_chat_id, uint64_t tg_msg_id)
+	{
+		struct shard *s = getShard(tg_chat_id);
+
+		s->lock.lock();
+		s->map[tg_chat_id].add(tg_msg_id);
+		s->lock.unlock();
+	}
+
+
+	template <typename F>
+	inline void forEachRun(int64_t tg_chat_id, F fn)
+	{
+		struct shard *s = getShard(tg_chat_id);
+
+		s->lock.lock_shared();
+		const auto &it = s->map.find(tg_chat_id);
+		if (it != s->map.end())
+			it->second.forEachRun(fn);
+		s->lock.unlock_shared();
+	}
+
+
+	/*
+	 * Number of ids in the index.
+	 */
+	inline size_t size(void)
+	{
+		size_t ret = 0;
+		uint32_t i;
+
+		for (i = 0; i < NR_SHARDS; i++) {
+			shards_[i].lock.lock_shared();
+			for (const auto &it: shards_[i].map)
+				ret += it.second.size();
+			shards_[i].lock.unlock_shared();
+		}
+		return ret;
+	}
+
+
+	inline size_t memUsage(void)
+	{
+		size_t ret = 0;
+		uint32_t i;
+
+		for (i = 0; i < NR_SHARDS; i++) {
+			shards_[i].lock.lock_shared();
+			for (const auto &it: shards_[i].map)
+				ret += it.second.memUsage();
+			shards_[i].lock.unlock_shared();
+		}
+		return ret;
+	}
+
+
+	inline uint64_t getNrHit(void)
+	{
+		return nrHit_.load(std::memory_order_relaxed);
+	}
+
+
+	inline uint64_t getNrMiss(void)
+	{
+		return nrMiss_.load(std::memory_order_relaxed);
+	}
+};
+
+
+} /* namespace tgvisd */
+
+#endif /* #ifndef TGVISD__MSGIDINDEX_HPP */
@@ -0,0 +1,418 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license GPL-2.0-only
+ * @package tgvisd
+ *
+ * Copyright (C) 2022 Ammar Faizi <ammarfaizi2@gmail.com>
+ */
+
+#include <cerrno>
+#include <cstring>
+#include <optional>
+#include <mysql/mysqld_error.h>
+#include <tgvisd/ScrapeState.hpp>
+#include <tgvisd/mysql_helpers.hpp>
+
+
+namespace tgvisd {
+
+
+void ScrapeState::mergeLocked(struct entry *e, const struct scrape_cursor &cur)
+{
+	struct scrape_cursor *c = &e->cur;
+
+	if (cur.oldest && (!c->oldest || cur.oldest < c->oldest)) {
+		c->oldest = cur.oldest;
+		e->dirty = true;
+	}
+
+	if (cur.newest > c->newest) {
+		c->newest = cur.newest;
+		e->dirty = true;
+	}
+
+	if (cur.backfill_done && !c->backfill_done) {
+		c->backfill_done = true;
+		e->dirty = true;
+	}
+}
+
+
+__cold int ScrapeState::load(mysql::MySQL *db)
+	__acquires(&lock_)
+	__releases(&lock_)
+{
+	mysql::Select<
+		"SELECT `tg_chat_id`, `oldest_tg_msg_id`, `newest_tg_msg_id`, "
+		"`backfill_done`, `covered_ranges` FROM `gt_scrape_state`",
+		mysql::columns<
+			int64_t,
+			uint64_t,
+			uint64_t,
+			std::string_view,
+			std::optional<std::string_view>
+		>
+	> st(db);
+	std::optional<std::string_view> ranges;
+	struct scrape_cursor cur;
+	std::string_view done;
+	int64_t tg_chat_id;
+	int ret;
+
+	if (unlikely(st.execute())) {
+		if (st.getErrno() == ER_NO_SUCH_TABLE) {
+			pr_err("gt_scrape_state is missing, apply "
+			       "migrations/0003_gt_scrape_state.sql. Scrape "
+			       "cursors won't survive a restart");
+			noTable_ = true;
+		} else if (st.getErrno() == ER_BAD_FIELD_ERROR) {
+			pr_err("gt_scrape_state.covered_ranges is missing, "
+			       "apply migrations/0004_gt_scrape_coverage.sql. "
+			       "Scrape cursors won't survive a restart");
+			noTable_ = true;
+		} else {
+			mysql_handle_stmt_err(&st);
+		}
+		return -EIO;
+	}
+
+	while (!(ret = st.next(tg_chat_id, cur.oldest, cur.newest, done,
+			       ranges))) {
+		cur.backfill_done = (done == "1");
+
+		lock_.lock();
+		auto it = map_.find(tg_chat_id);
+		if (it == map_.end()) {
+			it = map_.emplace(tg_chat_id, entry{cur, {}, false,
+							    false}).first;
+		} else {
+			/*
+			 * Seeded while we were loading, whatever the row
+			 * adds on top of that still has to be written.
+			 */
+			mergeLocked(&it->second, cur);
+		}
+
+		if (ranges) {
+			if (unlikely(!it->second.covered.parse(*ranges)))
+				pr_err("Malformed covered_ranges of chat %ld, "
+				       "rescanning the rest", tg_chat_id);
+			it->second.seeded = true;
+		}
+		lock_.unlock();
+	}
+
+	if (unlikely(ret < 0)) {
+		mysql_handle_stmt_err(&st);
+		return ret;
+	}
+
+	return 0;
+}
+
+
+bool ScrapeState::get(int64_t tg_chat_id, struct scrape_cursor *cur)
+	__acquires(&lock_)
+	__releases(&lock_)
+{
+	bool ret = false;
+
+	lock_.lock();
+	const auto &it = map_.find(tg_chat_id);
+	if (it != map_.end()) {
+		*cur = it->second.cur;
+		ret = true;
+	}
+	lock_.unlock();
+	return ret;
+}
+
+
+void ScrapeState::merge(int64_t tg_chat_id, const struct scrape_cursor &cur)
+	__acquires(&lock_)
+	__releases(&lock_)
+{
+	lock_.lock();
+	auto it = map_.find(tg_chat_id);
+	if (it == map_.end())
+		map_.emplace(tg_chat_id, entry{cur, {}, false, true});
+	else
+		mergeLocked(&it->second, cur);
+	lock_.unlock();
+}
+
+
+__hot void ScrapeState::note(int64_t tg_chat_id, uint64_t tg_msg_id)
+	__acquires(&lock_)
+	__releases(&lock_)
+{
+	struct scrape_cursor cur = {tg_msg_id, tg_msg_id, false};
+
+	lock_.lock();
+	auto it = map_.find(tg_chat_id);
+	if (it != map_.end())
+		mergeLocked(&it->second, cur);
+	lock_.unlock();
+}
+
+
+void ScrapeState::setBackfillDone(int64_t tg_chat_id)
+	__acquires(&lock_)
+	__releases(&lock_)
+{
+	lock_.lock();
+	auto it = map_.find(tg_chat_id);
+	if (it != map_.end() && !it->second.cur.backfill_done) {
+		it->second.cur.backfill_done = true;
+		it->second.dirty = true;
+	}
+	lock_.unlock();
+}
+
+
+void ScrapeState::cover(int64_t tg_chat_id, uint64_t lo, uint64_t hi)
+	__acquires(&lock_)
+	__releases(&lock_)
+{
+	struct scrape_cursor cur = {lo, hi, false};
+
+	if (unlikely(!lo || lo > hi))
+		return;
+
+	lock_.lock();
+	auto it = map_.find(tg_chat_id);
+	if (it == map_.end())
+		it = map_.emplace(tg_chat_id, entry{cur, {}, false, true}).first;
+	else
+		mergeLocked(&it->second, cur);
+
+	it->second.covered.add(lo, hi);
+	it->second.dirty = true;
+	lock_.unlock();
+}
+
+
+bool ScrapeState::isSeeded(int64_t tg_chat_id)
+	__acquires(&lock_)
+	__releases(&lock_)
+{
+	bool ret = false;
+
+	lock_.lock();
+	const auto &it = map_.find(tg_chat_id);
+	if (it != map_.end())
+		ret = it->second.seeded;
+	lock_.unlock();
+	return ret;
+}
+
+
+void ScrapeState::seedCoverage(int64_t tg_chat_id, const IntervalSet &covered)
+	__acquires(&lock_)
+	__releases(&lock_)
+{
+	struct scrape_cursor cur = {covered.min(), covered.max(), false};
+
+	lock_.lock();
+	auto it = map_.find(tg_chat_id);
+	if (it == map_.end())
+		it = map_.emplace(tg_chat_id, entry{cur, {}, false, true}).first;
+	else
+		mergeLocked(&it->second, cur);
+
+	covered.forEach([&](uint64_t lo, uint64_t hi) {
+		it->second.covered.add(lo, hi);
+	});
+	it->second.seeded = true;
+	it->second.dirty = true;
+	lock_.unlock();
+}
+
+
+enum scrape_gap ScrapeState::nextGap(int64_t tg_chat_id, uint64_t *from)
+	__acquires(&lock_)
+	__releases(&lock_)
+{
+	enum scrape_gap ret = SCRAPE_GAP_NONE;
+	uint64_t lo, hi;
+
+	lock_.lock();
+	const auto &it = map_.find(tg_chat_id);
+	if (it == map_.end() || !it->second.seeded)
+		goto out;
+
+	if (it->second.covered.highestGap(&lo, &hi)) {
+		*from = hi + 1;
+		ret = SCRAPE_GAP_HOLE;
+	} else if (!it->second.cur.backfill_done && !it->second.covered.empty()) {
+		*from = it->second.covered.min();
+		ret = SCRAPE_GAP_BACKFILL;
+	}
+
+out:
+	lock_.unlock();
+	return ret;
+}
+
+
+size_t ScrapeState::nextGaps(int64_t tg_chat_id, uint64_t *from, size_t n)
+	__acquires(&lock_)
+	__releases(&lock_)
+{
+	size_t ret = 0;
+
+	if (unlikely(!n))
+		return 0;
+
+	lock_.lock();
+	const auto &it = map_.find(tg_chat_id);
+	if (it == map_.end() || !it->second.seeded)
+		goto out;
+
+	it->second.covered.forEachGapDesc([&](uint64_t lo, uint64_t hi) {
+		from[ret++] = hi + 1;
+		return ret < n;
+	});
+
+	if (ret < n && !it->second.cur.backfill_done &&
+	    !it->second.covered.empty())
+		from[ret++] = it->second.covered.min();
+
+out:
+	lock_.unlock();
+	return ret;
+}
+
+
+bool ScrapeState::isCovered(int64_t tg_chat_id, uint64_t tg_msg_id)
+	__acquires(&lock_)
+	__releases(&lock_)
+{
+	bool ret = false;
+
+	lock_.lock();
+	const auto &it = map_.find(tg_chat_id);
+	if (it != map_.end())
+		ret = it->second.covered.contains(tg_msg_id);
+	lock_.unlock();
+	return ret;
+}
+
+
+uint64_t ScrapeState::coveredMin(int64_t tg_chat_id)
+	__acquires(&lock_)
+	__releases(&lock_)
+{
+	uint64_t ret = 0;
+
+	lock_.lock();
+	const auto &it = map_.find(tg_chat_id);
+	if (it != map_.end())
+		ret = it->second.covered.min();
+	lock_.unlock();
+	return ret;
+}
+
+
+void ScrapeState::getProgress(int64_t tg_chat_id, struct scrape_progress *p)
+	__acquires(&lock_)
+	__releases(&lock_)
+{
+	memset(p, 0, sizeof(*p));
+
+	lock_.lock();
+	const auto &it = map_.find(tg_chat_id);
+	if (it != map_.end()) {
+		const struct entry &e = it->second;
+
+		p->oldest = e.cur.oldest;
+		p->newest = e.cur.newest;
+		p->nr_ranges = e.covered.nrRanges();
+		p->nr_missing = e.covered.nrMissing();
+		p->seeded = e.seeded;
+		p->backfill_done = e.cur.backfill_done;
+	}
+	lock_.unlock();
+}
+
+
+int ScrapeState::save(mysql::MySQL *db, int64_t tg_chat_id)
+	__acquires(&lock_)
+	__releases(&lock_)
+{
+	std::optional<std::string> ranges;
+	struct scrape_cursor cur;
+
+	mysql::Statement<
+		"INSERT INTO `gt_scrape_state` "
+		"("
+			"`tg_chat_id`,"
+			"`oldest_tg_msg_id`,"
+			"`newest_tg_msg_id`,"
+			"`backfill_done`,"
+			"`covered_ranges`,"
+			"`updated_at`"
+		")"
+			" VALUES "
+		"("
+			"?,"
+			"?,"
+			"?,"
+			"?,"
+			"?,"
+			"NOW()"
+		") "
+		"ON DUPLICATE KEY UPDATE "
+			"`oldest_tg_msg_id` = LEAST(`oldest_tg_msg_id`, VALUES(`oldest_tg_msg_id`)),"
+			"`newest_tg_msg_id` = GREATEST(`newest_tg_msg_id`, VALUES(`newest_tg_msg_id`)),"
+			"`backfill_done` = IF(VALUES(`backfill_done`) = '1', '1', `backfill_done`),"
+			"`covered_ranges` = IFNULL(VALUES(`covered_ranges`), `covered_ranges`),"
+			"`updated_at` = NOW();",
+		int64_t,				/* tg_chat_id */
+		uint64_t,				/* oldest_tg_msg_id */
+		uint64_t,				/* newest_tg_msg_id */
+		mysql::enum01,				/* backfill_done */
+		std::optional<std::string_view>		/* covered_ranges */
+	> st(db);
+
+	if (noTable_)
+		return 0;
+
+	lock_.lock();
+	auto it = map_.find(tg_chat_id);
+
+	/* Nothing stored yet, nothing to resume from. */
+	if (it == map_.end() || !it->second.dirty || !it->second.cur.oldest) {
+		lock_.unlock();
+		return 0;
+	}
+	cur = it->second.cur;
+
+	/*
+	 * Unseeded coverage is only what this run has scraped so far,
+	 * don't let it replace the ranges in the row.
+	 */
+	if (it->second.seeded)
+		ranges = it->second.covered.toString();
+	it->second.dirty = false;
+	lock_.unlock();
+
+	if (unlikely(st.execute(tg_chat_id, cur.oldest, cur.newest,
+				cur.backfill_done,
+				ranges ? std::optional<std::string_view>(*ranges)
+				       : std::nullopt))) {
+		mysql_handle_stmt_err(&st);
+
+		/* Try again with the next page. */
+		lock_.lock();
+		map_[tg_chat_id].dirty = true;
+		lock_.unlock();
+		return -EIO;
+	}
+
+	return 0;
+}
+
+
+} /* namespace tgvisd */
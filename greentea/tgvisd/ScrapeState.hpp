@@ -0,0 +1,162 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license GPL-2.0-only
+ * @package tgvisd
+ *
+ * Copyright (C) 2022 Ammar Faizi <ammarfaizi2@gmail.com>
+ */
+
+#ifndef TGVISD__SCRAPESTATE_HPP
+#define TGVISD__SCRAPESTATE_HPP
+
+#include <mutex>
+#include <cstdint>
+#include <unordered_map>
+#include <mysql/MySQL.hpp>
+#include <tgvisd/common.hpp>
+#include <tgvisd/IntervalSet.hpp>
+
+
+namespace tgvisd {
+
+
+struct scrape_cursor {
+	/* Oldest and newest stored tg_msg_id, 0 if there is none. */
+	uint64_t	oldest;
+	uint64_t	newest;
+
+	/* Scraped all the way back to the first message of the chat. */
+	bool		backfill_done;
+};
+
+
+struct scrape_progress {
+	uint64_t	oldest;
+	uint64_t	newest;
+	size_t		nr_ranges;
+	uint64_t	nr_missing;
+	bool		seeded;
+	bool		backfill_done;
+};
+
+
+enum scrape_gap {
+	SCRAPE_GAP_NONE,
+
+	/* A hole between two covered ranges. */
+	SCRAPE_GAP_HOLE,
+
+	/* Everything older than the oldest covered message. */
+	SCRAPE_GAP_BACKFILL,
+};
+
+
+/*
+ * Where to resume scraping each chat, gt_scrape_state plus an in
+ * memory copy of it.
+ *
+ * The copy is what the scraper reads, it is widened by note() as
+ * messages are committed and written back with save() once per
+ * scraped page. Rows are only ever widened (LEAST/GREATEST), so a
+ * stale save can't move a cursor backwards.
+ *
+ * Each chat also has the set of tg_msg_id ranges known to be
+ * complete: every message in them has been fetched from Telegram
+ * and stored (ids in between belong to deleted messages). Whatever
+ * isn't covered is a gap the scraper still has to fetch. Until the
+ * coverage of a chat has been seeded, from gt_scrape_state or from
+ * the message id index, gaps aren't reported.
+ */
+class ScrapeState
+{
+private:
+	struct entry {
+		struct scrape_cursor	cur;
+		IntervalSet		covered;
+		bool			seeded;
+		bool			dirty;
+	};
+
+	std::mutex					lock_;
+	std::unordered_map<int64_t, struct entry>	map_;
+
+	/* gt_scrape_state is missing, keep the state in memory only. */
+	volatile bool					noTable_ = false;
+
+	void mergeLocked(struct entry *e, const struct scrape_cursor &cur);
+
+public:
+	/*
+	 * Load every row of gt_scrape_state, merged into what is
+	 * already in memory. Returns 0 or a negative error code.
+	 */
+	int load(mysql::MySQL *db);
+
+	/*
+	 * Returns false if nothing is known about @tg_chat_id yet.
+	 */
+	bool get(int64_t tg_chat_id, struct scrape_cursor *cur);
+
+	/*
+	 * Widen the cursor of @tg_chat_id with @cur, creating it if it
+	 * doesn't exist.
+	 */
+	void merge(int64_t tg_chat_id, const struct scrape_cursor &cur);
+
+	/*
+	 * @tg_msg_id of @tg_chat_id has been committed. Chats we don't
+	 * have a cursor for yet are left alone, their cursor is seeded
+	 * from the database.
+	 */
+	void note(int64_t tg_chat_id, uint64_t tg_msg_id);
+
+	void setBackfillDone(int64_t tg_chat_id);
+
+	/*
+	 * Every message of @tg_chat_id in [lo, hi] has been fetched and
+	 * stored.
+	 */
+	void cover(int64_t tg_chat_id, uint64_t lo, uint64_t hi);
+
+	bool isSeeded(int64_t tg_chat_id);
+
+	/*
+	 * Add @covered (e.g. runs of stored ids) to the coverage of
+	 * @tg_chat_id and start reporting its gaps.
+	 */
+	void seedCoverage(int64_t tg_chat_id, const IntervalSet &covered);
+
+	/*
+	 * The next range to fetch, newest hole first, then the backfill.
+	 * *from is the covered message right above it, fetching history
+	 * from there down proves the page contiguous with what we have.
+	 */
+	enum scrape_gap nextGap(int64_t tg_chat_id, uint64_t *from);
+
+	/*
+	 * Up to @n of the ranges nextGap() would return one after the
+	 * other, as their *from. Returns how many were written.
+	 */
+	size_t nextGaps(int64_t tg_chat_id, uint64_t *from, size_t n);
+
+	bool isCovered(int64_t tg_chat_id, uint64_t tg_msg_id);
+
+	/*
+	 * The oldest covered tg_msg_id, 0 if there is none.
+	 */
+	uint64_t coveredMin(int64_t tg_chat_id);
+
+	void getProgress(int64_t tg_chat_id, struct scrape_progress *p);
+
+	/*
+	 * Write the cursor of @tg_chat_id back if it changed. Returns 0
+	 * or a negative error code.
+	 */
+	int save(mysql::MySQL *db, int64_t tg_chat_id);
+};
+
+
+} /* namespace tgvisd */
+
+#endif /* #ifndef TGVISD__SCRAPESTATE_HPP */
@@ -20,181 +20,457 @@
 #include <cstring>
 #include <cassert>
 #include <cstdlib>
+#include <vector>
+#include <future>
 #include <cinttypes>
+#include <algorithm>
 #include <tgvisd/Td/Td.hpp>
 #include <tgvisd/common.hpp>
 #include <tgvisd/KWorker.hpp>
 #include <tgvisd/Scraper.hpp>
-#include <tgvisd/Logger/Message.hpp>
+#include <tgvisd/Logger/MessageBatch.hpp>
 
 
 namespace tgvisd {
 
-using LogMessage = tgvisd::Logger::Message;
+using LogMessageBatch = tgvisd::Logger::MessageBatch;
+
+static int64_t env_ms(const char *name, int64_t def)
+{
+	const char *tmp;
+
+	tmp = getenv(name);
+	if (tmp)
+		return (int64_t)strtoull(tmp, NULL, 10);
+
+	return def;
+}
 
 __cold Scraper::Scraper(Main *main):
 	main_(main),
-	kworker_(main->getKWorker())
+	kworker_(main->getKWorker()),
+	sched_(env_ms("TGVISD_SCRAPE_MIN_INTERVAL_MS", 1000),
+	       env_ms("TGVISD_SCRAPE_MAX_INTERVAL_MS", 600000))
 {
+	const char *tmp;
+
+	tmp = getenv("TGVISD_SCRAPE_GAP_PAGES");
+	if (tmp)
+		maxGapPages_ = (uint32_t)strtoul(tmp, NULL, 10);
+
+	tmp = getenv("TGVISD_SCRAPE_PREFETCH");
+	if (tmp)
+		prefetchDepth_ = (uint32_t)strtoul(tmp, NULL, 10);
+
+	tmp = getenv("TGVISD_SCRAPE_LOCAL_PAGES");
+	if (tmp)
+		maxLocalPages_ = (uint32_t)strtoul(tmp, NULL, 10);
+
+	tmp = getenv("TGVISD_SCRAPE_MAX_VISITS");
+	if (tmp)
+		maxVisits_ = (uint32_t)strtoul(tmp, NULL, 10);
+	if (unlikely(!maxVisits_))
+		maxVisits_ = 1;
+}
+
+static inline int64_t scraper_now_ms(void)
+{
+	using namespace std::chrono;
+
+	return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
 }
 
 __hot void Scraper::run(void)
 {
+	int64_t now_ms;
+
 	while (!main_->isReady()) {
 		if (shouldStop())
 			return;
 		sleep(1);
 	}
 
-	while (1) {
-		if (runFastPhase())
-			break;
-		if (runSlowPhase())
-			break;
+	while (!shouldStop()) {
+		now_ms = scraper_now_ms();
+		if (now_ms >= nextChatListMs_)
+			refreshChats(now_ms);
+
+		reapVisits(now_ms);
+		dispatchVisits(now_ms);
+		std::this_thread::sleep_for(100ms);
 	}
 }
 
+static void log_td_rate_stats(tgvisd::Td::RateGovernor *gov)
+{
+	struct tgvisd::Td::td_rate_stats st;
+	int i;
+
+	for (i = 0; i < tgvisd::Td::NR_TD_RATE_CLASSES; i++) {
+		gov->getStats(i, &st);
+		pr_notice("TDLib %s requests: %.2f/s, %" PRIu64 " sent, %" PRIu64
+			  " delayed (%" PRIu64 " ms total, %" PRIu64 " ms max), "
+			  "%zu queued, %" PRIu64 " flood wait(s)%s",
+			  tgvisd::Td::RateGovernor::className(i), st.rate,
+			  st.nr_sent, st.nr_delayed, st.total_wait_ms,
+			  st.max_wait_ms, st.nr_queued, st.nr_flood,
+			  st.blocked_ms ? ", blocked" : "");
+	}
+}
+
+static void log_db_pool_stats(KWorker *kworker)
+{
+	struct dbpool_stats st;
+	uint64_t avg_us = 0;
+
+	kworker->getDbPoolStats(&st);
+	if (st.nr_waited)
+		avg_us = st.wait_ns_total / st.nr_waited / 1000;
+
+	pr_notice("DB pool: %u/%u connection(s) (min %u), %" PRIu64
+		  " acquired, %" PRIu64 " waited (%" PRIu64 " us avg, %" PRIu64
+		  " us max), %" PRIu64 " timeout(s), %" PRIu64 " connect(s), %"
+		  PRIu64 " connect fail(s), %" PRIu64 " ping fail(s), %" PRIu64
+		  " reaped",
+		  st.nr_conns, st.nr_max, st.nr_min, st.nr_acquired,
+		  st.nr_waited, avg_us, st.wait_ns_max / 1000, st.nr_timeouts,
+		  st.nr_connects, st.nr_connect_fails, st.nr_ping_fails,
+		  st.nr_reaped);
+}
+
 /*
- * Returns true  = stop.
- * Returns false = continue.
+ * Pick up chats we joined and forget the ones we left, once a minute.
  */
-bool Scraper::runFastPhase(void)
+void Scraper::refreshChats(int64_t now_ms)
 {
-	bool stop = false;
-	uint32_t i;
+	std::vector<int64_t> chat_ids;
 
-	for (i = 0; i < 500; i++) {
-		if ((stop = shouldStop()))
-			break;
-		_run();
-		sleep(1);
+	nextChatListMs_ = now_ms + 60000;
+	log_td_rate_stats(kworker_->getTd()->getRateGovernor());
+	log_db_pool_stats(kworker_);
+
+	pr_notice("Getting chat list...");
+	auto chats = kworker_->getChats(nullptr, 500);
+	if (unlikely(!chats))
+		return;
+
+	chat_ids.assign(chats->chat_ids_.begin(), chats->chat_ids_.end());
+	sched_.setChats(chat_ids, now_ms);
+}
+
+void Scraper::reapVisits(int64_t now_ms)
+{
+	for (auto it = visits_.begin(); it != visits_.end();) {
+		if (it->done.wait_for(0ms) != std::future_status::ready) {
+			it++;
+			continue;
+		}
+
+		sched_.complete(it->chat_id, &it->vs, now_ms);
+		it = visits_.erase(it);
 	}
-	return stop;
 }
 
 /*
- * Returns true  = stop.
- * Returns false = continue.
+ * Start visits of the chats that are due, the most overdue first,
+ * while fewer than maxVisits_ are running. Their getChat queries are
+ * all in flight at once and none of them holds a thread while
+ * waiting.
  */
-bool Scraper::runSlowPhase(void)
+void Scraper::dispatchVisits(int64_t now_ms)
 {
-	bool stop = false;
-	uint32_t i, j;
+	int64_t chat_id;
 
-	for (i = 0; i < 10; i++) {
-		if ((stop = shouldStop()))
+	while (visits_.size() < maxVisits_) {
+		if (shouldStop())
 			break;
-		_run();
 
-		for (j = 0; j < 15; j++) {
-			if ((stop = shouldStop()))
-				goto out;
-			sleep(1);
-		}
+		if (!sched_.popDue(now_ms, &chat_id))
+			break;
+
+		struct pending_visit &pv = visits_.emplace_back();
+		pv.chat_id = chat_id;
+		pv.vs = {};
+		kworker_->spawn(visit_chat(chat_id, &pv.vs), &pv.done);
 	}
+}
+
+/*
+ * The coverage of @chat_id isn't known yet. Every run of consecutive
+ * ids we have stored is complete, what lies between two runs is
+ * either deleted or still missing, the gap pages will tell.
+ */
+void Scraper::seed_coverage(int64_t chat_id)
+{
+	IntervalSet covered;
+
+	kworker_->getMsgIdIndex()->forEachRun(chat_id,
+		[&](uint64_t lo, uint64_t hi) {
+			covered.add(lo, hi);
+		});
 
-out:
-	return stop;
+	kworker_->getScrapeState()->seedCoverage(chat_id, covered);
 }
 
-__hot void Scraper::_run(void)
+__hot Task<void> Scraper::visit_chat(int64_t chat_id, struct visit_stat *vs)
 {
-	int32_t i, count;
+	tgvisd::Td::Td *td = kworker_->getTd();
+
+	auto res = co_await td->send_query_async<td_api::getChat, td_api::chat>(
+		td_api::make_object<td_api::getChat>(chat_id)
+	);
+	if (unlikely(!res.obj)) {
+		vs->skipped = true;
+		co_return;
+	}
 
-	pr_notice("Getting chat list...");
-	auto chats = kworker_->getChats(nullptr, 500);
-	if (unlikely(!chats))
+	if (res.obj->type_->get_id() != td_api::chatTypeSupergroup::ID) {
+		vs->skipped = true;
+		co_return;
+	}
+
+	/*
+	 * Without a resumer (KWorker going away) we may have been woken
+	 * up on the Td loop thread.
+	 */
+	if (unlikely(!KWorker::getCurrentThPool()))
+		co_await kworker_->schedule();
+
+	if (shouldStop())
+		co_return;
+
+	pr_notice("Visiting %lld...", (long long) chat_id);
+	_visit_chat(KWorker::getCurrentThPool(), res.obj, vs);
+}
+
+/*
+ * The page is committed by now, write the chat's cursor back.
+ */
+void Scraper::save_scrape_state(int64_t chat_id)
+{
+	mysql::MySQL *db;
+
+	db = kworker_->getDbPool(32000ms);
+	if (unlikely(!db))
 		return;
 
-	count = chats->total_count_;
-	for (i = 0; i < count; i++) {
-		int64_t chat_id;
+	kworker_->getScrapeState()->save(db, chat_id);
+	kworker_->putDbPool(db);
+}
 
-		if (shouldStop())
-			return;
+/*
+ * Save @messages, the page of history right below @from, @from
+ * included (0 = the newest message). If the page is @proven to have
+ * every message in its range, every run of messages saved without a
+ * failure in between is marked covered.
+ *
+ * Returns the number of messages older than @from in the page.
+ */
+__hot int32_t Scraper::save_page(struct thpool *current,
+				 td_api::object_ptr<td_api::chat> &chat,
+				 std::mutex *chat_lock, uint64_t from,
+				 td_api::object_ptr<td_api::messages> &messages,
+				 bool proven, struct visit_stat *vs)
+{
+	ScrapeState *state = kworker_->getScrapeState();
+	MsgIdIndex<16> *stored = kworker_->getMsgIdIndex();
+	uint64_t id, run_hi, lowest = UINT64_MAX;
+	LogMessageBatch batch(kworker_, *chat, chat_lock);
+	std::vector<int32_t> in_page;
+	std::vector<bool> known, ok;
+	int32_t count, i, nr_older = 0;
+	size_t j, k = 0;
+
+	count = messages->total_count_;
+	if (unlikely(count == 0 || shouldStop()))
+		return 0;
 
-		chat_id = chats->chat_ids_[i];
-		auto chat = kworker_->getChat(chat_id);
-		if (unlikely(!chat))
+	/*
+	 * Newest first. The page proves there is nothing else between
+	 * @from (or its first message) and its last message.
+	 */
+	run_hi = from;
+	for (i = 0; i < count; i++) {
+		auto &msg = messages->messages_[i];
+		if (unlikely(!msg))
 			continue;
 
-		if (chat->type_->get_id() != td_api::chatTypeSupergroup::ID)
+		id = (uint64_t) msg->id_ >> 20u;
+		if (!run_hi)
+			run_hi = id;
+		if (unlikely(id > run_hi))
+			continue;
+		if (id < from)
+			nr_older++;
+
+		vs->nr_fetched++;
+		in_page.push_back(i);
+
+		/*
+		 * Most of a page is the overlap with what we already
+		 * have, don't spend any lookup or query on it.
+		 */
+		if (stored->contains(chat->id_, id)) {
+			vs->nr_known++;
+			known.push_back(true);
 			continue;
+		}
 
-		if (shouldStop())
-			return;
+		known.push_back(false);
+		batch.add(msg.get());
+	}
 
-		pr_notice("Visiting %lld...", (long long) chat_id);
-		visit_chat(chat);
+	if (batch.size()) {
+		current->setUninterruptible();
+		vs->nr_failed += (uint32_t) batch.save(&ok);
+		vs->nr_saved += (uint32_t) batch.getNrStored();
+		current->setInterruptible();
 	}
-}
 
-struct scraper_payload {
-	td_api::object_ptr<td_api::chat>	chat;
-};
+	for (j = 0; j < in_page.size(); j++) {
+		id = (uint64_t) messages->messages_[in_page[j]]->id_ >> 20u;
 
-static void scraper_payload_deleter(void *p)
-{
-	delete (struct scraper_payload *)p;
+		if (known[j]) {
+			lowest = id;
+			continue;
+		}
+
+		if (likely(ok[k++])) {
+			if (!from)
+				vs->nr_tail_new++;
+			lowest = id;
+			continue;
+		}
+
+		/* Leave a hole for the next visit to fill. */
+		if (proven && lowest != UINT64_MAX)
+			state->cover(chat->id_, lowest, run_hi);
+		lowest = UINT64_MAX;
+		run_hi = id - 1;
+	}
+
+	if (proven && lowest != UINT64_MAX)
+		state->cover(chat->id_, lowest, run_hi);
+
+	return nr_older;
 }
 
-__hot void Scraper::visit_chat(td_api::object_ptr<td_api::chat> &chat)
+void Scraper::report_progress(td_api::object_ptr<td_api::chat> &chat,
+			      const struct visit_stat *vs)
 {
-	int ret;
-	struct task_work tw;
-	struct scraper_payload *payload;
+	struct scrape_progress p;
+
+	kworker_->getScrapeState()->getProgress(chat->id_, &p);
+	pr_notice("Scraped %lld [%s]: %u local and %u network page(s), %u "
+		  "message(s) (%u already stored, %u failed); covered %" PRIu64
+		  "..%" PRIu64 " in %zu range(s), %" PRIu64 " id(s) missing%s; "
+		  "backfill %s",
+		  (long long) chat->id_, chat->title_.c_str(),
+		  vs->nr_local_pages, vs->nr_pages,
+		  vs->nr_fetched, vs->nr_known, vs->nr_failed, p.oldest,
+		  p.newest, p.nr_ranges, p.nr_missing,
+		  p.seeded ? "" : " (not seeded)",
+		  p.backfill_done ? "done" : "pending");
+}
 
-	payload = new struct scraper_payload;
-	payload->chat = std::move(chat);
+/*
+ * Save what TDLib already has in its local database, newest first,
+ * without any network request. Stops at the first page that brings
+ * nothing new, the rest has been drained by an earlier visit.
+ *
+ * The local database may have holes of its own, so these pages don't
+ * cover anything. The network pages that follow still do that, but
+ * find the messages stored already and TDLib can mostly answer them
+ * from its cache.
+ */
+void Scraper::drain_local(struct thpool *current,
+			  td_api::object_ptr<td_api::chat> &chat,
+			  std::mutex *chat_lock, struct visit_stat *vs)
+{
+	uint64_t from = 0, lowest;
+	uint32_t i, nr_before;
+	int32_t count;
 
-	tw.func = [this](struct tw_data *data){
-		struct scraper_payload *payload;
+	for (i = 0; i < maxLocalPages_; i++) {
+		if (shouldStop())
+			break;
 
-		payload = (struct scraper_payload *)data->tw->payload;
-		this->_visit_chat(data, payload->chat);
-	};
-	tw.payload = (void *)payload;
-	tw.deleter = scraper_payload_deleter;
+		auto messages = kworker_->getChatHistory(chat->id_,
+							 (int64_t) (from << 20u),
+							 0,
+							 SCRAPE_PAGE_SIZE,
+							 true);
+		if (!messages)
+			break;
 
-	while (1) {
-		if (shouldStop())
+		count = messages->total_count_;
+		if (!count || unlikely(!messages->messages_[count - 1]))
 			break;
 
-		ret = kworker_->submitTaskWork(&tw);
-		if (ret != -EAGAIN)
+		vs->nr_local_pages++;
+		nr_before = vs->nr_saved;
+		save_page(current, chat, chat_lock, from, messages, false, vs);
+		if (vs->nr_saved == nr_before)
 			break;
 
-		sleep(1);
+		lowest = (uint64_t) messages->messages_[count - 1]->id_ >> 20u;
+		if (from && lowest >= from)
+			break;
+		from = lowest;
 	}
 }
 
-__hot void Scraper::_visit_chat(struct tw_data *data,
-				td_api::object_ptr<td_api::chat> &chat)
+/*
+ * Send the getChatHistory of the page below @from, unless this visit
+ * already did. @recheck sends it again anyway.
+ */
+bool Scraper::queue_page(std::deque<struct page_fetch> *pipe,
+			 std::vector<uint64_t> *queued, int64_t chat_id,
+			 uint64_t from, bool recheck)
 {
-	int32_t count, i;
-	std::mutex *chat_lock;
-	int64_t startMsgId = 0;
-	int64_t shiftedMsgId;
-	td_api::object_ptr<td_api::error> err;
-	struct thpool *current = data->current;
-	static std::mutex minMaxMapLock;
-	static std::unordered_map<int64_t, uint8_t> minMaxMap;
-
-	/* false = min; true = max;*/
-	bool minMax;
-
-	minMaxMapLock.lock();
-	if (unlikely(minMaxMap.find(chat->id_) == minMaxMap.end())) {
-		minMaxMap.emplace(chat->id_, 0);
-		minMax = true;
-	} else {
-		uint8_t nn = ++minMaxMap[chat->id_];
-
-		/* Dominate min. */
-		minMax = ((nn % 5) == 0);
+	if (!recheck) {
+		if (std::find(queued->begin(), queued->end(), from) !=
+		    queued->end())
+			return false;
+
+		queued->push_back(from);
 	}
-	minMaxMapLock.unlock();
 
+	struct page_fetch &pf = pipe->emplace_back();
+	pf.from = from;
+	pf.recheck = recheck;
+	pf.fut = kworker_->getChatHistoryFuture(chat_id,
+						(int64_t) (from << 20u),
+						0, SCRAPE_PAGE_SIZE);
+	return true;
+}
+
+/*
+ * Every visit fetches the live tail, then up to maxGapPages_ pages
+ * from the gaps in the chat's coverage, newest hole first and the
+ * backfill last.
+ *
+ * Up to prefetchDepth_ pages are requested ahead of the one being
+ * saved: the gaps we already know of, and the page right below a
+ * full page that didn't reach anything we have. Which page comes
+ * next is only known for sure once the current one is saved, a
+ * prefetched page whose gap got covered in the meantime is dropped.
+ */
+__hot void Scraper::_visit_chat(struct thpool *current,
+				td_api::object_ptr<td_api::chat> &chat,
+				struct visit_stat *vs)
+{
+	ScrapeState *state = kworker_->getScrapeState();
+	MsgIdIndex<16> *stored = kworker_->getMsgIdIndex();
+	std::vector<uint64_t> queued, gaps(prefetchDepth_ + 1);
+	td_api::object_ptr<td_api::error> err;
+	std::deque<struct page_fetch> pipe;
+	uint32_t nr_gap_pages = 0;
+	std::mutex *chat_lock;
+	int32_t count, nr_older;
+	bool recheck;
+	uint64_t lowest, from;
+	size_t i, nr;
 
 	pr_notice("Scraping messages from (%lld) [%s]...",
 		  (long long) chat->id_, chat->title_.c_str());
@@ -207,73 +483,107 @@ __hot void Scraper::_visit_chat(struct tw_data *data,
 	}
 
 	/*
-	 * @startMsgId will be zero when we don't have any message from
-	 * the corresponding @chat->id_ in our database.
+	 * Until the message id index is loaded, we can't tell what the
+	 * chat is missing. Only the tail is scraped in the meantime.
 	 */
-	chat_lock->lock();
-	startMsgId = LogMessage::getMinMaxMsgIdByTgGroupId(kworker_, chat->id_,
-							   minMax);
-	chat_lock->unlock();
-	if (unlikely(startMsgId == -1)) {
-		pr_err("Cannot check last message id from (%lld)",
-		       (long long) chat->id_);
-		return;
-	}
+	if (!state->isSeeded(chat->id_) && kworker_->isWarm())
+		seed_coverage(chat->id_);
 
-	if (startMsgId > 0) {
-		if (!minMax)
-			startMsgId += 1;
-		else if (startMsgId > 30)
-			startMsgId -= 30;
-	}
+	if (maxLocalPages_)
+		drain_local(current, chat, chat_lock, vs);
 
-	pr_notice("Scraping %lld with startMsgId = %lld; (%s)",
-		  (long long) chat->id_, (long long) startMsgId,
-		  (minMax ? "max" : "min"));
-
-	shiftedMsgId = startMsgId ? startMsgId << 20ull : startMsgId;
-	auto messages = kworker_->getChatHistory(chat->id_,
-						 shiftedMsgId,
-						 -30,
-						 100,
-						 false,
-						 &err);
-	if (unlikely(!messages)) {
-out_get_msg_fail:
-		pr_notice("Could not get message history from (%lld) [%s]: %s",
-			  (long long) chat->id_, chat->title_.c_str(),
-			  err ? to_string(err).c_str() : "no err info");
-		return;
-	}
+	queue_page(&pipe, &queued, chat->id_, 0);
 
-	count = messages->total_count_;
-	if (unlikely(count == 0))
-		goto out_get_msg_fail;
+	auto refill = [&](void) {
+		if (pipe.size() > prefetchDepth_ || nr_gap_pages >= maxGapPages_)
+			return;
 
-	current->setInterruptible();
-	for (i = 0; i < count; i++) {
-		LogMessage *m_msg;
+		nr = state->nextGaps(chat->id_, gaps.data(), gaps.size());
+		for (i = 0; i < nr; i++) {
+			if (pipe.size() > prefetchDepth_ ||
+			    nr_gap_pages >= maxGapPages_)
+				break;
 
-		if (shouldStop())
+			if (queue_page(&pipe, &queued, chat->id_, gaps[i]))
+				nr_gap_pages++;
+		}
+	};
+
+	while (!shouldStop()) {
+		/* Gaps we already know of don't depend on this page. */
+		refill();
+		if (pipe.empty())
 			break;
 
-		auto &msg = messages->messages_[i];
-		if (unlikely(!msg))
+		from = pipe.front().from;
+		recheck = pipe.front().recheck;
+		auto messages = kworker_->waitChatHistory(pipe.front().fut, &err);
+		pipe.pop_front();
+		if (unlikely(!messages)) {
+			pr_notice("Could not get message history from (%lld) [%s]: %s",
+				  (long long) chat->id_, chat->title_.c_str(),
+				  err ? to_string(err).c_str() : "no err info");
+
+			/* Don't go after the gaps without the tail. */
+			if (!from)
+				break;
+
+			/*
+			 * The governor holds the history requests for as
+			 * long as Telegram asked, come back later.
+			 */
+			if (err && (err->code_ == 429 || err->code_ == 420))
+				break;
+			continue;
+		}
+
+		vs->nr_pages++;
+
+		/* Covered by a page saved after this one was sent. */
+		if (from && state->isCovered(chat->id_, from - 1))
 			continue;
 
-		current->setUninterruptible();
-		m_msg = new LogMessage(kworker_, *msg);
-		m_msg->set_chat(std::move(chat));
-		m_msg->set_chat_lock(chat_lock);
-		m_msg->save();
-		chat = m_msg->get_chat();
-		delete m_msg;
-		current->setInterruptible();
+		count = messages->total_count_;
+
+		/*
+		 * A full page that didn't reach anything we have is
+		 * followed by a gap right below it, get that page while
+		 * this one is saved.
+		 */
+		if (count == SCRAPE_PAGE_SIZE && messages->messages_[count - 1] &&
+		    pipe.size() <= prefetchDepth_ && nr_gap_pages < maxGapPages_ &&
+		    state->isSeeded(chat->id_)) {
+			lowest = (uint64_t) messages->messages_[count - 1]->id_ >> 20u;
+			if (!stored->contains(chat->id_, lowest) &&
+			    queue_page(&pipe, &queued, chat->id_, lowest))
+				nr_gap_pages++;
+		}
+
+		nr_older = save_page(current, chat, chat_lock, from, messages,
+				     true, vs);
+
+		/*
+		 * Nothing older than our oldest message: the chat start,
+		 * or TDLib answered before it had the older messages at
+		 * hand. Only an empty page is taken at its word, any
+		 * other page has to give the same answer a second time.
+		 */
+		if (from && !nr_older && !shouldStop() &&
+		    state->coveredMin(chat->id_) == from) {
+			if (!count || recheck)
+				state->setBackfillDone(chat->id_);
+			else
+				queue_page(&pipe, &queued, chat->id_, from, true);
+		}
 	}
 
-	pr_notice("Scraped %lld messages from %lld with startMsgId = %lld; (%s)",
-		  (long long) count, (long long) chat->id_,
-		  (long long) startMsgId, (minMax ? "max" : "min"));
+	/* Still catching up, come back soon. */
+	if (nr_gap_pages >= maxGapPages_ && maxGapPages_ &&
+	    state->nextGap(chat->id_, &from) != SCRAPE_GAP_NONE)
+		vs->has_gap = true;
+
+	save_scrape_state(chat->id_);
+	report_progress(chat, vs);
 }
 
 } /* namespace tgvisd */
@@ -11,24 +11,87 @@
 #define TGVISD__SCRAPER_HPP
 
 #include <tgvisd/Td/Td.hpp>
+#include <tgvisd/Task.hpp>
 #include <tgvisd/common.hpp>
+#include <tgvisd/ChatScheduler.hpp>
 
+#include <list>
+#include <deque>
+#include <future>
+#include <vector>
 #include <thread>
 #include <tgvisd/Main.hpp>
 
 namespace tgvisd {
 
+/* Messages per getChatHistory, the most TDLib returns. */
+static constexpr int32_t SCRAPE_PAGE_SIZE = 100;
+
+struct page_fetch {
+	uint64_t						from;
+
+	/* Second fetch of a page that seemed to end the chat. */
+	bool							recheck;
+	std::future<Td::query_result<td_api::messages>>		fut;
+};
+
+struct pending_visit {
+	int64_t			chat_id;
+	struct visit_stat	vs;
+	std::future<void>	done;
+};
+
 class Scraper {
 private:
 	Main		*main_ = nullptr;
 	KWorker		*kworker_ = nullptr;
 	volatile bool	stopScraper_ = false;
 
+	/* Max number of gap pages fetched per chat visit. */
+	uint32_t	maxGapPages_ = 4;
+
+	/*
+	 * Max number of history pages requested ahead of the one being
+	 * saved, per chat visit.
+	 */
+	uint32_t	prefetchDepth_ = 1;
+
+	/*
+	 * Max number of pages drained from TDLib's local database
+	 * before going to the network, 0 to always use the network.
+	 */
+	uint32_t	maxLocalPages_ = 16;
+
+	/* Max number of chat visits running at once. */
+	uint32_t	maxVisits_ = 8;
+
+	ChatScheduler			sched_;
+	std::list<struct pending_visit>	visits_;
+	int64_t				nextChatListMs_ = 0;
+
 	void scraperEventLoop(void);
-	void _run(void);
-	void visit_chat(td_api::object_ptr<td_api::chat> &chat);
-	void _visit_chat(struct tw_data *data,
-			 td_api::object_ptr<td_api::chat> &chat);
+	void refreshChats(int64_t now_ms);
+	void reapVisits(int64_t now_ms);
+	void dispatchVisits(int64_t now_ms);
+	Task<void> visit_chat(int64_t chat_id, struct visit_stat *vs);
+	void seed_coverage(int64_t chat_id);
+	void save_scrape_state(int64_t chat_id);
+	void report_progress(td_api::object_ptr<td_api::chat> &chat,
+			     const struct visit_stat *vs);
+	void _visit_chat(struct thpool *current,
+			 td_api::object_ptr<td_api::chat> &chat,
+			 struct visit_stat *vs);
+	bool queue_page(std::deque<struct page_fetch> *pipe,
+			std::vector<uint64_t> *queued, int64_t chat_id,
+			uint64_t from, bool recheck = false);
+	int32_t save_page(struct thpool *current,
+			  td_api::object_ptr<td_api::chat> &chat,
+			  std::mutex *chat_lock, uint64_t from,
+			  td_api::object_ptr<td_api::messages> &messages,
+			  bool proven, struct visit_stat *vs);
+	void drain_local(struct thpool *current,
+			 td_api::object_ptr<td_api::chat> &chat,
+			 std::mutex *chat_lock, struct visit_stat *vs);
 
 	void save_message(td_api::object_ptr<td_api::message> &msg,
 			  td_api::object_ptr<td_api::chat> *chat = nullptr,
@@ -37,9 +100,6 @@ private:
 	void _save_msg(td_api::object_ptr<td_api::message> &msg,
 		       uint64_t pk_gid, uint64_t pk_uid);
 
-	bool runFastPhase(void);
-	bool runSlowPhase(void);
-
 public:
 	Scraper(Main *main);
 	~Scraper(void) = default;
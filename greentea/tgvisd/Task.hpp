@@ -0,0 +1,255 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license GPL-2.0-only
+ * @package tgvisd
+ *
+ * Copyright (C) 2022 Ammar Faizi <ammarfaizi2@gmail.com>
+ */
+
+#ifndef TGVISD__TASK_HPP
+#define TGVISD__TASK_HPP
+
+#include <atomic>
+#include <cassert>
+#include <utility>
+#include <optional>
+#include <exception>
+#include <coroutine>
+#include <tgvisd/common.hpp>
+
+
+namespace tgvisd {
+
+
+template <typename T = void>
+class Task;
+
+
+namespace detail {
+
+
+struct task_promise_base {
+	std::coroutine_handle<>		continuation_ = nullptr;
+	std::exception_ptr		exc_          = nullptr;
+
+	/*
+	 * Set by whichever comes second: the awaiter being done with
+	 * await_suspend(), or the task reaching final_suspend(). That
+	 * one continues the awaiting coroutine.
+	 *
+	 * A task that completes synchronously thus returns to its
+	 * awaiter without nesting another resume() on the stack. We
+	 * can't rely on symmetric transfer for that, GCC doesn't turn
+	 * it into a tail call with -fsanitize=address.
+	 */
+	std::atomic<bool>		ready_        = false;
+
+	struct final_awaiter {
+		inline bool await_ready(void) const noexcept
+		{
+			return false;
+		}
+
+
+		template <typename P>
+		inline void await_suspend(std::coroutine_handle<P> h) noexcept
+		{
+			task_promise_base &p = h.promise();
+
+			if (p.ready_.exchange(true, std::memory_order_acq_rel) &&
+			    p.continuation_)
+				p.continuation_.resume();
+		}
+
+
+		inline void await_resume(void) const noexcept
+		{
+		}
+	};
+
+
+	/* Tasks are lazy, nothing runs until they are awaited. */
+	inline std::suspend_always initial_suspend(void) const noexcept
+	{
+		return {};
+	}
+
+
+	inline final_awaiter final_suspend(void) const noexcept
+	{
+		return {};
+	}
+
+
+	inline void unhandled_exception(void) noexcept
+	{
+		exc_ = std::current_exception();
+	}
+
+
+	inline void rethrow_if_failed(void)
+	{
+		if (unlikely(exc_))
+			std::rethrow_exception(exc_);
+	}
+};
+
+
+template <typename T>
+struct task_promise: public task_promise_base {
+	std::optional<T>	value_;
+
+	inline Task<T> get_return_object(void) noexcept;
+
+
+	template <typename V>
+	inline void return_value(V &&val)
+	{
+		value_.emplace(std::forward<V>(val));
+	}
+
+
+	inline T result(void)
+	{
+		rethrow_if_failed();
+		return std::move(*value_);
+	}
+};
+
+
+template <>
+struct task_promise<void>: public task_promise_base {
+	inline Task<void> get_return_object(void) noexcept;
+
+
+	inline void return_void(void) const noexcept
+	{
+	}
+
+
+	inline void result(void)
+	{
+		rethrow_if_failed();
+	}
+};
+
+
+} /* namespace detail */
+
+
+/*
+ * A coroutine returning Task<T> suspends (instead of blocking its
+ * thread) at every co_await, and is resumed by whatever completes the
+ * awaited operation: a TDLib answer, a free DB connection, etc.
+ *
+ * Task owns the coroutine frame. To start one, either co_await it from
+ * another task, or hand it to KWorker::spawn().
+ */
+template <typename T>
+class Task
+{
+public:
+	using promise_type = detail::task_promise<T>;
+	using handle_type  = std::coroutine_handle<promise_type>;
+
+private:
+	handle_type	h_ = nullptr;
+
+public:
+	inline Task(void) noexcept = default;
+
+
+	inline explicit Task(handle_type h) noexcept:
+		h_(h)
+	{
+	}
+
+
+	inline Task(Task &&t) noexcept:
+		h_(std::exchange(t.h_, nullptr))
+	{
+	}
+
+
+	inline Task &operator=(Task &&t) noexcept
+	{
+		if (this != &t) {
+			if (h_)
+				h_.destroy();
+			h_ = std::exchange(t.h_, nullptr);
+		}
+		return *this;
+	}
+
+
+	Task(const Task &) = delete;
+	Task &operator=(const Task &) = delete;
+
+
+	inline ~Task(void)
+	{
+		if (h_)
+			h_.destroy();
+	}
+
+
+	inline bool valid(void) const noexcept
+	{
+		return !!h_;
+	}
+
+
+	struct awaiter {
+		handle_type	h_;
+
+		inline bool await_ready(void) const noexcept
+		{
+			return h_.done();
+		}
+
+
+		inline bool await_suspend(std::coroutine_handle<> c) noexcept
+		{
+			h_.promise().continuation_ = c;
+			h_.resume();
+			return !h_.promise().ready_.exchange(true,
+						std::memory_order_acq_rel);
+		}
+
+
+		inline T await_resume(void)
+		{
+			return h_.promise().result();
+		}
+	};
+
+
+	/*
+	 * Only a Task returned by a coroutine can be awaited, never an
+	 * empty (default constructed or moved from) one.
+	 */
+	inline awaiter operator co_await(void) && noexcept
+	{
+		assert(h_);
+		return awaiter{h_};
+	}
+};
+
+
+template <typename T>
+inline Task<T> detail::task_promise<T>::get_return_object(void) noexcept
+{
+	return Task<T>(std::coroutine_handle<task_promise<T>>::from_promise(*this));
+}
+
+
+inline Task<void> detail::task_promise<void>::get_return_object(void) noexcept
+{
+	return Task<void>(std::coroutine_handle<task_promise<void>>::from_promise(*this));
+}
+
+
+} /* namespace tgvisd */
+
+#endif /* #ifndef TGVISD__TASK_HPP */
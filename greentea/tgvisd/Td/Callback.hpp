@@ -50,6 +50,30 @@ public:
 			updateUser(update);
 	}
 
+	std::function<void(td_api::updateUserFullInfo &update)>
+		updateUserFullInfo = nullptr;
+	inline void execute(td_api::updateUserFullInfo &update)
+	{
+		if (updateUserFullInfo)
+			updateUserFullInfo(update);
+	}
+
+	std::function<void(td_api::updateSupergroup &update)>
+		updateSupergroup = nullptr;
+	inline void execute(td_api::updateSupergroup &update)
+	{
+		if (updateSupergroup)
+			updateSupergroup(update);
+	}
+
+	std::function<void(td_api::updateSupergroupFullInfo &update)>
+		updateSupergroupFullInfo = nullptr;
+	inline void execute(td_api::updateSupergroupFullInfo &update)
+	{
+		if (updateSupergroupFullInfo)
+			updateSupergroupFullInfo(update);
+	}
+
 	std::function<void(td_api::updateNewMessage &update)>
 		updateNewMessage = nullptr;
 	inline void execute(td_api::updateNewMessage &update)
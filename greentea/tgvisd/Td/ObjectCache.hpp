@@ -0,0 +1,116 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license GPL-2.0-only
+ * @package tgvisd::Td
+ *
+ * Copyright (C) 2022 Ammar Faizi <ammarfaizi2@gmail.com>
+ */
+
+#ifndef TGVISD__TD__OBJECTCACHE_HPP
+#define TGVISD__TD__OBJECTCACHE_HPP
+
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <shared_mutex>
+#include <unordered_map>
+
+namespace tgvisd::Td {
+
+namespace td_api = td::td_api;
+
+/*
+ * Thread-safe cache of TDLib objects keyed by their 64-bit id.
+ *
+ * The Td loop feeds it from the update stream, the workers read from
+ * it. Objects are handed out as shared_ptr<const T>, so a reader may
+ * keep using an object after a newer one has replaced it.
+ */
+template <typename T>
+class ObjectCache
+{
+public:
+	using clock = std::chrono::steady_clock;
+
+	struct entry {
+		std::shared_ptr<const T>	obj;
+		clock::time_point		at;
+	};
+
+private:
+	std::shared_mutex			lock_;
+	std::unordered_map<int64_t, struct entry> map_;
+	std::chrono::seconds			ttl_;
+	std::atomic<uint64_t>			nrHit_  = 0;
+	std::atomic<uint64_t>			nrMiss_ = 0;
+
+public:
+	inline ObjectCache(std::chrono::seconds ttl):
+		ttl_(ttl)
+	{
+	}
+
+
+	/*
+	 * Returns nullptr if @id is not cached or has expired.
+	 */
+	inline std::shared_ptr<const T> get(int64_t id)
+	{
+		std::shared_ptr<const T> ret;
+
+		lock_.lock_shared();
+		const auto &it = map_.find(id);
+		if (it != map_.end() && clock::now() - it->second.at < ttl_)
+			ret = it->second.obj;
+		lock_.unlock_shared();
+
+		if (ret)
+			nrHit_.fetch_add(1, std::memory_order_relaxed);
+		else
+			nrMiss_.fetch_add(1, std::memory_order_relaxed);
+
+		return ret;
+	}
+
+
+	inline std::shared_ptr<const T> put(int64_t id, td_api::object_ptr<T> obj)
+	{
+		std::shared_ptr<const T> ret(std::move(obj));
+
+		if (unlikely(!ret))
+			return ret;
+
+		lock_.lock();
+		struct entry &e = map_[id];
+		e.obj = ret;
+		e.at  = clock::now();
+		lock_.unlock();
+		return ret;
+	}
+
+
+	inline void erase(int64_t id)
+	{
+		lock_.lock();
+		map_.erase(id);
+		lock_.unlock();
+	}
+
+
+	inline uint64_t getNrHit(void)
+	{
+		return nrHit_.load(std::memory_order_relaxed);
+	}
+
+
+	inline uint64_t getNrMiss(void)
+	{
+		return nrMiss_.load(std::memory_order_relaxed);
+	}
+};
+
+} /* namespace tgvisd::Td */
+
+#endif /* #ifndef TGVISD__TD__OBJECTCACHE_HPP */
@@ -0,0 +1,404 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license GPL-2.0-only
+ * @package tgvisd::Td
+ *
+ * Copyright (C) 2022 Ammar Faizi <ammarfaizi2@gmail.com>
+ */
+
+#ifndef TGVISD__TD__RATEGOVERNOR_HPP
+#define TGVISD__TD__RATEGOVERNOR_HPP
+
+#include <mutex>
+#include <deque>
+#include <chrono>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+namespace tgvisd::Td {
+
+namespace td_api = td::td_api;
+
+
+enum td_rate_class {
+	TD_RATE_HISTORY,
+	TD_RATE_CHAT,
+	TD_RATE_USER,
+	NR_TD_RATE_CLASSES
+};
+
+
+struct td_rate_stats {
+	/* Current allowed rate, requests per second. */
+	double		rate;
+	size_t		nr_queued;
+	uint64_t	nr_sent;
+	uint64_t	nr_delayed;
+	uint64_t	nr_flood;
+	uint64_t	total_wait_ms;
+	uint64_t	max_wait_ms;
+
+	/* Time left on the last flood wait, 0 if there is none. */
+	uint64_t	blocked_ms;
+};
+
+
+/*
+ * Token buckets in front of the TDLib requests that end up on
+ * Telegram's servers, one per class of method.
+ *
+ * A request that finds no token (or a class still serving a flood
+ * wait) is queued and sent, in order, once the bucket allows it.
+ * The rate of a class is adapted AIMD style: a FLOOD_WAIT / 429
+ * halves it and blocks the class for the retry-after Telegram asked
+ * for, every RATE_WINDOW answers in a row without one raise it by a
+ * tenth of its initial value, up to that initial value. So it keeps
+ * hovering right below what Telegram tolerates.
+ */
+class RateGovernor
+{
+public:
+	struct req {
+		td_api::object_ptr<td_api::Function>	f;
+		uint64_t				query_id;
+		int64_t					queued_ns;
+	};
+
+private:
+	static constexpr uint32_t RATE_WINDOW = 20;
+
+	/* When Telegram says 429 without telling for how long. */
+	static constexpr uint32_t DEFAULT_RETRY_AFTER = 5;
+
+	struct bucket {
+		double			rate;
+		double			max_rate;
+		double			min_rate;
+		double			tokens;
+		int64_t			last_ns;
+		int64_t			blocked_until_ns;
+		uint32_t		nr_ok;
+		std::deque<struct req>	queue;
+
+		uint64_t		nr_sent;
+		uint64_t		nr_delayed;
+		uint64_t		nr_flood;
+		uint64_t		total_wait_ns;
+		uint64_t		max_wait_ns;
+	};
+
+	std::mutex		lock_;
+	struct bucket		buckets_[NR_TD_RATE_CLASSES];
+
+
+	static inline int64_t now_ns(void)
+	{
+		using namespace std::chrono;
+
+		return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+	}
+
+
+	static inline void refill(struct bucket *b, int64_t now)
+	{
+		if (now > b->last_ns) {
+			b->tokens += b->rate * (double) (now - b->last_ns) / 1e9;
+			if (b->tokens > b->max_rate)
+				b->tokens = b->max_rate;
+		}
+		b->last_ns = now;
+	}
+
+
+	static inline bool can_send(struct bucket *b, int64_t now)
+	{
+		if (now < b->blocked_until_ns)
+			return false;
+
+		refill(b, now);
+		return b->tokens >= 1.0;
+	}
+
+
+	static inline void account_sent(struct bucket *b, int64_t now,
+					int64_t queued_ns)
+	{
+		uint64_t wait;
+
+		b->tokens -= 1.0;
+		b->nr_sent++;
+		if (!queued_ns)
+			return;
+
+		wait = (uint64_t) (now - queued_ns);
+		b->total_wait_ns += wait;
+		if (wait > b->max_wait_ns)
+			b->max_wait_ns = wait;
+	}
+
+
+	/*
+	 * Seconds to wait from a FLOOD_WAIT_X / "retry after X" error,
+	 * 0 if @err isn't one.
+	 */
+	static inline uint32_t retry_after(const td_api::error &err)
+	{
+		const char *msg = err.message_.c_str();
+		const char *p;
+		uint32_t v;
+
+		p = strstr(msg, "FLOOD_WAIT_");
+		if (p) {
+			v = (uint32_t) strtoul(p + 11, NULL, 10);
+			return v ? v : 1;
+		}
+
+		p = strstr(msg, "retry after ");
+		if (p) {
+			v = (uint32_t) strtoul(p + 12, NULL, 10);
+			return v ? v : 1;
+		}
+
+		return err.code_ == 429 ? DEFAULT_RETRY_AFTER : 0;
+	}
+
+public:
+	inline RateGovernor(void)
+	{
+		for (auto &b: buckets_) {
+			b.rate = b.max_rate = b.tokens = 10.0;
+			b.min_rate = 0.1;
+			b.last_ns = now_ns();
+			b.blocked_until_ns = 0;
+			b.nr_ok = 0;
+			b.nr_sent = b.nr_delayed = b.nr_flood = 0;
+			b.total_wait_ns = b.max_wait_ns = 0;
+		}
+	}
+
+
+	static inline const char *className(int cls)
+	{
+		static const char *const names[NR_TD_RATE_CLASSES] = {
+			"history",	/* TD_RATE_HISTORY */
+			"chat",		/* TD_RATE_CHAT */
+			"user",		/* TD_RATE_USER */
+		};
+
+		return names[cls];
+	}
+
+
+	/*
+	 * Which bucket @f goes through, -1 for the requests TDLib
+	 * answers without asking Telegram.
+	 */
+	static inline int classify(const td_api::Function &f)
+	{
+		switch (f.get_id()) {
+		case td_api::getChatHistory::ID:
+			if (static_cast<const td_api::getChatHistory &>(f).only_local_)
+				return -1;
+			return TD_RATE_HISTORY;
+		case td_api::getMessage::ID:
+			return TD_RATE_HISTORY;
+		case td_api::getChat::ID:
+		case td_api::getChats::ID:
+		case td_api::getSupergroup::ID:
+		case td_api::getSupergroupFullInfo::ID:
+			return TD_RATE_CHAT;
+		case td_api::getUser::ID:
+		case td_api::getUserFullInfo::ID:
+			return TD_RATE_USER;
+		default:
+			return -1;
+		}
+	}
+
+
+	inline void setRate(int cls, double rate)
+	{
+		struct bucket *b = &buckets_[cls];
+
+		if (unlikely(rate <= 0))
+			return;
+
+		lock_.lock();
+		b->rate = b->max_rate = rate;
+		if (b->min_rate > rate)
+			b->min_rate = rate;
+		if (b->tokens > rate)
+			b->tokens = rate;
+		lock_.unlock();
+	}
+
+
+	/*
+	 * Take a token for a request of @cls. Returns false if the
+	 * request has to wait, it must then be handed to enqueue().
+	 * Requests don't overtake the ones already waiting.
+	 */
+	inline bool tryAcquire(int cls)
+	{
+		struct bucket *b = &buckets_[cls];
+		int64_t now = now_ns();
+		bool ret = false;
+
+		lock_.lock();
+		if (b->queue.empty() && can_send(b, now)) {
+			account_sent(b, now, 0);
+			ret = true;
+		}
+		lock_.unlock();
+		return ret;
+	}
+
+
+	inline void enqueue(int cls, struct req &&r)
+	{
+		struct bucket *b = &buckets_[cls];
+
+		r.queued_ns = now_ns();
+		lock_.lock();
+		b->nr_delayed++;
+		b->queue.push_back(std::move(r));
+		lock_.unlock();
+	}
+
+
+	/*
+	 * Move the queued requests whose turn has come to @out, in the
+	 * order they have to be sent.
+	 */
+	inline void drain(std::vector<struct req> *out)
+	{
+		int64_t now = now_ns();
+
+		lock_.lock();
+		for (auto &b: buckets_) {
+			while (!b.queue.empty() && can_send(&b, now)) {
+				account_sent(&b, now, b.queue.front().queued_ns);
+				out->push_back(std::move(b.queue.front()));
+				b.queue.pop_front();
+			}
+		}
+		lock_.unlock();
+	}
+
+
+	/*
+	 * Drop every queued request. Their handlers are left alone, the
+	 * caller has to complete them (see Td::cancel_pending()).
+	 */
+	inline void clear(void)
+	{
+		lock_.lock();
+		for (auto &b: buckets_)
+			b.queue.clear();
+		lock_.unlock();
+	}
+
+
+	/*
+	 * Nanoseconds until the next queued request can be sent, -1 if
+	 * nothing is queued.
+	 */
+	inline int64_t nextWakeNs(void)
+	{
+		int64_t now = now_ns(), ret = -1, t;
+
+		lock_.lock();
+		for (auto &b: buckets_) {
+			if (b.queue.empty())
+				continue;
+
+			refill(&b, now);
+			t = 0;
+			if (b.tokens < 1.0)
+				t = (int64_t) ((1.0 - b.tokens) / b.rate * 1e9);
+			if (b.blocked_until_ns - now > t)
+				t = b.blocked_until_ns - now;
+
+			if (ret < 0 || t < ret)
+				ret = t;
+		}
+		lock_.unlock();
+		return ret;
+	}
+
+
+	/*
+	 * Feed the answer to a request of @cls back, this is where the
+	 * rate is adapted. Returns the retry-after applied, in seconds.
+	 */
+	inline uint32_t onResult(int cls, const td_api::Object *obj)
+	{
+		struct bucket *b = &buckets_[cls];
+		uint32_t secs = 0;
+
+		/* Cancelled, says nothing about the rate. */
+		if (unlikely(!obj))
+			return 0;
+
+		if (obj->get_id() == td_api::error::ID)
+			secs = retry_after(static_cast<const td_api::error &>(*obj));
+
+		lock_.lock();
+		if (secs) {
+			int64_t now = now_ns();
+			int64_t until = now + (int64_t) secs * 1000000000ll;
+
+			/*
+			 * The other requests in flight when it hit are
+			 * likely to get one too, that's still the same
+			 * flood.
+			 */
+			if (now >= b->blocked_until_ns) {
+				b->rate /= 2;
+				if (b->rate < b->min_rate)
+					b->rate = b->min_rate;
+			}
+
+			if (until > b->blocked_until_ns)
+				b->blocked_until_ns = until;
+			b->tokens = 0;
+			b->nr_ok = 0;
+			b->nr_flood++;
+		} else if (++b->nr_ok >= RATE_WINDOW) {
+			b->nr_ok = 0;
+			b->rate += b->max_rate / 10;
+			if (b->rate > b->max_rate)
+				b->rate = b->max_rate;
+		}
+		lock_.unlock();
+		return secs;
+	}
+
+
+	inline void getStats(int cls, struct td_rate_stats *st)
+	{
+		struct bucket *b = &buckets_[cls];
+		int64_t now = now_ns();
+
+		lock_.lock();
+		st->rate = b->rate;
+		st->nr_queued = b->queue.size();
+		st->nr_sent = b->nr_sent;
+		st->nr_delayed = b->nr_delayed;
+		st->nr_flood = b->nr_flood;
+		st->total_wait_ms = b->total_wait_ns / 1000000;
+		st->max_wait_ms = b->max_wait_ns / 1000000;
+		st->blocked_ms = 0;
+		if (b->blocked_until_ns > now)
+			st->blocked_ms = (uint64_t) (b->blocked_until_ns - now) / 1000000;
+		lock_.unlock();
+	}
+};
+
+
+} /* namespace tgvisd::Td */
+
+#endif /* #ifndef TGVISD__TD__RATEGOVERNOR_HPP */
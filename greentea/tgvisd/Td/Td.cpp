@@ -8,6 +8,7 @@
  */
 
 #include "Td.hpp"
+#include <cstdlib>
 #include <iostream>
 
 namespace tgvisd::Td {
@@ -25,8 +26,27 @@ volatile bool cancel_delayed_work = false;
 __cold Td::Td(uint32_t api_id, const char *api_hash, const char *data_path):
 	api_id_(api_id),
 	api_hash_(api_hash),
-	data_path_(data_path)
+	data_path_(data_path),
+	users_(3600s),
+	userFullInfos_(3600s),
+	supergroups_(3600s),
+	supergroupFullInfos_(3600s)
 {
+	static const char *const rate_env[NR_TD_RATE_CLASSES] = {
+		"TGVISD_TD_RATE_HISTORY",	/* TD_RATE_HISTORY */
+		"TGVISD_TD_RATE_CHAT",		/* TD_RATE_CHAT */
+		"TGVISD_TD_RATE_USER",		/* TD_RATE_USER */
+	};
+	const char *tmp;
+	int i;
+
+	/* Requests per second, the most the governor will ever allow. */
+	for (i = 0; i < NR_TD_RATE_CLASSES; i++) {
+		tmp = getenv(rate_env[i]);
+		if (tmp)
+			governor_.setRate(i, strtod(tmp, NULL));
+	}
+
 	auto p = td_api::make_object<td_api::setLogVerbosityLevel>(1);
 	td::ClientManager::execute(std::move(p));
 
@@ -40,27 +60,100 @@ __hot uint64_t Td::send_query(td_api::object_ptr<td_api::Function> f,
 			      function<void(Object)> handler)
 {
 	uint64_t query_id;
+	int cls;
+
+	/*
+	 * Whatever goes to Telegram's servers passes the governor, its
+	 * answer tells the governor whether we are going too fast.
+	 */
+	cls = RateGovernor::classify(*f);
+	if (cls >= 0) {
+		handler = [this, cls, h = std::move(handler)](Object obj) {
+			uint32_t secs;
+
+			secs = governor_.onResult(cls, obj.get());
+			if (unlikely(secs))
+				pr_notice("TDLib flood wait on %s requests, "
+					  "holding them for %u seconds",
+					  RateGovernor::className(cls), secs);
+			if (h)
+				h(std::move(obj));
+		};
+	}
 
 	query_id = next_query_id();
 	if (handler) {
 		handlersMutex_.lock();
+		if (unlikely(cancel_delayed_work)) {
+			handlersMutex_.unlock();
+			handler(nullptr);
+			return query_id;
+		}
 		handlers_.emplace(query_id, std::move(handler));
 		handlersMutex_.unlock();
 	}
 
+	if (cls >= 0 && !governor_.tryAcquire(cls)) {
+		governor_.enqueue(cls, {std::move(f), query_id, 0});
+		return query_id;
+	}
+
 	client_manager_->send(client_id_, query_id, std::move(f));
 	return query_id;
 }
 
 
+/*
+ * Send the requests the governor held back and now lets through.
+ */
+__hot void Td::send_queued(void)
+{
+	std::vector<RateGovernor::req> reqs;
+
+	governor_.drain(&reqs);
+	for (auto &r: reqs)
+		client_manager_->send(client_id_, r.query_id, std::move(r.f));
+}
+
+
+/*
+ * Complete every outstanding query with a NULL object.
+ */
+__cold void Td::cancel_pending(void)
+{
+	unordered_map<uint64_t, function<void(Object)>> handlers;
+
+	governor_.clear();
+	handlersMutex_.lock();
+	handlers.swap(handlers_);
+	handlersMutex_.unlock();
+
+	for (auto &it: handlers)
+		it.second(nullptr);
+}
+
+
 __hot void Td::loop(int timeout)
 {
+	double wait = timeout;
+	int64_t wake_ns;
+
 	if (unlikely(need_restart_)) {
 		restart();
 		return;
 	}
 
-	process_response(client_manager_->receive(timeout));
+	/*
+	 * Don't sleep past the moment the governor lets the next held
+	 * back request through.
+	 */
+	send_queued();
+	wake_ns = governor_.nextWakeNs();
+	if (wake_ns >= 0 && wake_ns / 1e9 < wait)
+		wait = wake_ns / 1e9;
+
+	process_response(client_manager_->receive(wait));
+	send_queued();
 }
 
 
@@ -121,8 +214,29 @@ __hot void Td::process_update(td_api::object_ptr<td_api::Object> update)
 	};
 
 	auto u_user = [this](td_api::updateUser &update) {
-		users_[update.user_->id_] = std::move(update.user_);
+		int64_t user_id = update.user_->id_;
+
+		callback.execute(update);
+		users_.put(user_id, std::move(update.user_));
+	};
+
+	auto u_user_full = [this](td_api::updateUserFullInfo &update) {
 		callback.execute(update);
+		userFullInfos_.put(update.user_id_,
+				   std::move(update.user_full_info_));
+	};
+
+	auto u_sgroup = [this](td_api::updateSupergroup &update) {
+		int64_t id = update.supergroup_->id_;
+
+		callback.execute(update);
+		supergroups_.put(id, std::move(update.supergroup_));
+	};
+
+	auto u_sgroup_full = [this](td_api::updateSupergroupFullInfo &update) {
+		callback.execute(update);
+		supergroupFullInfos_.put(update.supergroup_id_,
+					 std::move(update.supergroup_full_info_));
 	};
 
 	auto u_new_msg = [this](td_api::updateNewMessage &update) {
@@ -136,6 +250,9 @@ __hot void Td::process_update(td_api::object_ptr<td_api::Object> update)
 			u_new_chat,
 			u_chat_title,
 			u_user,
+			u_user_full,
+			u_sgroup,
+			u_sgroup_full,
 			u_new_msg,
 			[](auto &update) {}
 		)
@@ -145,6 +262,12 @@ __hot void Td::process_update(td_api::object_ptr<td_api::Object> update)
 
 __cold void Td::restart(void)
 {
+	/*
+	 * Neither the requests held back by the governor nor the ones
+	 * in flight will ever be answered by the new client, and the
+	 * query ids start over. Complete their handlers now.
+	 */
+	cancel_pending();
 	client_manager_.reset();
 	closed_ = false;
 	need_restart_ = false;
@@ -156,6 +279,10 @@ __cold void Td::restart(void)
 
 __cold void Td::check_authentication_error(Object object)
 {
+	/* Cancelled. */
+	if (!object)
+		return;
+
 	if (object->get_id() == td_api::error::ID) {
 		auto error = td::move_tl_object_as<td_api::error>(object);
 		std::cout << "Error: " << to_string(error) << std::flush;
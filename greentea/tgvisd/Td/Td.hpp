@@ -44,6 +44,8 @@
 #include <mutex>
 #include <chrono>
 #include <atomic>
+#include <future>
+#include <coroutine>
 #include <functional>
 #include <unordered_map>
 #include <condition_variable>
@@ -51,6 +53,8 @@
 #include <tgvisd/print.h>
 
 #include "Callback.hpp"
+#include "ObjectCache.hpp"
+#include "RateGovernor.hpp"
 
 namespace td_api = td::td_api;
 using Object = td_api::object_ptr<td_api::Object>;
@@ -71,6 +75,21 @@ using namespace std::chrono_literals;
 extern volatile bool cancel_delayed_work;
 
 
+/*
+ * What a TDLib query resolved to. Both are NULL if the query was
+ * cancelled or TDLib answered with an unexpected object.
+ */
+template <typename U>
+struct query_result {
+	td_api::object_ptr<U>			obj;
+	td_api::object_ptr<td_api::error>	err;
+};
+
+
+template <typename T, typename U>
+class QueryAwaiter;
+
+
 class Td
 {
 private:
@@ -85,7 +104,11 @@ private:
 
 	unordered_map<int64_t, string> chat_title_;
 	unordered_map<uint64_t, function<void(Object)>> handlers_;
-	unordered_map<int32_t, td_api::object_ptr<td_api::user>> users_;
+	ObjectCache<td_api::user> users_;
+	ObjectCache<td_api::userFullInfo> userFullInfos_;
+	ObjectCache<td_api::supergroup> supergroups_;
+	ObjectCache<td_api::supergroupFullInfo> supergroupFullInfos_;
+	RateGovernor governor_;
 
 	atomic<uint64_t> current_query_id_ = 0;
 	inline uint64_t next_query_id(void)
@@ -98,11 +121,15 @@ private:
 	mutex on_auth_update_mutex;
 	mutex handlersMutex_;
 
+	function<void(std::coroutine_handle<>)> resumer_ = nullptr;
+
 	bool closed_ = false;
 	bool need_restart_ = false;
 	bool is_authorized_ = false;
 
 	void restart(void);
+	void cancel_pending(void);
+	void send_queued(void);
 	void on_authorization_state_update(void);
 	void check_authentication_error(Object object);
 	void process_response(td::ClientManager::Response response);
@@ -121,6 +148,23 @@ public:
 	void loop(int timeout);
 	void close(void);
 
+	/*
+	 * @cb runs on the Td loop thread, keep it short.
+	 */
+	template <typename T, typename U>
+	void send_query_async(td_api::object_ptr<T> method,
+			      function<void(query_result<U>)> cb);
+
+	/*
+	 * co_await td->send_query_async<T, U>(method) suspends the
+	 * coroutine until TDLib answers, without pinning a thread.
+	 */
+	template <typename T, typename U>
+	QueryAwaiter<T, U> send_query_async(td_api::object_ptr<T> method);
+
+	template <typename T, typename U>
+	std::future<query_result<U>> send_query_future(td_api::object_ptr<T> method);
+
 	template <typename T, typename U>
 	td_api::object_ptr<U> send_query_sync(td_api::object_ptr<T> method,
 					      uint32_t timeout);
@@ -131,9 +175,31 @@ public:
 					      td_api::object_ptr<td_api::error> *err);
 
 
+	/*
+	 * Cancelling also completes every query still waiting for an
+	 * answer, so nobody stays blocked on a Td that is going away.
+	 */
 	inline void setCancelDelayedWork(bool cancel)
 	{
-		cancel_delayed_work = true;
+		cancel_delayed_work = cancel;
+		if (cancel)
+			cancel_pending();
+	}
+
+
+	/*
+	 * Where coroutines suspended in send_query_async() are resumed.
+	 * By default they are resumed right on the Td loop thread.
+	 */
+	inline void setAwaitResumer(function<void(std::coroutine_handle<>)> resumer)
+	{
+		resumer_ = std::move(resumer);
+	}
+
+
+	inline const function<void(std::coroutine_handle<>)> &getAwaitResumer(void)
+	{
+		return resumer_;
 	}
 
 
@@ -141,58 +207,179 @@ public:
 	{
 		return cancel_delayed_work;
 	}
-};
 
 
-template <typename U>
-struct query_sync_data {
-	td_api::object_ptr<td_api::error>	*err;
-	Td					*td;
-	condition_variable			cond;
-	std::mutex				mutex;
-	std::unique_lock<std::mutex>		lock;
-	td_api::object_ptr<U>			ret;
-	volatile bool				finished = false;
-
-	query_sync_data(void):
-		lock(this->mutex, std::defer_lock)
+	inline ObjectCache<td_api::user> *getUserCache(void)
+	{
+		return &users_;
+	}
+
+
+	inline ObjectCache<td_api::userFullInfo> *getUserFullInfoCache(void)
+	{
+		return &userFullInfos_;
+	}
+
+
+	inline ObjectCache<td_api::supergroup> *getSupergroupCache(void)
+	{
+		return &supergroups_;
+	}
+
+
+	inline ObjectCache<td_api::supergroupFullInfo> *getSupergroupFullInfoCache(void)
+	{
+		return &supergroupFullInfos_;
+	}
+
+
+	inline RateGovernor *getRateGovernor(void)
 	{
+		return &governor_;
 	}
 };
 
 
 template <typename U>
-static inline auto query_sync_callback(std::shared_ptr<query_sync_data<U>> data)
+static inline query_result<U> query_result_from(Object obj)
+{
+	query_result<U> ret;
+
+	/* Cancelled. */
+	if (unlikely(!obj))
+		return ret;
+
+	if (unlikely(obj->get_id() == td_api::error::ID)) {
+		ret.err = td::move_tl_object_as<td_api::error>(obj);
+		return ret;
+	}
+
+	if (unlikely(obj->get_id() != U::ID)) {
+		pr_error("Invalid object returned on send_query");
+		return ret;
+	}
+
+	ret.obj = td::move_tl_object_as<U>(obj);
+	return ret;
+}
+
+
+/*
+ * Wait up to @timeout seconds (0 means forever) for a query
+ * started with send_query_future().
+ */
+template <typename U>
+static inline td_api::object_ptr<U> query_future_get(
+					std::future<query_result<U>> &fut,
+					uint32_t timeout,
+					td_api::object_ptr<td_api::error> *err = nullptr)
 {
-	return [data](td_api::object_ptr<td_api::Object> obj) {
-		if (unlikely(!obj))
-			goto out;
-
-		data->mutex.lock();
-		if (unlikely(data->td->getCancelDelayedWork())) {
-			data->mutex.unlock();
-			return;
+	query_result<U> res;
+	uint32_t secs = 0;
+	const uint32_t warnOnSecs = 120;
+
+	if (timeout > 0) {
+		if (unlikely(fut.wait_for(std::chrono::seconds(timeout)) !=
+			     std::future_status::ready)) {
+			pr_notice("Warning: send_query_sync() reached "
+				  "timeout after %u seconds", timeout);
+			return nullptr;
+		}
+	} else {
+		while (fut.wait_for(std::chrono::seconds(warnOnSecs)) !=
+		       std::future_status::ready) {
+			secs += warnOnSecs;
+			pr_notice("Warning: send_query_sync() blocked "
+				  "for more than %u seconds", secs);
 		}
+	}
+
+	res = fut.get();
+	if (unlikely(res.err) && err) {
+		*err = std::move(res.err);
+		pr_err("Got error on query_sync_callback");
+	}
+	return std::move(res.obj);
+}
+
+
+template <typename T, typename U>
+class QueryAwaiter
+{
+private:
+	Td				*td_;
+	td_api::object_ptr<T>		method_;
+	query_result<U>			res_;
+
+public:
+	inline QueryAwaiter(Td *td, td_api::object_ptr<T> method):
+		td_(td),
+		method_(std::move(method))
+	{
+	}
+
+
+	inline bool await_ready(void) const noexcept
+	{
+		return false;
+	}
 
-		if (unlikely(obj->get_id() == td_api::error::ID)) {
-			if (data->err) {
-				*data->err = td::move_tl_object_as<td_api::error>(obj);
-				pr_err("Got error on query_sync_callback");
+
+	inline void await_suspend(std::coroutine_handle<> h)
+	{
+		function<void(std::coroutine_handle<>)> resumer;
+
+		resumer = td_->getAwaitResumer();
+		td_->send_query(std::move(method_),
+			[this, h, resumer](Object obj) {
+				/*
+				 * Don't touch @this after resuming, the
+				 * coroutine frame we live in may be gone.
+				 */
+				res_ = query_result_from<U>(std::move(obj));
+				if (resumer)
+					resumer(h);
+				else
+					h.resume();
 			}
-			goto out;
-		}
+		);
+	}
 
-		if (unlikely(obj->get_id() != U::ID)) {
-			pr_error("Invalid object returned on send_query_sync");
-			goto out;
-		}
 
-		data->ret = td::move_tl_object_as<U>(obj);
-	out:
-		data->finished = true;
-		data->mutex.unlock();
-		data->cond.notify_one();
-	};
+	inline query_result<U> await_resume(void)
+	{
+		return std::move(res_);
+	}
+};
+
+
+template <typename T, typename U>
+void Td::send_query_async(td_api::object_ptr<T> method,
+			  function<void(query_result<U>)> cb)
+{
+	send_query(std::move(method), [cb](Object obj) {
+		cb(query_result_from<U>(std::move(obj)));
+	});
+}
+
+
+template <typename T, typename U>
+QueryAwaiter<T, U> Td::send_query_async(td_api::object_ptr<T> method)
+{
+	return QueryAwaiter<T, U>(this, std::move(method));
+}
+
+
+template <typename T, typename U>
+std::future<query_result<U>> Td::send_query_future(td_api::object_ptr<T> method)
+{
+	auto p = std::make_shared<std::promise<query_result<U>>>();
+	std::future<query_result<U>> ret = p->get_future();
+
+	send_query(std::move(method), [p](Object obj) {
+		p->set_value(query_result_from<U>(std::move(obj)));
+	});
+	return ret;
 }
 
 
@@ -213,43 +400,13 @@ td_api::object_ptr<U> Td::send_query_sync(td_api::object_ptr<T> method,
 					  uint32_t timeout,
 					  td_api::object_ptr<td_api::error> *err)
 {
-	td_api::object_ptr<U> ret;
-	std::shared_ptr<query_sync_data<U>> data;
-
-	uint32_t secs = 0;
-	const uint32_t warnOnSecs = 120;
-
-	data = std::make_shared<query_sync_data<U>>();
-	data->err = err;
-	data->td  = this;
-	send_query(std::move(method), query_sync_callback<U>(data));
+	std::future<query_result<U>> fut;
 
-	data->lock.lock();
-	while (!data->finished) {
+	if (unlikely(getCancelDelayedWork()))
+		return nullptr;
 
-		if (unlikely(getCancelDelayedWork()))
-			break;
-
-		data->cond.wait_for(data->lock, 1000ms);
-
-		if (likely(data->finished))
-			break;
-
-		if (timeout > 0) {
-			if (unlikely(secs >= timeout)) {
-				pr_notice("Warning: send_query_sync() reached "
-					  "timeout after %u seconds", secs);
-				break;
-			}
-		} else {
-			if (unlikely(++secs >= warnOnSecs))
-				pr_notice("Warning: send_query_sync() blocked "
-					  "for more than %u seconds", secs);
-		}
-	}
-	ret = std::move(data->ret);
-	data->lock.unlock();
-	return ret;
+	fut = send_query_future<T, U>(std::move(method));
+	return query_future_get<U>(fut, timeout, err);
 }
 
 
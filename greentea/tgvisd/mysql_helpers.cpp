@@ -29,3 +29,9 @@ void mysql_handle_prepare_err(mysql::MySQL *db, mysql::MySQLStmt *stmt)
 
 	pr_err("prepare(): (%d) %s", err_ret, err_str);
 }
+
+void mysql_handle_stmt_err(mysql::StatementBase *st)
+{
+	pr_err("%s(): (%d) %s", st->getErrFunc(), st->getErrno(),
+	       st->getError());
+}
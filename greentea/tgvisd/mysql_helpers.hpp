@@ -4,8 +4,10 @@
 #define TGVISD__MYSQL_HELPER_H
 
 #include <mysql/MySQL.hpp>
+#include <mysql/Statement.hpp>
 
 void mysql_handle_stmt_err(const char *stmtErrFunc, mysql::MySQLStmt *stmt);
 void mysql_handle_prepare_err(mysql::MySQL *db, mysql::MySQLStmt *stmt);
+void mysql_handle_stmt_err(mysql::StatementBase *st);
 
 #endif /* #ifndef TGVISD__MYSQL_HELPER_H */